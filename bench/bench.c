@@ -0,0 +1,963 @@
+/*
+ * MiniTox - Microbenchmarks for client hot paths
+ *
+ * minitox.c is compiled into this file(with its main renamed) and linked
+ * against the mock toxcore, so callbacks can be driven without a network.
+ * Allocations are counted by wrapping malloc & co at link time, see Makefile.
+ */
+
+#define main minitox_main
+#include "../minitox.c"
+#undef main
+
+#include <inttypes.h>
+
+#include "mock_tox.h"
+#include "train.c"
+
+/*******************************************************************************
+ *
+ * Allocation Counting
+ *
+ ******************************************************************************/
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+struct AllocStats {
+    uint64_t count;
+    uint64_t bytes;
+} alloc_stats;
+
+void *__wrap_malloc(size_t size) {
+    alloc_stats.count++;
+    alloc_stats.bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    alloc_stats.count++;
+    alloc_stats.bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_stats.count++;
+    alloc_stats.bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+    alloc_stats.count++;
+    alloc_stats.bytes += strlen(s) + 1;
+    return __real_strdup(s);
+}
+
+/*******************************************************************************
+ *
+ * Harness
+ *
+ ******************************************************************************/
+
+typedef void BenchFunc(uint64_t n, size_t param);
+typedef void BenchSetup(size_t param);
+
+struct Benchmark {
+    const char *name;
+    BenchFunc *fn;
+    BenchSetup *setup;  // run before timing, may be NULL
+    size_t param;       // list size etc, 0 if unused
+};
+
+#define BENCH_MAX_RUNS 64
+
+struct BenchResult {
+    char name[64];
+    uint64_t iterations;       // per run
+    int runs;
+    double samples[BENCH_MAX_RUNS];  // ns/op of every run
+    double ns_per_op;          // median of samples
+    double mad;                // median absolute deviation of samples
+    double allocs_per_op;
+    double bytes_per_op;
+    char note[64];             // extra numbers a benchmark reports, e.g. compression ratio
+};
+
+volatile uintptr_t bench_sink; // keeps results alive
+
+double bench_min_time = 0.2;  // seconds per run
+
+char bench_note[64];  // set by a benchmark, copied into its result
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+int _cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double median(const double *v, int count) {
+    double sorted[BENCH_MAX_RUNS];
+    memcpy(sorted, v, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), _cmp_double);
+    return count % 2 ? sorted[count/2] : (sorted[count/2 - 1] + sorted[count/2]) / 2;
+}
+
+double median_abs_dev(const double *v, int count, double med) {
+    double dev[BENCH_MAX_RUNS];
+    for (int i = 0; i < count; i++) dev[i] = v[i] > med ? v[i] - med : med - v[i];
+    return median(dev, count);
+}
+
+uint64_t time_benchmark(const struct Benchmark *bm, uint64_t n) {
+    uint64_t t0 = now_ns();
+    bm->fn(n, bm->param);
+    return now_ns() - t0;
+}
+
+// grow n until one run takes at least bench_min_time, like go's testing.B,
+// then repeat with the same n for the remaining runs.
+void run_benchmark(const struct Benchmark *bm, int runs, struct BenchResult *res) {
+    if (bm->param) {
+        snprintf(res->name, sizeof(res->name), "%s/%zu", bm->name, bm->param);
+    } else {
+        snprintf(res->name, sizeof(res->name), "%s", bm->name);
+    }
+    bench_note[0] = '\0';
+    if (bm->setup) bm->setup(bm->param);
+
+    uint64_t n = 1, elapsed;
+    struct AllocStats before;
+    for (;;) {
+        before = alloc_stats;
+        elapsed = time_benchmark(bm, n);
+
+        if (elapsed >= bench_min_time * 1e9 || n >= 1000000000u) break;
+
+        uint64_t next = elapsed ? n * (bench_min_time * 1e9 * 1.2 / elapsed) : n * 100;
+        if (next > n * 100) next = n * 100;
+        n = next > n ? next : n + 1;
+    }
+
+    res->iterations = n;
+    res->allocs_per_op = (double)(alloc_stats.count - before.count) / n;
+    res->bytes_per_op = (double)(alloc_stats.bytes - before.bytes) / n;
+
+    res->runs = runs;
+    res->samples[0] = (double)elapsed / n;
+    for (int i = 1; i < runs; i++) {
+        res->samples[i] = (double)time_benchmark(bm, n) / n;
+    }
+    res->ns_per_op = median(res->samples, runs);
+    res->mad = median_abs_dev(res->samples, runs, res->ns_per_op);
+    snprintf(res->note, sizeof(res->note), "%s", bench_note);
+}
+
+/*******************************************************************************
+ *
+ * Baseline
+ *
+ ******************************************************************************/
+
+// A baseline file keeps results of previous commits, one line per benchmark:
+//
+//     <commit> <name> <runs> <median ns/op> <mad ns/op>
+//
+// Lines are only ever appended, the last commit in the file is the default
+// one to compare against.
+
+#define BASELINE_MAX 256
+
+struct BaselineEntry {
+    char commit[64];
+    char name[64];
+    int runs;
+    double median;
+    double mad;
+};
+
+double regress_threshold = 0.10;  // relative slowdown worth reporting
+
+bool save_baseline(const char *filename, const char *commit, struct BenchResult *results, size_t count) {
+    FILE *fp = fopen(filename, "a");
+    if (!fp) return false;
+    for (size_t i = 0; i < count; i++) {
+        struct BenchResult *r = &results[i];
+        fprintf(fp, "%s %s %d %.3f %.3f\n", commit, r->name, r->runs, r->ns_per_op, r->mad);
+    }
+    return fclose(fp) == 0;
+}
+
+// load the entries of `commit`, or of the last commit in the file if it's NULL.
+size_t load_baseline(const char *filename, const char *commit, struct BaselineEntry *entries) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) return 0;
+
+    char last[64] = "";
+    if (!commit) {
+        struct BaselineEntry e;
+        while (fscanf(fp, "%63s %63s %d %lf %lf", e.commit, e.name, &e.runs, &e.median, &e.mad) == 5) {
+            strcpy(last, e.commit);
+        }
+        commit = last;
+        rewind(fp);
+    }
+
+    size_t count = 0;
+    struct BaselineEntry *e = entries;
+    while (count < BASELINE_MAX && fscanf(fp, "%63s %63s %d %lf %lf", e->commit, e->name, &e->runs, &e->median, &e->mad) == 5) {
+        if (strcmp(e->commit, commit) != 0) continue;
+        // a commit benchmarked twice: the later result wins.
+        size_t j = 0;
+        while (j < count && strcmp(entries[j].name, e->name) != 0) j++;
+        if (j < count) {
+            entries[j] = *e;
+        } else {
+            e = &entries[++count];
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+// A slowdown is significant if it's larger than the threshold, and also
+// clearly outside the noise of both sides: 3 scaled MADs(~3 sigma).
+int compare_baseline(struct BaselineEntry *base, size_t nbase, struct BenchResult *results, size_t count) {
+    int regressions = 0;
+    printf("%-36s %12s %12s %9s  %s\n", "benchmark", "base ns/op", "ns/op", "delta", "verdict");
+    for (size_t i = 0; i < count; i++) {
+        struct BenchResult *r = &results[i];
+        struct BaselineEntry *b = NULL;
+        for (size_t j = 0; j < nbase && !b; j++) {
+            if (strcmp(base[j].name, r->name) == 0) b = &base[j];
+        }
+        if (!b) {
+            printf("%-36s %12s %12.1f %9s  %s\n", r->name, "-", r->ns_per_op, "-", "new");
+            continue;
+        }
+
+        double delta = r->ns_per_op - b->median;
+        double noise = 3 * 1.4826 * (r->mad + b->mad);
+        double limit = regress_threshold * b->median;
+        const char *verdict = "ok";
+        if (delta > limit && delta > noise) {
+            verdict = "SLOWER";
+            regressions++;
+        } else if (-delta > limit && -delta > noise) {
+            verdict = "faster";
+        }
+        printf("%-36s %12.1f %12.1f %+8.1f%%  %s\n", r->name, b->median, r->ns_per_op,
+               b->median > 0 ? 100 * delta / b->median : 0, verdict);
+    }
+    return regressions;
+}
+
+/*******************************************************************************
+ *
+ * Fixtures
+ *
+ ******************************************************************************/
+
+const char *bench_tox_id = "A6A1F4F72D8E4A2A0E6C3F3A1E8D8B17C0D2E5F6A7B8C9D0E1F2A3B4C5D6E7F8091AB3C4D5E6";
+
+const char *bench_msg = "Hi there, this is a fairly ordinary chat message of a typical length.";
+
+void reset_contacts(void) {
+    while (friends) delfriend(friends->friend_num);
+    while (groups) delgroup(groups->group_num);
+    tox_kill(tox);
+    tox = tox_new(NULL, NULL);
+}
+
+void setup_friends(size_t count) {
+    reset_contacts();
+    char name[32];
+    for (size_t i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "friend-%zu", i);
+        struct Friend *f = addfriend(mock_tox_add_friend(tox, name, "busy"));
+        f->name = strdup(name);
+        f->status_message = strdup("busy");
+    }
+}
+
+void setup_groups(size_t count) {
+    reset_contacts();
+    for (size_t i = 0; i < count; i++) {
+        struct Group *cf = addgroup(mock_tox_add_conference(tox, "group", 8));
+        cf->title = strdup("group");
+    }
+}
+
+void setup_group_peers(size_t count) {
+    reset_contacts();
+    addgroup(mock_tox_add_conference(tox, "group", count));
+}
+
+// random lowercase keywords of 5~9 letters, the same ones every run.
+void setup_triggers(size_t count) {
+    while (triggers) deltrigger(triggers->id);
+    ac_free(&trigger_ac);
+    uint32_t seed = 42;
+    char keyword[16];
+    for (size_t i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        int len = 5 + (seed >> 16) % 5;
+        for (int j = 0; j < len; j++) {
+            seed = seed * 1103515245 + 12345;
+            keyword[j] = 'a' + (seed >> 16) % 26;
+        }
+        keyword[len] = '\0';
+        addtrigger(keyword, TRIGGER_NOTIFY, "bench");
+    }
+    triggers_match(0, "friend-0", "", 0); // build it outside of timing
+}
+
+// 1000 triggers, and `count` more on every 4 letters of bench_msg, which all hit it.
+void setup_trigger_hits(size_t count) {
+    setup_triggers(1000);
+    char keyword[5];
+    size_t len = strlen(bench_msg);
+    for (size_t i = 0; i < count; i++) {
+        snprintf(keyword, sizeof(keyword), "%s", bench_msg + i % (len - 3));
+        addtrigger(keyword, TRIGGER_NOTIFY, "bench");
+    }
+    triggers_match(0, "friend-0", "", 0);
+}
+
+const char *bench_announcement = "Maintenance tonight: the relay at node-3 goes down from 23:00 to 23:30 UTC. "
+                                 "Messages sent meanwhile are delivered afterwards, nothing to do on your side. Thanks!";
+
+void broadcast(void) {
+    size_t len = strlen(bench_announcement);
+    for (struct Friend *f = friends; f; f = f->next) {
+        send_message(GEN_INDEX(f->friend_num, TALK_TYPE_FRIEND), bench_announcement, len, view);
+        view->out.len = 0;
+    }
+}
+
+// `count` friends, and how much memory the bodies of one broadcast to all of them take.
+void setup_broadcast(size_t count) {
+    setup_friends(count);
+    struct BodyStore before = body_store;
+    broadcast();
+    snprintf(bench_note, sizeof(bench_note), "bodies %.1fKB for %.1fKB of copies",
+             (body_store.bytes - before.bytes) / 1024.0, (body_store.text_bytes - before.text_bytes) / 1024.0);
+}
+
+// a pasted log of `size` bytes, the same one every run.
+char *bench_paste = NULL;
+size_t bench_paste_len = 0;
+uint8_t *bench_packed = NULL;
+size_t bench_packed_len = 0;
+
+void setup_paste(size_t size) {
+    static const char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+    static const char *status[] = {"ok", "ok", "ok", "retry", "timeout"};
+    free(bench_paste);
+    bench_paste = malloc(size + 128);
+    bench_paste_len = 0;
+    uint32_t seed = 42;
+    while (bench_paste_len < size) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 8;
+        bench_paste_len += sprintf(bench_paste + bench_paste_len,
+                                   "2026-10-18 12:%02u:%02u %-5s worker-%u: processed request id=%u in %u ms, status=%s\n",
+                                   r % 60, (r >> 6) % 60, levels[r % 6], (r >> 3) % 8, r % 100000, (r >> 12) % 500,
+                                   status[(r >> 5) % 5]);
+    }
+    bench_paste_len = size;
+
+    free(bench_packed);
+    bench_packed = malloc(lz_compress_bound(size));
+    bench_packed_len = lz_compress((uint8_t *)bench_paste, size, bench_packed);
+    snprintf(bench_note, sizeof(bench_note), "ratio %.2fx", (double)size / bench_packed_len);
+}
+
+// `count` items of history, lines of a pasted log.
+struct History bench_cold_hist;
+
+void setup_cold_hist(size_t count) {
+    freehist(&bench_cold_hist);
+    setup_paste(count * 128);
+    char *line = bench_paste;
+    for (size_t i = 0; i < count; i++) {
+        char *eol = strchr(line, '\n');
+        addhist(&bench_cold_hist, 1000 + i, i % 3 == 0, "friend-0", line, eol - line);
+        line = eol + 1;
+    }
+
+    // see what it takes once the compressor is done
+    freeze_hist(&bench_cold_hist);
+    bool idle = false;
+    while (!idle) {
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&compressor.lock);
+        idle = compressor.queue == NULL;
+        pthread_mutex_unlock(&compressor.lock);
+    }
+    for (struct HistBlock *b = bench_cold_hist.blocks; b; b = b->next) claim_block(b);
+    size_t before, after;
+    hist_block_bytes(&bench_cold_hist, &before, &after);
+    snprintf(bench_note, sizeof(bench_note), "%zu items %.1fKB -> %.1fKB",
+             bench_cold_hist.packed_count, before / 1024.0, after / 1024.0);
+    thaw_hist(&bench_cold_hist);
+}
+
+// a friend which is another minitox, or not, which gets a paste back for every one sent.
+void setup_paste_friend(size_t size, bool is_minitox) {
+    setup_friends(1);
+    tox_callback_friend_message(tox, friend_message_cb);
+    tox_callback_friend_lossless_packet(tox, friend_lossless_packet_cb);
+    tox_callback_friend_connection_status(tox, friend_connection_status_cb);
+    mock_tox_set_loopback(tox, true);
+    if (is_minitox) {
+        mock_tox_set_friend_connection(tox, 0, TOX_CONNECTION_NONE);
+        mock_tox_set_friend_connection(tox, 0, TOX_CONNECTION_UDP);  // exchanges caps
+    }
+    setup_paste(size);
+}
+
+void setup_large_message(size_t size) {
+    setup_paste_friend(size, true);
+}
+
+void setup_split_message(size_t size) {
+    setup_paste_friend(size, false);
+}
+
+// a message of `size` bytes as it arrives: in pieces or packets, ready to be fed to callbacks.
+uint8_t (*bench_pieces)[TOX_MAX_CUSTOM_PACKET_SIZE] = NULL;
+size_t *bench_piece_lens = NULL;
+size_t bench_piece_count = 0;
+
+uint8_t *bench_add_piece(size_t len) {
+    bench_pieces = realloc(bench_pieces, (bench_piece_count + 1) * sizeof(*bench_pieces));
+    bench_piece_lens = realloc(bench_piece_lens, (bench_piece_count + 1) * sizeof(size_t));
+    bench_piece_lens[bench_piece_count] = len;
+    return bench_pieces[bench_piece_count++];
+}
+
+void setup_receive_message(size_t size) {
+    setup_friends(1);
+    setup_paste(size);
+    bench_piece_count = 0;
+    for (size_t off = 0, n; off < size; off += n) {
+        n = split_message(bench_paste + off, size - off, true);  // as from another minitox
+        bool more = off + n < size;
+        uint8_t *piece = bench_add_piece(n + (more ? SPLIT_MARK_LEN : 0));
+        memcpy(piece, bench_paste + off, n);
+        if (more) memcpy(piece + n, SPLIT_MARK, SPLIT_MARK_LEN);
+    }
+}
+
+void setup_receive_large_message(size_t size) {
+    setup_friends(1);
+    setup_paste(size);
+    bench_piece_count = 0;
+    uint8_t *start = bench_add_piece(LARGE_START_SIZE);
+    start[0] = PACKET_LARGE_START;
+    put32(start + 1, 1);
+    put32(start + 5, size);
+    put32(start + 9, bench_packed_len);
+    start[13] = LARGE_CODEC_LZ;
+    size_t max = TOX_MAX_CUSTOM_PACKET_SIZE - LARGE_DATA_HEADER_SIZE;
+    for (size_t off = 0, n; off < bench_packed_len; off += n) {
+        n = bench_packed_len - off < max ? bench_packed_len - off : max;
+        uint8_t *data = bench_add_piece(LARGE_DATA_HEADER_SIZE + n);
+        data[0] = PACKET_LARGE_DATA;
+        put32(data + 1, 1);
+        memcpy(data + LARGE_DATA_HEADER_SIZE, bench_packed + off, n);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Benchmarks
+ *
+ ******************************************************************************/
+
+// the sscanf/sprintf based codec minitox used before, kept for comparison.
+uint8_t *legacy_hex2bin(const char *hex) {
+    size_t len = strlen(hex) / 2;
+    uint8_t *bin = malloc(len);
+    for (size_t i = 0; i < len; ++i, hex += 2) {
+        sscanf(hex, "%2hhx", &bin[i]);
+    }
+    return bin;
+}
+
+char *legacy_bin2hex(const uint8_t *bin, size_t length) {
+    char *hex = malloc(2*length + 1);
+    for (size_t i = 0; i < length; i++) {
+        sprintf(hex + 2*i, "%02X", bin[i]);
+    }
+    return hex;
+}
+
+void bench_hex2bin(uint64_t n, size_t param) {
+    uint8_t bin[TOX_ADDRESS_SIZE];
+    size_t len = strlen(bench_tox_id);
+    for (uint64_t i = 0; i < n; i++) {
+        bench_sink = hex2bin(bin, bench_tox_id, len);
+        bench_sink = bin[i % TOX_ADDRESS_SIZE];
+    }
+}
+
+void bench_hex2bin_legacy(uint64_t n, size_t param) {
+    for (uint64_t i = 0; i < n; i++) {
+        uint8_t *bin = legacy_hex2bin(bench_tox_id);
+        bench_sink = bin[i % TOX_ADDRESS_SIZE];
+        free(bin);
+    }
+}
+
+void bench_bin2hex(uint64_t n, size_t param) {
+    uint8_t bin[TOX_ADDRESS_SIZE];
+    char hex[TOX_ADDRESS_SIZE * 2 + 1];
+    for (int i = 0; i < TOX_ADDRESS_SIZE; i++) bin[i] = i * 37;
+    for (uint64_t i = 0; i < n; i++) {
+        bin2hex(hex, bin, sizeof(bin));
+        bench_sink = hex[i % (2 * TOX_ADDRESS_SIZE)];
+    }
+}
+
+void bench_bin2hex_legacy(uint64_t n, size_t param) {
+    uint8_t bin[TOX_ADDRESS_SIZE];
+    for (int i = 0; i < TOX_ADDRESS_SIZE; i++) bin[i] = i * 37;
+    for (uint64_t i = 0; i < n; i++) {
+        char *hex = legacy_bin2hex(bin, sizeof(bin));
+        bench_sink = hex[i % (2 * TOX_ADDRESS_SIZE)];
+        free(hex);
+    }
+}
+
+// the history is kept across runs, so with `history_size` set this measures the
+// steady state once it's full.
+struct History bench_hist;
+
+void bench_addhist(uint64_t n, size_t param) {
+    size_t len = strlen(bench_msg);
+    time_t t = time(NULL);
+    config.history_size = 1000;
+    for (uint64_t i = 0; i < n; i++) {
+        bench_sink = (uintptr_t)addhist(&bench_hist, t, false, "friend-0", bench_msg, len);
+    }
+    config.history_size = MAX_CHAT_HIST_COUNT;
+}
+
+void bench_print_hist(uint64_t n, size_t param) {
+    struct History hist = {0};
+    struct ChatHist *h = addhist(&hist, time(NULL), false, "friend-0", bench_msg, strlen(bench_msg));
+    for (uint64_t i = 0; i < n; i++) {
+        print_hist(h);
+        view->out.len = 0;  // discard instead of writing to the terminal
+    }
+    freehist(&hist);
+}
+
+void bench_json_event(uint64_t n, size_t param) {
+    struct History hist = {0};
+    struct ChatHist *h = addhist(&hist, time(NULL), false, "friend-0", "say \"hi\"\tto\\everyone\n", 24);
+    struct Event e = {EVENT_GROUP_MESSAGE, h->time, GEN_INDEX(3, TALK_TYPE_GROUP)};
+    e.peer = 7;
+    e.name = "friend-0";
+    e.text = h->msg;
+    e.text_len = h->msg_len;
+    e.hist = h;
+    for (uint64_t i = 0; i < n; i++) {
+        json_event(&e);
+        view->out.len = 0;
+    }
+    freehist(&hist);
+}
+
+// what a callback pays for `--log`, the writer thread writes to /dev/null.
+void bench_log_event(uint64_t n, size_t param) {
+    if (!eventlog.started) {
+        open_eventlog("/dev/null");
+        start_eventlog();
+    }
+    struct History hist = {0};
+    struct ChatHist *h = addhist(&hist, time(NULL), false, "friend-0", bench_msg, strlen(bench_msg));
+    struct Event e = {EVENT_FRIEND_MESSAGE, h->time, GEN_INDEX(0, TALK_TYPE_FRIEND)};
+    e.name = "friend-0";
+    e.text = h->msg;
+    e.text_len = h->msg_len;
+    e.hist = h;
+    uint64_t dropped = eventlog.dropped;
+    for (uint64_t i = 0; i < n; i++) {
+        log_event(&e);
+    }
+    freehist(&hist);
+    snprintf(bench_note, sizeof(bench_note), "dropped %.2f%%", 100.0 * (eventlog.dropped - dropped) / n);
+}
+
+void bench_getftime(uint64_t n, size_t param) {
+    for (uint64_t i = 0; i < n; i++) {
+        bench_sink = (uintptr_t)getftime();
+    }
+}
+
+void bench_poptok(uint64_t n, size_t param) {
+    static const char cmd[] = "invite 12   34\tsome trailing words of the command line";
+    char line[sizeof(cmd)];
+    for (uint64_t i = 0; i < n; i++) {
+        memcpy(line, cmd, sizeof(cmd));
+        char *l = line;
+        while (l != NULL) bench_sink = (uintptr_t)poptok(&l);
+    }
+}
+
+void bench_arepl_readline(uint64_t n, size_t param) {
+    static const char input[] = "hello, this is a line typed at the prompt\n";
+    char linebuf[LINE_MAX_SIZE];
+    char out[LINE_MAX_SIZE];
+    struct AsyncREPL arepl = {linebuf, NULL, sizeof(linebuf), 0, 0, 0};
+    for (uint64_t i = 0; i < n; i++) {
+        for (const char *c = input; *c; c++) {
+            bench_sink = arepl_readline(&arepl, *c, out, sizeof(out));
+        }
+    }
+}
+
+void bench_getfriend(uint64_t n, size_t count) {
+    for (uint64_t i = 0; i < n; i++) {
+        bench_sink = (uintptr_t)getfriend(i % count);
+    }
+}
+
+void bench_getgroup(uint64_t n, size_t count) {
+    for (uint64_t i = 0; i < n; i++) {
+        bench_sink = (uintptr_t)getgroup(i % count);
+    }
+}
+
+void bench_group_peer_list_changed(uint64_t n, size_t count) {
+    uint32_t group_num = groups->group_num;
+    for (uint64_t i = 0; i < n; i++) {
+        group_peer_list_changed_cb(tox, group_num, NULL);
+    }
+    bench_sink = groups->peers_count;
+}
+
+void bench_triggers_match(uint64_t n, size_t count) {
+    size_t len = strlen(bench_msg);
+    for (uint64_t i = 0; i < n; i++) {
+        triggers_match(0, "friend-0", bench_msg, len);
+        view->out.len = 0;
+    }
+}
+
+void bench_trigger_hits(uint64_t n, size_t count) {
+    uint64_t before = 0, after = 0;
+    for (struct Trigger *t = triggers; t; t = t->next) before += t->hits;
+    bench_triggers_match(n, count);
+    for (struct Trigger *t = triggers; t; t = t->next) after += t->hits;
+    snprintf(bench_note, sizeof(bench_note), "%.1f actions/msg", (double)(after - before) / n);
+}
+
+// `/trigger` then `/untrigger`, each building the automaton again.
+void bench_trigger_churn(uint64_t n, size_t count) {
+    char keyword[32];
+    for (uint64_t i = 0; i < n; i++) {
+        snprintf(keyword, sizeof(keyword), "churn%llu", (unsigned long long)i);
+        struct Trigger *t = addtrigger(keyword, TRIGGER_NOTIFY, "bench");
+        ac_build(&trigger_ac);
+        deltrigger(t->id);
+        ac_build(&trigger_ac);
+    }
+    snprintf(bench_note, sizeof(bench_note), "%u nodes", trigger_ac.nnodes);
+}
+
+void bench_trigger_build(uint64_t n, size_t count) {
+    for (uint64_t i = 0; i < n; i++) {
+        ac_build(&trigger_ac);
+    }
+}
+
+void bench_lz_compress(uint64_t n, size_t size) {
+    uint8_t *out = malloc(lz_compress_bound(size));
+    for (uint64_t i = 0; i < n; i++) {
+        bench_sink = lz_compress((uint8_t *)bench_paste, size, out);
+    }
+    free(out);
+}
+
+void bench_lz_decompress(uint64_t n, size_t size) {
+    uint8_t *out = malloc(size);
+    for (uint64_t i = 0; i < n; i++) {
+        bench_sink = lz_decompress(bench_packed, bench_packed_len, out, size);
+    }
+    free(out);
+}
+
+void bench_broadcast(uint64_t n, size_t count) {
+    for (uint64_t i = 0; i < n; i++) {
+        broadcast();
+    }
+}
+
+// what the main thread spends, the compression is left to the compressor thread.
+void bench_freeze_thaw_hist(uint64_t n, size_t count) {
+    for (uint64_t i = 0; i < n; i++) {
+        freeze_hist(&bench_cold_hist);
+        thaw_hist(&bench_cold_hist);
+    }
+}
+
+// a file transfer hogging the disk meanwhile, writing and syncing 4MB chunks.
+volatile bool bench_transfer_stop;
+
+void *bench_transfer_main(void *arg) {
+    size_t size = 4 * 1024 * 1024;
+    char *chunk = calloc(1, size);
+    int fd = open("minitox_bench.transfer", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    while (fd != -1 && !bench_transfer_stop) {
+        if (write(fd, chunk, size) != (ssize_t)size) break;
+        fsync(fd);
+        lseek(fd, 0, SEEK_SET);
+    }
+    if (fd != -1) close(fd);
+    unlink("minitox_bench.transfer");
+    free(chunk);
+    return NULL;
+}
+
+// what the main thread spends saving a file of `size` bytes, with a transfer going on.
+void bench_save(uint64_t n, size_t size, bool blocking) {
+    struct FileWrite fw = {.path = "minitox_bench.save", .tmp_path = "minitox_bench.save.tmp"};
+    pthread_t transfer;
+    bench_note[0] = '\0';
+    bench_transfer_stop = false;
+    pthread_create(&transfer, NULL, bench_transfer_main, NULL);
+    for (uint64_t i = 0; i < n; i++) {
+        char *buf = malloc(size);
+        memcpy(buf, bench_paste, size);
+        if (blocking) {
+            write_file_now(&fw, buf, size);
+            free(buf);
+        } else {
+            write_file(&fw, buf, size);
+        }
+        poll_file_writes(false);
+    }
+    flush_file_writes();
+    bench_transfer_stop = true;
+    pthread_join(transfer, NULL);
+    unlink(fw.path);
+#ifdef MINITOX_IO_URING
+    if (!blocking) snprintf(bench_note, sizeof(bench_note), uring.unusable ? "io_uring unavailable" : "io_uring");
+#endif
+}
+
+void bench_save_file(uint64_t n, size_t size) {
+    bench_save(n, size, false);
+}
+
+void bench_save_file_blocking(uint64_t n, size_t size) {
+    bench_save(n, size, true);
+}
+
+// receive a message, and see how many times its bytes are copied on the way into history.
+void bench_receive(uint64_t n, size_t size, bool large) {
+    uint64_t copied = body_store.copied;
+    for (uint64_t i = 0; i < n; i++) {
+        if (!large) memcpy(bench_pieces[0], &i, sizeof(i));  // a different message every time
+        for (size_t j = 0; j < bench_piece_count; j++) {
+            if (large) friend_lossless_packet_cb(tox, 0, bench_pieces[j], bench_piece_lens[j], NULL);
+            else friend_message_cb(tox, 0, TOX_MESSAGE_TYPE_NORMAL, bench_pieces[j], bench_piece_lens[j], NULL);
+        }
+        view->out.len = 0;
+    }
+    snprintf(bench_note, sizeof(bench_note), "copied %.1fB/msg",
+             (double)(body_store.copied - copied) / n);
+}
+
+void bench_receive_message(uint64_t n, size_t size) {
+    bench_receive(n, size, false);
+}
+
+void bench_receive_large_message(uint64_t n, size_t size) {
+    bench_receive(n, size, true);
+}
+
+// send a paste and receive it back: everything but the network.
+void bench_paste_roundtrip(uint64_t n, size_t size) {
+    uint32_t contact = GEN_INDEX(0, TALK_TYPE_FRIEND);
+    uint64_t sent = mock_tox_sent_bytes(tox);
+    for (uint64_t i = 0; i < n; i++) {
+        send_message(contact, bench_paste, size, view);
+        freehist(&friends->hist);
+        view->out.len = 0;
+    }
+    double wire = (double)(mock_tox_sent_bytes(tox) - sent) / n;
+    snprintf(bench_note, sizeof(bench_note), "wire %.1fKB, ratio %.2fx", wire / 1024, size / wire);
+}
+
+struct Benchmark benchmarks[] = {
+    {"hex2bin", bench_hex2bin},
+    {"hex2bin_legacy", bench_hex2bin_legacy},
+    {"bin2hex", bench_bin2hex},
+    {"bin2hex_legacy", bench_bin2hex_legacy},
+    {"addhist", bench_addhist},
+    {"print_hist", bench_print_hist},
+    {"json_event", bench_json_event},
+    {"log_event", bench_log_event},
+    {"getftime", bench_getftime},
+    {"poptok", bench_poptok},
+    {"arepl_readline", bench_arepl_readline},
+    {"getfriend", bench_getfriend, setup_friends, 10},
+    {"getfriend", bench_getfriend, setup_friends, 100},
+    {"getfriend", bench_getfriend, setup_friends, 1000},
+    {"getfriend", bench_getfriend, setup_friends, 10000},
+    {"getgroup", bench_getgroup, setup_groups, 10},
+    {"getgroup", bench_getgroup, setup_groups, 100},
+    {"getgroup", bench_getgroup, setup_groups, 1000},
+    {"group_peer_list_changed_cb", bench_group_peer_list_changed, setup_group_peers, 10},
+    {"group_peer_list_changed_cb", bench_group_peer_list_changed, setup_group_peers, 100},
+    {"group_peer_list_changed_cb", bench_group_peer_list_changed, setup_group_peers, 1000},
+    {"triggers_match", bench_triggers_match, setup_triggers, 10},
+    {"triggers_match", bench_triggers_match, setup_triggers, 1000},
+    {"triggers_match", bench_triggers_match, setup_triggers, 10000},
+    {"trigger_hits", bench_trigger_hits, setup_trigger_hits, 64},
+    {"trigger_build", bench_trigger_build, setup_triggers, 10000},
+    {"trigger_churn", bench_trigger_churn, setup_triggers, 10000},
+    {"broadcast", bench_broadcast, setup_broadcast, 3000},
+    {"lz_compress", bench_lz_compress, setup_paste, 100 * 1024},
+    {"lz_decompress", bench_lz_decompress, setup_paste, 100 * 1024},
+    {"freeze_thaw_hist", bench_freeze_thaw_hist, setup_cold_hist, 1000},
+    {"large_message", bench_paste_roundtrip, setup_large_message, 100 * 1024},
+    {"split_message", bench_paste_roundtrip, setup_split_message, 100 * 1024},
+    {"receive_message", bench_receive_message, setup_receive_message, 100},
+    {"receive_message", bench_receive_message, setup_receive_message, 10 * 1024},
+    {"receive_large_message", bench_receive_large_message, setup_receive_large_message, 100 * 1024},
+    {"save_file", bench_save_file, setup_paste, 1024 * 1024},
+    {"save_file_blocking", bench_save_file_blocking, setup_paste, 1024 * 1024},
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks)/sizeof(struct Benchmark))
+
+/*******************************************************************************
+ *
+ * Main
+ *
+ ******************************************************************************/
+
+void print_text(struct BenchResult *results, size_t count) {
+    printf("%-36s %12s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+    for (size_t i = 0; i < count; i++) {
+        struct BenchResult *r = &results[i];
+        printf("%-36s %12" PRIu64 " %12.1f %12.2f %12.1f",
+               r->name, r->iterations, r->ns_per_op, r->allocs_per_op, r->bytes_per_op);
+        if (r->runs > 1) printf("  (mad %.1f)", r->mad);
+        if (r->note[0]) printf("  %s", r->note);
+        printf("\n");
+    }
+}
+
+void print_json(struct BenchResult *results, size_t count) {
+    printf("{\"benchmarks\":[");
+    for (size_t i = 0; i < count; i++) {
+        struct BenchResult *r = &results[i];
+        printf("%s\n{\"name\":\"%s\",\"iterations\":%" PRIu64 ",\"runs\":%d,\"ns_per_op\":%.3f,"
+               "\"mad_ns\":%.3f,\"allocs_per_op\":%.3f,\"bytes_per_op\":%.3f,\"note\":\"%s\"}",
+               i ? "," : "", r->name, r->iterations, r->runs, r->ns_per_op, r->mad,
+               r->allocs_per_op, r->bytes_per_op, r->note);
+    }
+    printf("\n]}\n");
+}
+
+void usage(void) {
+    fputs("Usage: minitox_bench [--json] [--time <seconds>] [--runs <n>] [<name_filter>]\n", stderr);
+    fputs("                     [--save <baseline_file> --commit <id>]\n", stderr);
+    fputs("                     [--compare <baseline_file> [--against <id>] [--threshold <percent>]]\n", stderr);
+    fputs("       minitox_bench --train < bench/train.txt  (the PGO training session, see Makefile)\n", stderr);
+}
+
+int main(int argc, char **argv) {
+    bool json = false;
+    const char *filter = NULL;
+    int runs = 1;
+    const char *save_file = NULL, *compare_file = NULL;
+    const char *commit = NULL, *against = NULL;
+    train_active = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--train") == 0) {
+            // run minitox itself, as minitox_train does
+            train_active = true;
+            char *args[] = {argv[0], "--json", NULL};
+            return minitox_main(2, args);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "--time") == 0 && has_value) {
+            bench_min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--runs") == 0 && has_value) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--save") == 0 && has_value) {
+            save_file = argv[++i];
+        } else if (strcmp(argv[i], "--commit") == 0 && has_value) {
+            commit = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && has_value) {
+            compare_file = argv[++i];
+        } else if (strcmp(argv[i], "--against") == 0 && has_value) {
+            against = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && has_value) {
+            regress_threshold = atof(argv[++i]) / 100;
+        } else if (argv[i][0] != '-' && !filter) {
+            filter = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (runs < 1 || runs > BENCH_MAX_RUNS || (save_file && !commit)) {
+        usage();
+        return 1;
+    }
+
+    // load it before running, so that a missing baseline fails fast.
+    struct BaselineEntry base[BASELINE_MAX + 1];
+    size_t nbase = 0;
+    if (compare_file) {
+        nbase = load_baseline(compare_file, against, base);
+        if (nbase == 0) {
+            fprintf(stderr, "! no baseline found in %s\n", compare_file);
+            return 1;
+        }
+        fprintf(stderr, "comparing against commit %s\n", base[0].commit);
+    }
+
+    tox = tox_new(NULL, NULL);
+    view = new_view(STDIN_FILENO, STDOUT_FILENO, false, false);
+
+    struct BenchResult results[BENCHMARK_COUNT];
+    size_t count = 0;
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+        if (filter && !strstr(benchmarks[i].name, filter)) continue;
+        run_benchmark(&benchmarks[i], runs, &results[count++]);
+    }
+
+    if (json) {
+        print_json(results, count);
+    } else if (!compare_file) {
+        print_text(results, count);
+    }
+
+    if (save_file && !save_baseline(save_file, commit, results, count)) {
+        fprintf(stderr, "! write baseline %s failed\n", save_file);
+        return 1;
+    }
+    if (compare_file && compare_baseline(base, nbase, results, count) > 0) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * MiniTox - Group traffic load generator
+ *
+ * Runs `instances` minitox_loadgen processes, each in a directory of its own
+ * and in JSON mode, all in the same synthetic conference(see loadgen.h), and
+ * reads what they print. For every step of the schedule and every instance, it
+ * reports how many of the messages sent arrived, and how late: from the time a
+ * message was due to the time its `group_message` event was read. With `ramp`,
+ * the rate grows every step, and the first step where an instance falls behind
+ * is reported as where it saturates.
+ *
+ *     make loadgen
+ *     ./loadgen instances=4 rate=50 ramp=50 step=5 seconds=60 pattern=bursty
+ *
+ * The mock toxcore stands in for the network, so what's measured is minitox's
+ * side: conference callbacks, history, rendering and output, with the
+ * instances competing for the CPU. Arguments after `--` go to every minitox,
+ * e.g. `-- --perf`.
+ */
+
+#define _XOPEN_SOURCE 700 // for realpath(3)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "loadgen.h"
+
+#define LOADGEN_MAX_INSTANCES 64
+#define LOADGEN_BOOT_NS 1500000000u // for the instances to start up, before the traffic
+#define LOADGEN_GRACE_NS 2000000000u // after the traffic, for late messages to arrive
+#define LOADGEN_LINE_MAX 65536
+
+struct Samples {
+    uint32_t *us;  // latencies
+    size_t len, cap;
+};
+
+struct Instance {
+    pid_t pid;
+    int in, out;  // its stdin & stdout
+    bool eof;
+    char line[LOADGEN_LINE_MAX];
+    size_t line_len;
+    struct Samples *steps;  // of every step
+};
+
+struct LoadConfig cfg = LOADGEN_DEFAULT_CONFIG;
+int nsteps;
+uint64_t *sent;  // messages of every step
+
+struct Instance instances[LOADGEN_MAX_INSTANCES];
+int ninstances = 2;
+
+static void samples_add(struct Samples *s, uint32_t us) {
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->us = realloc(s->us, s->cap * sizeof(uint32_t));
+    }
+    s->us[s->len++] = us;
+}
+
+static int _cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// the p-th percentile in ms, of sorted samples.
+static double percentile(const struct Samples *s, double p) {
+    if (s->len == 0) return 0;
+    size_t i = (size_t)(p * (s->len - 1) + 0.5);
+    return s->us[i] / 1000.0;
+}
+
+static void handle_line(struct Instance *in, const char *line, uint64_t now) {
+    if (!strstr(line, "\"type\":\"group_message\"")) return;
+    const char *t = strstr(line, "\"text\":\"#");
+    unsigned long long seq, at;
+    if (!t || sscanf(t + 9, "%llu %llu", &seq, &at) != 2 || at < cfg.start_ns) return;
+    int step = loadgen_step_of(&cfg, (at - cfg.start_ns) / 1e9);
+    if (step >= nsteps) return;
+    samples_add(&in->steps[step], now > at ? (uint32_t)((now - at) / 1000) : 0);
+}
+
+static void read_instance(struct Instance *in) {
+    char buf[16384];
+    ssize_t n = read(in->out, buf, sizeof(buf));
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        in->eof = true;
+        return;
+    }
+    uint64_t now = loadgen_now_ns();
+    for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] != '\n') {
+            if (in->line_len < LOADGEN_LINE_MAX - 1) in->line[in->line_len++] = buf[i];
+            continue;
+        }
+        in->line[in->line_len] = '\0';
+        handle_line(in, in->line, now);
+        in->line_len = 0;
+    }
+}
+
+// read what the instances print, until `until`(or they all exit, if 0).
+static void read_instances(uint64_t until) {
+    struct pollfd fds[LOADGEN_MAX_INSTANCES];
+    while (!until || loadgen_now_ns() < until) {
+        int nfds = 0;
+        for (int i = 0; i < ninstances; i++) {
+            if (instances[i].eof) continue;
+            fds[nfds].fd = instances[i].out;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        if (nfds == 0) return;
+        if (poll(fds, nfds, 100) <= 0) continue;
+        for (int i = 0, j = 0; i < ninstances; i++) {
+            if (instances[i].eof) continue;
+            if (fds[j++].revents) read_instance(&instances[i]);
+        }
+    }
+}
+
+static bool spawn_instance(struct Instance *in, const char *dir, const char *path, char **args, const char *env) {
+    int pin[2], pout[2];
+    if (pipe(pin) != 0 || pipe(pout) != 0) return false;
+    in->pid = fork();
+    if (in->pid < 0) return false;
+    if (in->pid == 0) {
+        dup2(pin[0], STDIN_FILENO);
+        dup2(pout[1], STDOUT_FILENO);
+        close(pin[0]), close(pin[1]), close(pout[0]), close(pout[1]);
+        if (chdir(dir) != 0 || setenv(LOADGEN_ENV, env, 1) != 0) _exit(127);
+        execv(path, args);
+        fprintf(stderr, "! exec %s failed: %s\n", path, strerror(errno));
+        _exit(127);
+    }
+    close(pin[0]), close(pout[1]);
+    in->in = pin[1];
+    in->out = pout[0];
+    fcntl(in->out, F_SETFL, fcntl(in->out, F_GETFL) | O_NONBLOCK);
+    in->steps = calloc(nsteps, sizeof(struct Samples));
+    return true;
+}
+
+static void report(const char *dir, double limit_ms) {
+    printf("# pattern=%s, %d instances, %u peers(churn %g/s), %u-%u bytes, in %s\n",
+           load_pattern_names[cfg.pattern], ninstances, cfg.peers, cfg.churn, cfg.size_min, cfg.size_max, dir);
+    printf("%5s %9s %9s %9s %9s %9s %9s\n", "step", "rate/s", "instance", "received", "p50 ms", "p99 ms", "max ms");
+    int saturated = -1;
+    double top_rate = 0;
+    for (int k = 0; k < nsteps; k++) {
+        double secs = cfg.step;
+        if ((k + 1) * cfg.step > cfg.seconds) secs = cfg.seconds - k * cfg.step;
+        double rate = sent[k] / secs;
+        for (int i = 0; i < ninstances; i++) {
+            struct Samples *s = &instances[i].steps[k];
+            qsort(s->us, s->len, sizeof(uint32_t), _cmp_u32);
+            double received = sent[k] ? 100.0 * s->len / sent[k] : 100;
+            double p99 = percentile(s, 0.99);
+            printf("%5d %9.1f %9d %8.1f%% %9.1f %9.1f %9.1f\n", k, rate, i, received, percentile(s, 0.5), p99,
+                   percentile(s, 1));
+            if (saturated < 0 && (received < 99 || p99 > limit_ms)) saturated = k;
+        }
+        if (saturated < 0) top_rate = rate;
+    }
+    if (saturated >= 0) {
+        printf("# saturated at step %d: some instance lost over 1%% or had p99 over %gms, "
+               "it kept up with %.1f msg/s\n", saturated, limit_ms, top_rate);
+    } else {
+        printf("# kept up with all of it, up to %.1f msg/s\n", top_rate);
+    }
+}
+
+static void usage(void) {
+    fputs("Usage: loadgen [<key>=<value>]... [-- <minitox args>...]\n", stderr);
+    fputs("  instances=2       minitox instances in the conference, each one a receiver\n", stderr);
+    fputs("  rate=10 ramp=0    messages per second, and how much more every step\n", stderr);
+    fputs("  step=5 seconds=30 seconds of a step, and of the whole run\n", stderr);
+    fputs("  pattern=steady    steady, bursty(a fifth of every second at 4x) or diurnal(+-80% over `day`)\n", stderr);
+    fputs("  day=60            seconds of a diurnal cycle\n", stderr);
+    fputs("  size=16-256       message sizes in bytes, uniform\n", stderr);
+    fputs("  peers=50 churn=1  peers in the conference, and how many join or leave per second\n", stderr);
+    fputs("  seed=1            of the schedule\n", stderr);
+    fputs("  limit=1000        p99 latency in ms over which an instance is taken as saturated\n", stderr);
+    fputs("  minitox=./minitox_loadgen\n", stderr);
+}
+
+int main(int argc, char **argv) {
+    const char *minitox = "./minitox_loadgen";
+    double limit_ms = 1000;
+    int i = 1;
+    for (; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        const char *a = argv[i];
+        if (strncmp(a, "instances=", 10) == 0) {
+            ninstances = atoi(a + 10);
+            if (ninstances < 1 || ninstances > LOADGEN_MAX_INSTANCES) {
+                usage();
+                return 1;
+            }
+        } else if (strncmp(a, "minitox=", 8) == 0) {
+            minitox = a + 8;
+        } else if (strncmp(a, "limit=", 6) == 0) {
+            limit_ms = atof(a + 6);
+        } else if (!loadgen_set(&cfg, a)) {
+            usage();
+            return 1;
+        }
+    }
+
+    char path[PATH_MAX];
+    if (!realpath(minitox, path)) {
+        fprintf(stderr, "! %s not found, `make minitox_loadgen`\n", minitox);
+        return 1;
+    }
+    char *args[argc + 3];
+    int nargs = 0;
+    args[nargs++] = "minitox_loadgen";
+    args[nargs++] = "--json";
+    for (i++; i < argc; i++) args[nargs++] = argv[i];
+    args[nargs] = NULL;
+
+    // the instances get the settings as formatted, so use them as parsed back too
+    char env[512];
+    cfg.start_ns = loadgen_now_ns() + LOADGEN_BOOT_NS;
+    loadgen_format(&cfg, env, sizeof(env));
+    loadgen_parse(&cfg, env);
+
+    nsteps = loadgen_steps(&cfg);
+    sent = calloc(nsteps, sizeof(uint64_t));
+    struct LoadGen gen;
+    struct LoadEvent e;
+    loadgen_init(&gen, &cfg);
+    while (loadgen_next(&gen, &e)) {
+        if (!e.churn) sent[loadgen_step_of(&cfg, e.at_ns / 1e9)]++;
+    }
+
+    char dir[] = "/tmp/minitox-loadgen-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    for (int k = 0; k < ninstances; k++) {
+        char sub[sizeof(dir) + 16];
+        snprintf(sub, sizeof(sub), "%s/%d", dir, k);
+        if (mkdir(sub, 0755) != 0 || !spawn_instance(&instances[k], sub, path, args, env)) {
+            fprintf(stderr, "! start instance %d failed: %s\n", k, strerror(errno));
+            return 1;
+        }
+        const char *invite = "/invite 0\n";  // creates the conference
+        if (write(instances[k].in, invite, strlen(invite)) < 0) instances[k].eof = true;
+    }
+    fprintf(stderr, "* %d instances, %.0f seconds of traffic ...\n", ninstances, cfg.seconds);
+
+    read_instances(cfg.start_ns + (uint64_t)(cfg.seconds * 1e9) + LOADGEN_GRACE_NS);
+    for (int k = 0; k < ninstances; k++) {
+        if (write(instances[k].in, "\004", 1) < 0) {}  // Ctrl-D, shut down
+        close(instances[k].in);
+    }
+    read_instances(0);
+    for (int k = 0; k < ninstances; k++) waitpid(instances[k].pid, NULL, 0);
+
+    report(dir, limit_ms);
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * MiniTox - Synthetic group traffic
+ *
+ * The schedule of a conference's traffic, shared by the load generator
+ * (bench/loadgen.c) and the peers it plays inside every minitox instance
+ * (bench/loadgen_peer.c). Both run the same seeded generator, so every
+ * instance gets the same messages at the same times, and the generator knows
+ * what each of them should have received.
+ *
+ * Settings are `key=value` pairs, given on the command line of `loadgen` and
+ * passed to the instances in the MINITOX_LOADGEN environment variable.
+ */
+
+#ifndef MINITOX_LOADGEN_H
+#define MINITOX_LOADGEN_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOADGEN_ENV "MINITOX_LOADGEN"
+#define LOADGEN_MAX_SIZE 1372 // TOX_MAX_MESSAGE_LENGTH, a conference message can't be longer
+
+enum LoadPattern {
+    LOAD_STEADY,  // poisson arrivals at the rate
+    LOAD_BURSTY,  // a fifth of every second at 4x the rate, the rest at 1/4
+    LOAD_DIURNAL, // the rate swings +-80% over `day` seconds
+};
+
+struct LoadConfig {
+    double rate;        // messages per second of the whole conference, in the first step
+    double ramp;        // added to the rate every step, to find where it saturates
+    double step;        // seconds of a step
+    double seconds;     // of traffic in all
+    int pattern;
+    double day;         // seconds of a `diurnal` cycle
+    uint32_t size_min;  // message sizes are uniform in [size_min, size_max]
+    uint32_t size_max;
+    uint32_t peers;     // synthetic peers in the conference at start
+    double churn;       // peers joining or leaving per second
+    uint64_t seed;
+    uint64_t start_ns;  // CLOCK_MONOTONIC time the traffic starts at, the same for every instance
+};
+
+#define LOADGEN_DEFAULT_CONFIG {10, 0, 5, 30, LOAD_STEADY, 60, 16, 256, 50, 1, 1, 0}
+
+static const char *load_pattern_names[] = {"steady", "bursty", "diurnal"};
+
+// set one `key=value`, returns false if it's not a setting or the value is bad.
+static inline bool loadgen_set(struct LoadConfig *cfg, const char *kv) {
+    const char *eq = strchr(kv, '=');
+    if (!eq) return false;
+    size_t klen = eq - kv;
+    const char *v = eq + 1;
+    char *end;
+#define LOADGEN_KEY(_k) (klen == strlen(_k) && strncmp(kv, _k, klen) == 0)
+    if (LOADGEN_KEY("pattern")) {
+        for (int i = 0; i < 3; i++) {
+            if (strcmp(v, load_pattern_names[i]) == 0) {
+                cfg->pattern = i;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (LOADGEN_KEY("size")) {  // <min>-<max>, or one size
+        unsigned long lo = strtoul(v, &end, 10), hi = lo;
+        if (end == v) return false;
+        if (*end == '-') hi = strtoul(end + 1, &end, 10);
+        if (*end || lo < 1 || hi < lo || hi > LOADGEN_MAX_SIZE) return false;
+        cfg->size_min = lo;
+        cfg->size_max = hi;
+        return true;
+    }
+    if (LOADGEN_KEY("peers") || LOADGEN_KEY("seed") || LOADGEN_KEY("start")) {
+        unsigned long long n = strtoull(v, &end, 10);
+        if (end == v || *end) return false;
+        if (LOADGEN_KEY("peers")) {
+            if (n < 1 || n > 10000) return false;
+            cfg->peers = n;
+        } else if (LOADGEN_KEY("seed")) {
+            cfg->seed = n;
+        } else {
+            cfg->start_ns = n;
+        }
+        return true;
+    }
+    double d = strtod(v, &end);
+    if (end == v || *end || d < 0) return false;
+    if (LOADGEN_KEY("rate")) cfg->rate = d;
+    else if (LOADGEN_KEY("ramp")) cfg->ramp = d;
+    else if (LOADGEN_KEY("step") && d > 0) cfg->step = d;
+    else if (LOADGEN_KEY("seconds") && d > 0) cfg->seconds = d;
+    else if (LOADGEN_KEY("day") && d > 0) cfg->day = d;
+    else if (LOADGEN_KEY("churn")) cfg->churn = d;
+    else return false;
+    return true;
+#undef LOADGEN_KEY
+}
+
+// the settings as `key=value ...`, for LOADGEN_ENV.
+static inline void loadgen_format(const struct LoadConfig *cfg, char *buf, size_t size) {
+    snprintf(buf, size, "rate=%g ramp=%g step=%g seconds=%g pattern=%s day=%g size=%u-%u peers=%u churn=%g "
+             "seed=%llu start=%llu", cfg->rate, cfg->ramp, cfg->step, cfg->seconds,
+             load_pattern_names[cfg->pattern], cfg->day, cfg->size_min, cfg->size_max, cfg->peers, cfg->churn,
+             (unsigned long long)cfg->seed, (unsigned long long)cfg->start_ns);
+}
+
+// parse what loadgen_format() made.
+static inline bool loadgen_parse(struct LoadConfig *cfg, const char *s) {
+    char kv[128];
+    while (*s) {
+        while (*s == ' ') s++;
+        size_t len = strcspn(s, " ");
+        if (len == 0) break;
+        if (len >= sizeof(kv)) return false;
+        memcpy(kv, s, len);
+        kv[len] = '\0';
+        if (!loadgen_set(cfg, kv)) return false;
+        s += len;
+    }
+    return true;
+}
+
+static inline uint64_t loadgen_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ *
+ * Schedule
+ *
+ ******************************************************************************/
+
+struct LoadEvent {
+    uint64_t at_ns;    // since start_ns
+    bool churn;        // a peer joins or leaves, rather than a message
+    bool join;
+    uint64_t seq;      // of messages, from 0
+    uint32_t size;
+    uint32_t pick;     // random, which peer says it
+};
+
+struct LoadGen {
+    const struct LoadConfig *cfg;
+    uint64_t msg_rng, churn_rng;  // apart, so that churn doesn't change the messages
+    double msg_t, churn_t;        // seconds, of the next candidate
+    double peak;                  // most rate the pattern ever asks for
+    uint64_t seq;
+    bool has_msg;
+    struct LoadEvent msg;
+};
+
+static inline uint64_t loadgen_rand(uint64_t *s) {  // splitmix64
+    uint64_t z = (*s += 0x9E3779B97F4A7C15u);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+    return z ^ (z >> 31);
+}
+
+static inline double loadgen_uniform(uint64_t *s) {  // in (0, 1]
+    return ((loadgen_rand(s) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static inline int loadgen_step_of(const struct LoadConfig *cfg, double t) {
+    return (int)(t / cfg->step);
+}
+
+static inline int loadgen_steps(const struct LoadConfig *cfg) {
+    return (int)ceil(cfg->seconds / cfg->step);
+}
+
+// messages per second asked for at `t` seconds.
+static inline double loadgen_rate(const struct LoadConfig *cfg, double t) {
+    double r = cfg->rate + cfg->ramp * loadgen_step_of(cfg, t);
+    switch (cfg->pattern) {
+    case LOAD_BURSTY:
+        return fmod(t, 1.0) < 0.2 ? r * 4 : r / 4;
+    case LOAD_DIURNAL:
+        return r * (1 + 0.8 * sin(6.283185307179586 * t / cfg->day));
+    default:
+        return r;
+    }
+}
+
+static inline void loadgen_init(struct LoadGen *g, const struct LoadConfig *cfg) {
+    memset(g, 0, sizeof(*g));
+    g->cfg = cfg;
+    g->msg_rng = cfg->seed;
+    g->churn_rng = cfg->seed ^ 0x5DEECE66Du;
+    double top = cfg->rate + cfg->ramp * (loadgen_steps(cfg) - 1);
+    g->peak = top * (cfg->pattern == LOAD_BURSTY ? 4 : cfg->pattern == LOAD_DIURNAL ? 1.8 : 1);
+    g->churn_t = cfg->churn > 0 ? -log(loadgen_uniform(&g->churn_rng)) / cfg->churn : INFINITY;
+}
+
+// the next message, arrivals are thinned from a poisson process at the peak rate.
+static inline bool loadgen_next_msg(struct LoadGen *g, struct LoadEvent *e) {
+    const struct LoadConfig *cfg = g->cfg;
+    if (g->peak <= 0) return false;
+    while (true) {
+        g->msg_t += -log(loadgen_uniform(&g->msg_rng)) / g->peak;
+        if (g->msg_t >= cfg->seconds) return false;
+        if (loadgen_uniform(&g->msg_rng) * g->peak <= loadgen_rate(cfg, g->msg_t)) break;
+    }
+    memset(e, 0, sizeof(*e));
+    e->at_ns = (uint64_t)(g->msg_t * 1e9);
+    e->seq = g->seq++;
+    e->size = cfg->size_min + loadgen_rand(&g->msg_rng) % (cfg->size_max - cfg->size_min + 1);
+    e->pick = (uint32_t)loadgen_rand(&g->msg_rng);
+    return true;
+}
+
+// the next event in time, false when the traffic is over.
+static inline bool loadgen_next(struct LoadGen *g, struct LoadEvent *e) {
+    if (!g->has_msg && g->msg_t < g->cfg->seconds) g->has_msg = loadgen_next_msg(g, &g->msg);
+    if (g->churn_t < g->cfg->seconds && (!g->has_msg || g->churn_t * 1e9 < g->msg.at_ns)) {
+        memset(e, 0, sizeof(*e));
+        e->at_ns = (uint64_t)(g->churn_t * 1e9);
+        e->churn = true;
+        e->join = loadgen_rand(&g->churn_rng) & 1;
+        g->churn_t += -log(loadgen_uniform(&g->churn_rng)) / g->cfg->churn;
+        return true;
+    }
+    if (!g->has_msg) return false;
+    *e = g->msg;
+    g->has_msg = false;
+    return true;
+}
+
+#endif
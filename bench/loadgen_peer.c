@@ -0,0 +1,77 @@
+/*
+ * MiniTox - Synthetic conference peers
+ *
+ * Linked into minitox_loadgen with the mock toxcore, with tox_new &
+ * tox_iterate wrapped at link time(see Makefile). Once minitox has a
+ * conference(`/invite 0`, typed by loadgen), its peers say what the schedule
+ * in MINITOX_LOADGEN tells them, and join & leave, on every tox_iterate as
+ * toxcore would deliver them. Every message starts with `#<seq> <at_ns>`, for
+ * loadgen to take the latency from.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "loadgen.h"
+#include "mock_tox.h"
+
+Tox *__real_tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error);
+void __real_tox_iterate(Tox *tox, void *user_data);
+
+struct LoadConfig peer_cfg = LOADGEN_DEFAULT_CONFIG;
+struct LoadGen peer_gen;
+bool peer_started, peer_done;
+uint32_t peer_conference, peer_count;
+struct LoadEvent peer_next;
+
+Tox *__wrap_tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error) {
+    Tox *tox = __real_tox_new(options, error);
+    // someone to invite to the conference
+    if (tox && tox_self_get_friend_list_size(tox) == 0) mock_tox_add_friend(tox, "loadgen", "");
+    return tox;
+}
+
+static void peer_start(Tox *tox) {
+    const char *env = getenv(LOADGEN_ENV);
+    if (!env || !loadgen_parse(&peer_cfg, env)) {
+        fprintf(stderr, "! bad or no %s\n", LOADGEN_ENV);
+        exit(1);
+    }
+    uint32_t chatlist[1];
+    tox_conference_get_chatlist(tox, chatlist);
+    peer_conference = chatlist[0];
+    peer_count = peer_cfg.peers;
+    mock_tox_set_conference_peers(tox, peer_conference, peer_count);
+    loadgen_init(&peer_gen, &peer_cfg);
+    peer_done = !loadgen_next(&peer_gen, &peer_next);
+    peer_started = true;
+}
+
+void __wrap_tox_iterate(Tox *tox, void *user_data) {
+    __real_tox_iterate(tox, user_data);
+    if (!peer_started) {
+        if (tox_conference_get_chatlist_size(tox) == 0) return;
+        peer_start(tox);
+    }
+
+    uint64_t now = loadgen_now_ns();
+    if (now < peer_cfg.start_ns) return;
+    char msg[LOADGEN_MAX_SIZE + 1];
+    // everything due since the last call, at once, as a busy toxcore would
+    while (!peer_done && peer_cfg.start_ns + peer_next.at_ns <= now) {
+        struct LoadEvent *e = &peer_next;
+        if (e->churn) {
+            if (e->join && peer_count < peer_cfg.peers * 2) peer_count++;
+            else if (!e->join && peer_count > 1) peer_count--;
+            mock_tox_set_conference_peers(tox, peer_conference, peer_count);
+        } else {
+            int len = snprintf(msg, sizeof(msg), "#%llu %llu ", (unsigned long long)e->seq,
+                               (unsigned long long)(peer_cfg.start_ns + e->at_ns));
+            if ((uint32_t)len < e->size) {
+                memset(msg + len, 'x', e->size - len);
+                len = e->size;
+            }
+            mock_tox_conference_message(tox, peer_conference, 1 + e->pick % peer_count, (const uint8_t *)msg, len);
+        }
+        peer_done = !loadgen_next(&peer_gen, &peer_next);
+    }
+}
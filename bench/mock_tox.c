@@ -0,0 +1,670 @@
+/*
+ * MiniTox - Mock toxcore
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock_tox.h"
+
+struct MockOptions {
+    TOX_SAVEDATA_TYPE savedata_type;
+    const uint8_t *savedata;
+    size_t savedata_length;
+};
+
+struct MockFriend {
+    bool exists;
+    uint8_t pubkey[TOX_PUBLIC_KEY_SIZE];
+    char name[TOX_MAX_NAME_LENGTH];
+    size_t name_length;
+    char status_message[TOX_MAX_STATUS_MESSAGE_LENGTH];
+    size_t status_message_length;
+    TOX_CONNECTION connection;
+    uint32_t unreceipted;  // messages sent since last tox_iterate(), receipted by it
+};
+
+struct MockPeer {
+    uint8_t pubkey[TOX_PUBLIC_KEY_SIZE];
+    char name[TOX_MAX_NAME_LENGTH];
+    size_t name_length;
+};
+
+struct MockConference {
+    bool exists;
+    char title[TOX_MAX_NAME_LENGTH];
+    size_t title_length;
+    struct MockPeer *peers;  // peers[0] is us
+    uint32_t peers_count;
+};
+
+struct Tox {
+    uint8_t pubkey[TOX_PUBLIC_KEY_SIZE];
+    char name[TOX_MAX_NAME_LENGTH];
+    size_t name_length;
+    char status_message[TOX_MAX_STATUS_MESSAGE_LENGTH];
+    size_t status_message_length;
+
+    struct MockFriend *friends;
+    uint32_t friends_count;
+
+    struct MockConference *conferences;
+    uint32_t conferences_count;
+
+    uint64_t sent_count;
+    uint64_t sent_bytes;
+    bool loopback;  // friends send back whatever they get
+
+    tox_self_connection_status_cb *self_connection_status_cb;
+    tox_friend_name_cb *friend_name_cb;
+    tox_friend_status_message_cb *friend_status_message_cb;
+    tox_friend_connection_status_cb *friend_connection_status_cb;
+    tox_friend_request_cb *friend_request_cb;
+    tox_friend_message_cb *friend_message_cb;
+    tox_friend_read_receipt_cb *friend_read_receipt_cb;
+    tox_friend_lossless_packet_cb *friend_lossless_packet_cb;
+    tox_conference_invite_cb *conference_invite_cb;
+    tox_conference_message_cb *conference_message_cb;
+    tox_conference_title_cb *conference_title_cb;
+    tox_conference_peer_name_cb *conference_peer_name_cb;
+    tox_conference_peer_list_changed_cb *conference_peer_list_changed_cb;
+};
+
+#define SAVEDATA_MAGIC "MOCKTOX1"
+
+// deterministic keys, so that the same savedata always gives the same friends.
+static void gen_pubkey(uint8_t *pubkey, uint32_t seed) {
+    uint32_t x = seed * 2654435761u + 1;
+    for (int i = 0; i < TOX_PUBLIC_KEY_SIZE; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        pubkey[i] = (uint8_t)x;
+    }
+}
+
+static void set_bytes(char *dst, size_t *dst_len, size_t cap, const void *src, size_t len) {
+    if (len > cap) len = cap;
+    memcpy(dst, src, len);
+    *dst_len = len;
+}
+
+static struct MockFriend *get_friend(const Tox *tox, uint32_t friend_num) {
+    if (friend_num >= tox->friends_count || !tox->friends[friend_num].exists) return NULL;
+    return &tox->friends[friend_num];
+}
+
+static struct MockConference *get_conference(const Tox *tox, uint32_t conference_num) {
+    if (conference_num >= tox->conferences_count || !tox->conferences[conference_num].exists) return NULL;
+    return &tox->conferences[conference_num];
+}
+
+static struct MockFriend *new_friend(Tox *tox, uint32_t *friend_num) {
+    tox->friends = realloc(tox->friends, sizeof(struct MockFriend) * (tox->friends_count + 1));
+    struct MockFriend *f = &tox->friends[tox->friends_count];
+    memset(f, 0, sizeof(struct MockFriend));
+    f->exists = true;
+    *friend_num = tox->friends_count++;
+    return f;
+}
+
+/*******************************************************************************
+ *
+ * Options & Lifecycle
+ *
+ ******************************************************************************/
+
+struct Tox_Options *tox_options_new(TOX_ERR_OPTIONS_NEW *error) {
+    if (error) *error = TOX_ERR_OPTIONS_NEW_OK;
+    return (struct Tox_Options *)calloc(1, sizeof(struct MockOptions));
+}
+
+void tox_options_free(struct Tox_Options *options) {
+    free(options);
+}
+
+void tox_options_set_start_port(struct Tox_Options *options, uint16_t start_port) {}
+void tox_options_set_end_port(struct Tox_Options *options, uint16_t end_port) {}
+
+void tox_options_set_savedata_type(struct Tox_Options *options, TOX_SAVEDATA_TYPE type) {
+    ((struct MockOptions *)options)->savedata_type = type;
+}
+
+void tox_options_set_savedata_data(struct Tox_Options *options, const uint8_t *data, size_t length) {
+    ((struct MockOptions *)options)->savedata = data;
+    ((struct MockOptions *)options)->savedata_length = length;
+}
+
+// savedata: magic, self pubkey, friends_count, then every friend's pubkey, name & status message.
+static bool load_savedata(Tox *tox, const uint8_t *data, size_t length) {
+    const uint8_t *end = data + length;
+    if (length < 8 + TOX_PUBLIC_KEY_SIZE + 4 || memcmp(data, SAVEDATA_MAGIC, 8) != 0) return false;
+    data += 8;
+    memcpy(tox->pubkey, data, TOX_PUBLIC_KEY_SIZE);
+    data += TOX_PUBLIC_KEY_SIZE;
+    uint32_t count;
+    memcpy(&count, data, 4);
+    data += 4;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t friend_num;
+        struct MockFriend *f = new_friend(tox, &friend_num);
+        uint16_t len[2];
+        if (end - data < TOX_PUBLIC_KEY_SIZE + 4) return false;
+        memcpy(f->pubkey, data, TOX_PUBLIC_KEY_SIZE);
+        memcpy(len, data + TOX_PUBLIC_KEY_SIZE, 4);
+        data += TOX_PUBLIC_KEY_SIZE + 4;
+        if (end - data < len[0] + len[1]) return false;
+        set_bytes(f->name, &f->name_length, sizeof(f->name), data, len[0]);
+        set_bytes(f->status_message, &f->status_message_length, sizeof(f->status_message), data + len[0], len[1]);
+        data += len[0] + len[1];
+    }
+    return true;
+}
+
+Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error) {
+    const struct MockOptions *opts = (const struct MockOptions *)options;
+    Tox *tox = calloc(1, sizeof(Tox));
+    gen_pubkey(tox->pubkey, UINT32_MAX);
+
+    if (opts && opts->savedata_type == TOX_SAVEDATA_TYPE_TOX_SAVE
+            && !load_savedata(tox, opts->savedata, opts->savedata_length)) {
+        tox_kill(tox);
+        if (error) *error = TOX_ERR_NEW_LOAD_BAD_FORMAT;
+        return NULL;
+    }
+    if (error) *error = TOX_ERR_NEW_OK;
+    return tox;
+}
+
+void tox_kill(Tox *tox) {
+    if (!tox) return;
+    for (uint32_t i = 0; i < tox->conferences_count; i++) free(tox->conferences[i].peers);
+    free(tox->conferences);
+    free(tox->friends);
+    free(tox);
+}
+
+size_t tox_get_savedata_size(const Tox *tox) {
+    size_t size = 8 + TOX_PUBLIC_KEY_SIZE + 4;
+    for (uint32_t i = 0; i < tox->friends_count; i++) {
+        const struct MockFriend *f = &tox->friends[i];
+        if (f->exists) size += TOX_PUBLIC_KEY_SIZE + 4 + f->name_length + f->status_message_length;
+    }
+    return size;
+}
+
+void tox_get_savedata(const Tox *tox, uint8_t *savedata) {
+    memcpy(savedata, SAVEDATA_MAGIC, 8);
+    memcpy(savedata + 8, tox->pubkey, TOX_PUBLIC_KEY_SIZE);
+    uint8_t *p = savedata + 8 + TOX_PUBLIC_KEY_SIZE + 4;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < tox->friends_count; i++) {
+        const struct MockFriend *f = &tox->friends[i];
+        if (!f->exists) continue;
+        uint16_t len[2] = {f->name_length, f->status_message_length};
+        memcpy(p, f->pubkey, TOX_PUBLIC_KEY_SIZE);
+        memcpy(p + TOX_PUBLIC_KEY_SIZE, len, 4);
+        p += TOX_PUBLIC_KEY_SIZE + 4;
+        memcpy(p, f->name, len[0]);
+        memcpy(p + len[0], f->status_message, len[1]);
+        p += len[0] + len[1];
+        count++;
+    }
+    memcpy(savedata + 8 + TOX_PUBLIC_KEY_SIZE, &count, 4);
+}
+
+bool tox_bootstrap(Tox *tox, const char *host, uint16_t port, const uint8_t *public_key, TOX_ERR_BOOTSTRAP *error) {
+    if (error) *error = TOX_ERR_BOOTSTRAP_OK;
+    return true;
+}
+
+bool tox_add_tcp_relay(Tox *tox, const char *host, uint16_t port, const uint8_t *public_key, TOX_ERR_BOOTSTRAP *error) {
+    if (error) *error = TOX_ERR_BOOTSTRAP_OK;
+    return true;
+}
+
+TOX_CONNECTION tox_self_get_connection_status(const Tox *tox) {
+    return TOX_CONNECTION_UDP;
+}
+
+uint32_t tox_iteration_interval(const Tox *tox) {
+    return 50;
+}
+
+void tox_iterate(Tox *tox, void *user_data) {
+    for (uint32_t i = 0; i < tox->friends_count; i++) {
+        struct MockFriend *f = &tox->friends[i];
+        for (; f->exists && f->unreceipted > 0; f->unreceipted--) {
+            if (tox->friend_read_receipt_cb) tox->friend_read_receipt_cb(tox, i, 0, user_data);
+        }
+    }
+}
+
+/*******************************************************************************
+ *
+ * Self
+ *
+ ******************************************************************************/
+
+void tox_self_get_address(const Tox *tox, uint8_t *address) {
+    memcpy(address, tox->pubkey, TOX_PUBLIC_KEY_SIZE);
+    memset(address + TOX_PUBLIC_KEY_SIZE, 0, TOX_ADDRESS_SIZE - TOX_PUBLIC_KEY_SIZE);
+}
+
+void tox_self_get_public_key(const Tox *tox, uint8_t *public_key) {
+    memcpy(public_key, tox->pubkey, TOX_PUBLIC_KEY_SIZE);
+}
+
+bool tox_self_set_name(Tox *tox, const uint8_t *name, size_t length, TOX_ERR_SET_INFO *error) {
+    if (length > TOX_MAX_NAME_LENGTH) {
+        if (error) *error = TOX_ERR_SET_INFO_TOO_LONG;
+        return false;
+    }
+    set_bytes(tox->name, &tox->name_length, sizeof(tox->name), name, length);
+    if (error) *error = TOX_ERR_SET_INFO_OK;
+    return true;
+}
+
+size_t tox_self_get_name_size(const Tox *tox) {
+    return tox->name_length;
+}
+
+void tox_self_get_name(const Tox *tox, uint8_t *name) {
+    memcpy(name, tox->name, tox->name_length);
+}
+
+bool tox_self_set_status_message(Tox *tox, const uint8_t *status_message, size_t length, TOX_ERR_SET_INFO *error) {
+    if (length > TOX_MAX_STATUS_MESSAGE_LENGTH) {
+        if (error) *error = TOX_ERR_SET_INFO_TOO_LONG;
+        return false;
+    }
+    set_bytes(tox->status_message, &tox->status_message_length, sizeof(tox->status_message), status_message, length);
+    if (error) *error = TOX_ERR_SET_INFO_OK;
+    return true;
+}
+
+size_t tox_self_get_status_message_size(const Tox *tox) {
+    return tox->status_message_length;
+}
+
+void tox_self_get_status_message(const Tox *tox, uint8_t *status_message) {
+    memcpy(status_message, tox->status_message, tox->status_message_length);
+}
+
+/*******************************************************************************
+ *
+ * Friends
+ *
+ ******************************************************************************/
+
+uint32_t tox_friend_add(Tox *tox, const uint8_t *address, const uint8_t *message, size_t length, TOX_ERR_FRIEND_ADD *error) {
+    return tox_friend_add_norequest(tox, address, error);
+}
+
+uint32_t tox_friend_add_norequest(Tox *tox, const uint8_t *public_key, TOX_ERR_FRIEND_ADD *error) {
+    for (uint32_t i = 0; i < tox->friends_count; i++) {
+        if (tox->friends[i].exists && memcmp(tox->friends[i].pubkey, public_key, TOX_PUBLIC_KEY_SIZE) == 0) {
+            if (error) *error = TOX_ERR_FRIEND_ADD_ALREADY_SENT;
+            return UINT32_MAX;
+        }
+    }
+    uint32_t friend_num;
+    struct MockFriend *f = new_friend(tox, &friend_num);
+    memcpy(f->pubkey, public_key, TOX_PUBLIC_KEY_SIZE);
+    if (error) *error = TOX_ERR_FRIEND_ADD_OK;
+    return friend_num;
+}
+
+bool tox_friend_delete(Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_DELETE *error) {
+    struct MockFriend *f = get_friend(tox, friend_number);
+    if (error) *error = f ? TOX_ERR_FRIEND_DELETE_OK : TOX_ERR_FRIEND_DELETE_FRIEND_NOT_FOUND;
+    if (f) f->exists = false;
+    return f != NULL;
+}
+
+bool tox_friend_exists(const Tox *tox, uint32_t friend_number) {
+    return get_friend(tox, friend_number) != NULL;
+}
+
+size_t tox_self_get_friend_list_size(const Tox *tox) {
+    size_t n = 0;
+    for (uint32_t i = 0; i < tox->friends_count; i++) n += tox->friends[i].exists;
+    return n;
+}
+
+void tox_self_get_friend_list(const Tox *tox, uint32_t *friend_list) {
+    for (uint32_t i = 0; i < tox->friends_count; i++) {
+        if (tox->friends[i].exists) *friend_list++ = i;
+    }
+}
+
+bool tox_friend_get_public_key(const Tox *tox, uint32_t friend_number, uint8_t *public_key, TOX_ERR_FRIEND_GET_PUBLIC_KEY *error) {
+    struct MockFriend *f = get_friend(tox, friend_number);
+    if (error) *error = f ? TOX_ERR_FRIEND_GET_PUBLIC_KEY_OK : TOX_ERR_FRIEND_GET_PUBLIC_KEY_FRIEND_NOT_FOUND;
+    if (f) memcpy(public_key, f->pubkey, TOX_PUBLIC_KEY_SIZE);
+    return f != NULL;
+}
+
+size_t tox_friend_get_name_size(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error) {
+    struct MockFriend *f = get_friend(tox, friend_number);
+    if (error) *error = f ? TOX_ERR_FRIEND_QUERY_OK : TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND;
+    return f ? f->name_length : SIZE_MAX;
+}
+
+bool tox_friend_get_name(const Tox *tox, uint32_t friend_number, uint8_t *name, TOX_ERR_FRIEND_QUERY *error) {
+    struct MockFriend *f = get_friend(tox, friend_number);
+    if (error) *error = f ? TOX_ERR_FRIEND_QUERY_OK : TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND;
+    if (f) memcpy(name, f->name, f->name_length);
+    return f != NULL;
+}
+
+size_t tox_friend_get_status_message_size(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error) {
+    struct MockFriend *f = get_friend(tox, friend_number);
+    if (error) *error = f ? TOX_ERR_FRIEND_QUERY_OK : TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND;
+    return f ? f->status_message_length : SIZE_MAX;
+}
+
+bool tox_friend_get_status_message(const Tox *tox, uint32_t friend_number, uint8_t *status_message, TOX_ERR_FRIEND_QUERY *error) {
+    struct MockFriend *f = get_friend(tox, friend_number);
+    if (error) *error = f ? TOX_ERR_FRIEND_QUERY_OK : TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND;
+    if (f) memcpy(status_message, f->status_message, f->status_message_length);
+    return f != NULL;
+}
+
+TOX_CONNECTION tox_friend_get_connection_status(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error) {
+    struct MockFriend *f = get_friend(tox, friend_number);
+    if (error) *error = f ? TOX_ERR_FRIEND_QUERY_OK : TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND;
+    return f ? f->connection : TOX_CONNECTION_NONE;
+}
+
+uint32_t tox_friend_send_message(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
+                                 size_t length, TOX_ERR_FRIEND_SEND_MESSAGE *error) {
+    TOX_ERR_FRIEND_SEND_MESSAGE err = TOX_ERR_FRIEND_SEND_MESSAGE_OK;
+    if (!get_friend(tox, friend_number)) err = TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_FOUND;
+    else if (length == 0) err = TOX_ERR_FRIEND_SEND_MESSAGE_EMPTY;
+    else if (length > TOX_MAX_MESSAGE_LENGTH) err = TOX_ERR_FRIEND_SEND_MESSAGE_TOO_LONG;
+    if (error) *error = err;
+    if (err != TOX_ERR_FRIEND_SEND_MESSAGE_OK) return 0;
+    tox->sent_bytes += length;
+    tox->friends[friend_number].unreceipted++;
+    if (tox->loopback && tox->friend_message_cb) {
+        tox->friend_message_cb(tox, friend_number, type, message, length, NULL);
+    }
+    return (uint32_t)++tox->sent_count;
+}
+
+bool tox_friend_send_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                     TOX_ERR_FRIEND_CUSTOM_PACKET *error) {
+    struct MockFriend *f = get_friend(tox, friend_number);
+    TOX_ERR_FRIEND_CUSTOM_PACKET err = TOX_ERR_FRIEND_CUSTOM_PACKET_OK;
+    if (!f) err = TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND;
+    else if (f->connection == TOX_CONNECTION_NONE) err = TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_CONNECTED;
+    else if (length == 0) err = TOX_ERR_FRIEND_CUSTOM_PACKET_EMPTY;
+    else if (length > TOX_MAX_CUSTOM_PACKET_SIZE) err = TOX_ERR_FRIEND_CUSTOM_PACKET_TOO_LONG;
+    else if (data[0] < 160 || data[0] > 191) err = TOX_ERR_FRIEND_CUSTOM_PACKET_INVALID;
+    if (error) *error = err;
+    if (err != TOX_ERR_FRIEND_CUSTOM_PACKET_OK) return false;
+    tox->sent_count++;
+    tox->sent_bytes += length;
+    if (tox->loopback && tox->friend_lossless_packet_cb) {
+        tox->friend_lossless_packet_cb(tox, friend_number, data, length, NULL);
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *
+ * Conferences
+ *
+ ******************************************************************************/
+
+uint32_t tox_conference_new(Tox *tox, TOX_ERR_CONFERENCE_NEW *error) {
+    tox->conferences = realloc(tox->conferences, sizeof(struct MockConference) * (tox->conferences_count + 1));
+    struct MockConference *c = &tox->conferences[tox->conferences_count];
+    memset(c, 0, sizeof(struct MockConference));
+    c->exists = true;
+    c->peers = calloc(1, sizeof(struct MockPeer));
+    c->peers_count = 1;
+    memcpy(c->peers[0].pubkey, tox->pubkey, TOX_PUBLIC_KEY_SIZE);
+    set_bytes(c->peers[0].name, &c->peers[0].name_length, TOX_MAX_NAME_LENGTH, tox->name, tox->name_length);
+    if (error) *error = TOX_ERR_CONFERENCE_NEW_OK;
+    return tox->conferences_count++;
+}
+
+bool tox_conference_delete(Tox *tox, uint32_t conference_number, TOX_ERR_CONFERENCE_DELETE *error) {
+    struct MockConference *c = get_conference(tox, conference_number);
+    if (error) *error = c ? TOX_ERR_CONFERENCE_DELETE_OK : TOX_ERR_CONFERENCE_DELETE_CONFERENCE_NOT_FOUND;
+    if (c) c->exists = false;
+    return c != NULL;
+}
+
+static struct MockPeer *get_peer(const Tox *tox, uint32_t conference_number, uint32_t peer_number,
+                                 TOX_ERR_CONFERENCE_PEER_QUERY *error) {
+    struct MockConference *c = get_conference(tox, conference_number);
+    TOX_ERR_CONFERENCE_PEER_QUERY err = TOX_ERR_CONFERENCE_PEER_QUERY_OK;
+    if (!c) err = TOX_ERR_CONFERENCE_PEER_QUERY_CONFERENCE_NOT_FOUND;
+    else if (peer_number >= c->peers_count) err = TOX_ERR_CONFERENCE_PEER_QUERY_PEER_NOT_FOUND;
+    if (error) *error = err;
+    return err == TOX_ERR_CONFERENCE_PEER_QUERY_OK ? &c->peers[peer_number] : NULL;
+}
+
+uint32_t tox_conference_peer_count(const Tox *tox, uint32_t conference_number, TOX_ERR_CONFERENCE_PEER_QUERY *error) {
+    struct MockConference *c = get_conference(tox, conference_number);
+    if (error) *error = c ? TOX_ERR_CONFERENCE_PEER_QUERY_OK : TOX_ERR_CONFERENCE_PEER_QUERY_CONFERENCE_NOT_FOUND;
+    return c ? c->peers_count : UINT32_MAX;
+}
+
+size_t tox_conference_peer_get_name_size(const Tox *tox, uint32_t conference_number, uint32_t peer_number,
+                                         TOX_ERR_CONFERENCE_PEER_QUERY *error) {
+    struct MockPeer *p = get_peer(tox, conference_number, peer_number, error);
+    return p ? p->name_length : SIZE_MAX;
+}
+
+bool tox_conference_peer_get_name(const Tox *tox, uint32_t conference_number, uint32_t peer_number, uint8_t *name,
+                                  TOX_ERR_CONFERENCE_PEER_QUERY *error) {
+    struct MockPeer *p = get_peer(tox, conference_number, peer_number, error);
+    if (p) memcpy(name, p->name, p->name_length);
+    return p != NULL;
+}
+
+bool tox_conference_peer_get_public_key(const Tox *tox, uint32_t conference_number, uint32_t peer_number,
+                                        uint8_t *public_key, TOX_ERR_CONFERENCE_PEER_QUERY *error) {
+    struct MockPeer *p = get_peer(tox, conference_number, peer_number, error);
+    if (p) memcpy(public_key, p->pubkey, TOX_PUBLIC_KEY_SIZE);
+    return p != NULL;
+}
+
+bool tox_conference_peer_number_is_ours(const Tox *tox, uint32_t conference_number, uint32_t peer_number,
+                                        TOX_ERR_CONFERENCE_PEER_QUERY *error) {
+    return get_peer(tox, conference_number, peer_number, error) != NULL && peer_number == 0;
+}
+
+bool tox_conference_invite(Tox *tox, uint32_t friend_number, uint32_t conference_number, TOX_ERR_CONFERENCE_INVITE *error) {
+    bool ok = get_friend(tox, friend_number) && get_conference(tox, conference_number);
+    if (error) *error = ok ? TOX_ERR_CONFERENCE_INVITE_OK : TOX_ERR_CONFERENCE_INVITE_CONFERENCE_NOT_FOUND;
+    return ok;
+}
+
+uint32_t tox_conference_join(Tox *tox, uint32_t friend_number, const uint8_t *cookie, size_t length,
+                             TOX_ERR_CONFERENCE_JOIN *error) {
+    if (!get_friend(tox, friend_number)) {
+        if (error) *error = TOX_ERR_CONFERENCE_JOIN_FRIEND_NOT_FOUND;
+        return UINT32_MAX;
+    }
+    if (error) *error = TOX_ERR_CONFERENCE_JOIN_OK;
+    return tox_conference_new(tox, NULL);
+}
+
+bool tox_conference_send_message(Tox *tox, uint32_t conference_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
+                                 size_t length, TOX_ERR_CONFERENCE_SEND_MESSAGE *error) {
+    TOX_ERR_CONFERENCE_SEND_MESSAGE err = TOX_ERR_CONFERENCE_SEND_MESSAGE_OK;
+    if (!get_conference(tox, conference_number)) err = TOX_ERR_CONFERENCE_SEND_MESSAGE_CONFERENCE_NOT_FOUND;
+    else if (length > TOX_MAX_MESSAGE_LENGTH) err = TOX_ERR_CONFERENCE_SEND_MESSAGE_TOO_LONG;
+    if (error) *error = err;
+    if (err != TOX_ERR_CONFERENCE_SEND_MESSAGE_OK) return false;
+    tox->sent_count++;
+    tox->sent_bytes += length;
+    return true;
+}
+
+size_t tox_conference_get_title_size(const Tox *tox, uint32_t conference_number, TOX_ERR_CONFERENCE_TITLE *error) {
+    struct MockConference *c = get_conference(tox, conference_number);
+    if (error) *error = c ? TOX_ERR_CONFERENCE_TITLE_OK : TOX_ERR_CONFERENCE_TITLE_CONFERENCE_NOT_FOUND;
+    return c ? c->title_length : SIZE_MAX;
+}
+
+bool tox_conference_get_title(const Tox *tox, uint32_t conference_number, uint8_t *title, TOX_ERR_CONFERENCE_TITLE *error) {
+    struct MockConference *c = get_conference(tox, conference_number);
+    if (error) *error = c ? TOX_ERR_CONFERENCE_TITLE_OK : TOX_ERR_CONFERENCE_TITLE_CONFERENCE_NOT_FOUND;
+    if (c) memcpy(title, c->title, c->title_length);
+    return c != NULL;
+}
+
+bool tox_conference_set_title(Tox *tox, uint32_t conference_number, const uint8_t *title, size_t length,
+                              TOX_ERR_CONFERENCE_TITLE *error) {
+    struct MockConference *c = get_conference(tox, conference_number);
+    TOX_ERR_CONFERENCE_TITLE err = TOX_ERR_CONFERENCE_TITLE_OK;
+    if (!c) err = TOX_ERR_CONFERENCE_TITLE_CONFERENCE_NOT_FOUND;
+    else if (length == 0 || length > TOX_MAX_NAME_LENGTH) err = TOX_ERR_CONFERENCE_TITLE_INVALID_LENGTH;
+    if (error) *error = err;
+    if (err != TOX_ERR_CONFERENCE_TITLE_OK) return false;
+    set_bytes(c->title, &c->title_length, sizeof(c->title), title, length);
+    return true;
+}
+
+size_t tox_conference_get_chatlist_size(const Tox *tox) {
+    size_t n = 0;
+    for (uint32_t i = 0; i < tox->conferences_count; i++) n += tox->conferences[i].exists;
+    return n;
+}
+
+void tox_conference_get_chatlist(const Tox *tox, uint32_t *chatlist) {
+    for (uint32_t i = 0; i < tox->conferences_count; i++) {
+        if (tox->conferences[i].exists) *chatlist++ = i;
+    }
+}
+
+/*******************************************************************************
+ *
+ * Callbacks
+ *
+ ******************************************************************************/
+
+void tox_callback_self_connection_status(Tox *tox, tox_self_connection_status_cb *callback) {
+    tox->self_connection_status_cb = callback;
+}
+void tox_callback_friend_name(Tox *tox, tox_friend_name_cb *callback) {
+    tox->friend_name_cb = callback;
+}
+void tox_callback_friend_status_message(Tox *tox, tox_friend_status_message_cb *callback) {
+    tox->friend_status_message_cb = callback;
+}
+void tox_callback_friend_connection_status(Tox *tox, tox_friend_connection_status_cb *callback) {
+    tox->friend_connection_status_cb = callback;
+}
+void tox_callback_friend_request(Tox *tox, tox_friend_request_cb *callback) {
+    tox->friend_request_cb = callback;
+}
+void tox_callback_friend_message(Tox *tox, tox_friend_message_cb *callback) {
+    tox->friend_message_cb = callback;
+}
+void tox_callback_friend_read_receipt(Tox *tox, tox_friend_read_receipt_cb *callback) {
+    tox->friend_read_receipt_cb = callback;
+}
+void tox_callback_friend_lossless_packet(Tox *tox, tox_friend_lossless_packet_cb *callback) {
+    tox->friend_lossless_packet_cb = callback;
+}
+void tox_callback_conference_invite(Tox *tox, tox_conference_invite_cb *callback) {
+    tox->conference_invite_cb = callback;
+}
+void tox_callback_conference_message(Tox *tox, tox_conference_message_cb *callback) {
+    tox->conference_message_cb = callback;
+}
+void tox_callback_conference_title(Tox *tox, tox_conference_title_cb *callback) {
+    tox->conference_title_cb = callback;
+}
+void tox_callback_conference_peer_name(Tox *tox, tox_conference_peer_name_cb *callback) {
+    tox->conference_peer_name_cb = callback;
+}
+void tox_callback_conference_peer_list_changed(Tox *tox, tox_conference_peer_list_changed_cb *callback) {
+    tox->conference_peer_list_changed_cb = callback;
+}
+
+/*******************************************************************************
+ *
+ * Control Interface
+ *
+ ******************************************************************************/
+
+uint32_t mock_tox_add_friend(Tox *tox, const char *name, const char *status_message) {
+    uint32_t friend_num;
+    struct MockFriend *f = new_friend(tox, &friend_num);
+    gen_pubkey(f->pubkey, friend_num);
+    set_bytes(f->name, &f->name_length, sizeof(f->name), name, strlen(name));
+    set_bytes(f->status_message, &f->status_message_length, sizeof(f->status_message),
+              status_message, strlen(status_message));
+    f->connection = TOX_CONNECTION_UDP;
+    return friend_num;
+}
+
+static void resize_peers(Tox *tox, struct MockConference *c, uint32_t npeers) {
+    uint32_t old = c->peers_count;
+    c->peers = realloc(c->peers, sizeof(struct MockPeer) * (npeers + 1));
+    c->peers_count = npeers + 1;
+    for (uint32_t i = old; i < c->peers_count; i++) {
+        struct MockPeer *p = &c->peers[i];
+        gen_pubkey(p->pubkey, i);
+        p->name_length = snprintf(p->name, sizeof(p->name), "peer-%u", i);
+    }
+}
+
+uint32_t mock_tox_add_conference(Tox *tox, const char *title, uint32_t npeers) {
+    uint32_t conference_num = tox_conference_new(tox, NULL);
+    struct MockConference *c = &tox->conferences[conference_num];
+    set_bytes(c->title, &c->title_length, sizeof(c->title), title, strlen(title));
+    resize_peers(tox, c, npeers);
+    return conference_num;
+}
+
+void mock_tox_set_conference_peers(Tox *tox, uint32_t conference_num, uint32_t npeers) {
+    struct MockConference *c = get_conference(tox, conference_num);
+    if (!c) return;
+    resize_peers(tox, c, npeers);
+    if (tox->conference_peer_list_changed_cb) tox->conference_peer_list_changed_cb(tox, conference_num, NULL);
+}
+
+void mock_tox_friend_message(Tox *tox, uint32_t friend_num, const uint8_t *message, size_t length) {
+    if (tox->friend_message_cb && get_friend(tox, friend_num)) {
+        tox->friend_message_cb(tox, friend_num, TOX_MESSAGE_TYPE_NORMAL, message, length, NULL);
+    }
+}
+
+void mock_tox_conference_message(Tox *tox, uint32_t conference_num, uint32_t peer_num,
+                                 const uint8_t *message, size_t length) {
+    if (tox->conference_message_cb && get_peer(tox, conference_num, peer_num, NULL)) {
+        tox->conference_message_cb(tox, conference_num, peer_num, TOX_MESSAGE_TYPE_NORMAL, message, length, NULL);
+    }
+}
+
+uint64_t mock_tox_sent_count(const Tox *tox) {
+    return tox->sent_count;
+}
+
+uint64_t mock_tox_sent_bytes(const Tox *tox) {
+    return tox->sent_bytes;
+}
+
+void mock_tox_set_loopback(Tox *tox, bool loopback) {
+    tox->loopback = loopback;
+}
+
+void mock_tox_set_friend_connection(Tox *tox, uint32_t friend_num, TOX_CONNECTION connection) {
+    struct MockFriend *f = get_friend(tox, friend_num);
+    if (!f) return;
+    f->connection = connection;
+    if (tox->friend_connection_status_cb) tox->friend_connection_status_cb(tox, friend_num, connection, NULL);
+}
@@ -0,0 +1,38 @@
+/*
+ * MiniTox - Mock toxcore
+ *
+ * An in-memory implementation of the parts of the toxcore API used by
+ * minitox. Nothing touches the network: the functions below stand in for
+ * remote peers, so benchmarks can drive minitox's callbacks directly.
+ */
+
+#ifndef MINITOX_MOCK_TOX_H
+#define MINITOX_MOCK_TOX_H
+
+#include <tox/tox.h>
+
+// add a friend as if it was loaded from savedata, return its friend_num.
+uint32_t mock_tox_add_friend(Tox *tox, const char *name, const char *status_message);
+
+// create a conference with `npeers` peers(besides us), return its conference number.
+uint32_t mock_tox_add_conference(Tox *tox, const char *title, uint32_t npeers);
+
+// resize the peer list of a conference and fire the peer_list_changed callback.
+void mock_tox_set_conference_peers(Tox *tox, uint32_t conference_num, uint32_t npeers);
+
+// make a remote peer say something.
+void mock_tox_friend_message(Tox *tox, uint32_t friend_num, const uint8_t *message, size_t length);
+void mock_tox_conference_message(Tox *tox, uint32_t conference_num, uint32_t peer_num,
+                                 const uint8_t *message, size_t length);
+
+// how many messages(and custom packets) minitox has sent through this instance, and their total length.
+uint64_t mock_tox_sent_count(const Tox *tox);
+uint64_t mock_tox_sent_bytes(const Tox *tox);
+
+// make every friend send back what it gets, as if it was another minitox.
+void mock_tox_set_loopback(Tox *tox, bool loopback);
+
+// change a friend's connection and fire the connection_status callback.
+void mock_tox_set_friend_connection(Tox *tox, uint32_t friend_num, TOX_CONNECTION connection);
+
+#endif
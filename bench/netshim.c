@@ -0,0 +1,413 @@
+/*
+ * MiniTox - Network impairment shim
+ *
+ * An LD_PRELOAD library that wraps sendto(2) & recvfrom(2), so that UDP
+ * datagrams between minitox instances on loopback get latency, jitter, loss,
+ * reordering and bandwidth caps, per pair of instances, without root or netem:
+ *
+ *     make netshim.so
+ *     LD_PRELOAD=./netshim.so MINITOX_NETEM='*:* delay=40 jitter=10; 33445:33446 loss=20 rate=64' ./minitox
+ *
+ * Instances are told apart by the UDP port they are bound to(toxcore takes the
+ * first free one from 33445 up). MINITOX_NETEM is a list of rules separated by
+ * ';', each `<from>:<to>` ports(`*`, `<port>` or `<lo>-<hi>`) followed by
+ * settings; every rule matching a pair overrides the settings it gives:
+ *
+ *     delay=<ms>     added to every datagram
+ *     jitter=<ms>    +- uniformly, datagrams may overtake each other
+ *     loss=<%>       dropped at random
+ *     reorder=<%>    sent at once, ahead of those delayed
+ *     rate=<kbit/s>  a link of that bandwidth, queueing up to NETEM_BUFFER_MS
+ *
+ * Only what's sent is impaired, so every instance should run with the shim;
+ * recvfrom is wrapped to count what arrives. TCP(relays) passes through, which
+ * is what lets toxcore fall back to it. Counts per pair are printed to stderr
+ * on exit.
+ */
+
+#define _GNU_SOURCE // for RTLD_NEXT
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NETEM_ENV "MINITOX_NETEM"
+#define NETEM_MAX_RULES 32
+#define NETEM_MAX_PAIRS 256 // pairs with state & counts, more pass through
+#define NETEM_QUEUE_MAX 8192 // datagrams held back at once, more are dropped
+#define NETEM_BUFFER_MS 1000 // most a rate capped link queues, then drops(tail drop)
+#define NETEM_DATAGRAM_MAX 65536
+
+enum {NETEM_DELAY, NETEM_JITTER, NETEM_LOSS, NETEM_REORDER, NETEM_RATE, NETEM_SETTINGS};
+
+static const char *netem_names[NETEM_SETTINGS] = {"delay", "jitter", "loss", "reorder", "rate"};
+
+struct Rule {
+    int from_lo, from_hi, to_lo, to_hi;
+    double value[NETEM_SETTINGS];
+    bool set[NETEM_SETTINGS];
+};
+
+struct Pair {
+    int from, to;                  // ports
+    double value[NETEM_SETTINGS];  // of all rules matching
+    bool impaired;
+    uint64_t link_free_ns;         // when a rate capped link is done with what's queued
+    uint64_t sent, lost, queue_dropped, reordered, delayed, received;
+};
+
+struct Datagram {
+    uint64_t at_ns;
+    uint64_t seq;  // keeps datagrams due at the same time in order
+    int fd;
+    int flags;
+    struct sockaddr_storage to;
+    socklen_t tolen;
+    size_t len;
+    char *data;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool inited, enabled;
+    struct Rule rules[NETEM_MAX_RULES];
+    int nrules;
+    struct Pair pairs[NETEM_MAX_PAIRS];
+    int npairs;
+    struct Datagram queue[NETEM_QUEUE_MAX];  // a min-heap by (at_ns, seq)
+    int queue_len;
+    uint64_t seq;
+    uint64_t rng;
+    bool sender_started;
+    pthread_t sender;
+} netem = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static ssize_t (*real_sendto)(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
+static ssize_t (*real_recvfrom)(int, void *, size_t, int, struct sockaddr *, socklen_t *);
+
+static uint64_t netem_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static double netem_uniform(void) {  // in [0, 1), splitmix64
+    uint64_t z = (netem.rng += 0x9E3779B97F4A7C15u);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+    return ((z ^ (z >> 31)) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*******************************************************************************
+ *
+ * Rules
+ *
+ ******************************************************************************/
+
+// `*`, `<port>` or `<lo>-<hi>`
+static bool parse_ports(const char *s, size_t len, int *lo, int *hi) {
+    char buf[32];
+    if (len == 0 || len >= sizeof(buf)) return false;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    if (strcmp(buf, "*") == 0) {
+        *lo = 0, *hi = 65535;
+        return true;
+    }
+    char *end;
+    *lo = *hi = strtol(buf, &end, 10);
+    if (*end == '-') *hi = strtol(end + 1, &end, 10);
+    return end != buf && *end == '\0' && *lo >= 0 && *hi <= 65535 && *lo <= *hi;
+}
+
+static bool parse_rule(struct Rule *r, char *s) {
+    memset(r, 0, sizeof(*r));
+    char *tok = strtok(s, " \t");
+    if (!tok) return false;
+    char *colon = strchr(tok, ':');
+    if (!colon || !parse_ports(tok, colon - tok, &r->from_lo, &r->from_hi) ||
+        !parse_ports(colon + 1, strlen(colon + 1), &r->to_lo, &r->to_hi)) {
+        return false;
+    }
+    while ((tok = strtok(NULL, " \t"))) {
+        char *eq = strchr(tok, '=');
+        if (!eq) return false;
+        *eq = '\0';
+        int i = 0;
+        while (i < NETEM_SETTINGS && strcmp(tok, netem_names[i]) != 0) i++;
+        char *end;
+        double v = strtod(eq + 1, &end);
+        if (i == NETEM_SETTINGS || end == eq + 1 || *end || v < 0) return false;
+        if ((i == NETEM_LOSS || i == NETEM_REORDER) && v > 100) return false;
+        r->value[i] = v;
+        r->set[i] = true;
+    }
+    return true;
+}
+
+static void netem_init(void) {
+    real_sendto = dlsym(RTLD_NEXT, "sendto");
+    real_recvfrom = dlsym(RTLD_NEXT, "recvfrom");
+    netem.rng = netem_now_ns() ^ ((uint64_t)getpid() << 32);
+    netem.inited = true;
+
+    const char *env = getenv(NETEM_ENV);
+    if (!env || !*env) return;
+    char *rules = strdup(env);
+    for (char *s = rules, *next; s && *s; s = next) {
+        next = strchr(s, ';');
+        if (next) *next++ = '\0';
+        while (*s == ' ') s++;
+        if (!*s) continue;
+        if (netem.nrules == NETEM_MAX_RULES || !parse_rule(&netem.rules[netem.nrules], s)) {
+            fprintf(stderr, "netshim: bad rule in %s, impairing nothing\n", NETEM_ENV);
+            netem.nrules = 0;
+            break;
+        }
+        netem.nrules++;
+    }
+    free(rules);
+    netem.enabled = netem.nrules > 0;
+}
+
+// the state of a pair, settled from the rules the first time it's seen. NULL if the table is full.
+static struct Pair *get_pair(int from, int to) {
+    for (int i = 0; i < netem.npairs; i++) {
+        if (netem.pairs[i].from == from && netem.pairs[i].to == to) return &netem.pairs[i];
+    }
+    if (netem.npairs == NETEM_MAX_PAIRS) return NULL;
+    struct Pair *p = &netem.pairs[netem.npairs++];
+    memset(p, 0, sizeof(*p));
+    p->from = from;
+    p->to = to;
+    for (int i = 0; i < netem.nrules; i++) {
+        struct Rule *r = &netem.rules[i];
+        if (from < r->from_lo || from > r->from_hi || to < r->to_lo || to > r->to_hi) continue;
+        for (int k = 0; k < NETEM_SETTINGS; k++) {
+            if (r->set[k]) p->value[k] = r->value[k];
+        }
+    }
+    for (int k = 0; k < NETEM_SETTINGS; k++) p->impaired |= p->value[k] > 0;
+    return p;
+}
+
+// the port of a loopback address, or -1.
+static int loopback_port(const struct sockaddr *addr, socklen_t len) {
+    if (!addr) return -1;
+    if (addr->sa_family == AF_INET && len >= sizeof(struct sockaddr_in)) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        if ((ntohl(in->sin_addr.s_addr) >> 24) != 127) return -1;
+        return ntohs(in->sin_port);
+    }
+    if (addr->sa_family == AF_INET6 && len >= sizeof(struct sockaddr_in6)) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        const uint8_t *a = in6->sin6_addr.s6_addr;
+        static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        bool loopback = IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr) || (memcmp(a, mapped, 12) == 0 && a[12] == 127);
+        return loopback ? ntohs(in6->sin6_port) : -1;
+    }
+    return -1;
+}
+
+static int local_port(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0) return -1;
+    if (addr.ss_family == AF_INET) return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+    if (addr.ss_family == AF_INET6) return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    return -1;
+}
+
+static bool is_udp(int fd) {
+    int type;
+    socklen_t len = sizeof(type);
+    return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_DGRAM;
+}
+
+/*******************************************************************************
+ *
+ * Queue
+ *
+ ******************************************************************************/
+
+static bool dg_before(const struct Datagram *a, const struct Datagram *b) {
+    return a->at_ns < b->at_ns || (a->at_ns == b->at_ns && a->seq < b->seq);
+}
+
+static void queue_push(struct Datagram *d) {
+    int i = netem.queue_len++;
+    while (i > 0 && dg_before(d, &netem.queue[(i - 1) / 2])) {
+        netem.queue[i] = netem.queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    netem.queue[i] = *d;
+}
+
+static void queue_pop(struct Datagram *out) {
+    *out = netem.queue[0];
+    struct Datagram last = netem.queue[--netem.queue_len];
+    int i = 0;
+    while (true) {
+        int c = 2 * i + 1;
+        if (c >= netem.queue_len) break;
+        if (c + 1 < netem.queue_len && dg_before(&netem.queue[c + 1], &netem.queue[c])) c++;
+        if (!dg_before(&netem.queue[c], &last)) break;
+        netem.queue[i] = netem.queue[c];
+        i = c;
+    }
+    if (netem.queue_len > 0) netem.queue[i] = last;
+}
+
+// sends what's held back when it's due. a socket closed meanwhile just fails.
+static void *sender_thread(void *arg) {
+    pthread_mutex_lock(&netem.lock);
+    while (true) {
+        if (netem.queue_len == 0) {
+            pthread_cond_wait(&netem.cond, &netem.lock);
+            continue;
+        }
+        uint64_t at = netem.queue[0].at_ns, now = netem_now_ns();
+        if (at > now) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t wake = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec + (at - now);
+            ts.tv_sec = wake / 1000000000u;
+            ts.tv_nsec = wake % 1000000000u;
+            pthread_cond_timedwait(&netem.cond, &netem.lock, &ts);
+            continue;
+        }
+        struct Datagram d;
+        queue_pop(&d);
+        pthread_mutex_unlock(&netem.lock);
+        real_sendto(d.fd, d.data, d.len, d.flags, (struct sockaddr *)&d.to, d.tolen);
+        free(d.data);
+        pthread_mutex_lock(&netem.lock);
+    }
+    return NULL;
+}
+
+static void start_sender(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_destroy(&netem.cond);
+    pthread_cond_init(&netem.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    netem.sender_started = pthread_create(&netem.sender, NULL, sender_thread, NULL) == 0;
+    if (netem.sender_started) pthread_detach(netem.sender);
+}
+
+/*******************************************************************************
+ *
+ * Wrappers
+ *
+ ******************************************************************************/
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
+    pthread_mutex_lock(&netem.lock);
+    if (!netem.inited) netem_init();
+    int to_port = netem.enabled ? loopback_port(to, tolen) : -1;
+    struct Pair *p = NULL;
+    if (to_port >= 0 && len <= NETEM_DATAGRAM_MAX && is_udp(fd)) p = get_pair(local_port(fd), to_port);
+    if (!p || !p->impaired) {
+        pthread_mutex_unlock(&netem.lock);
+        return real_sendto(fd, buf, len, flags, to, tolen);
+    }
+
+    p->sent++;
+    if (netem_uniform() * 100 < p->value[NETEM_LOSS]) {
+        p->lost++;
+        pthread_mutex_unlock(&netem.lock);
+        return len;  // as far as the sender knows, it went out
+    }
+    uint64_t now = netem_now_ns(), at = now;
+    if (p->value[NETEM_RATE] > 0) {
+        uint64_t start = p->link_free_ns > now ? p->link_free_ns : now;
+        if (start - now > (uint64_t)NETEM_BUFFER_MS * 1000000u) {
+            p->queue_dropped++;
+            pthread_mutex_unlock(&netem.lock);
+            return len;
+        }
+        p->link_free_ns = start + (uint64_t)(len * 8 * 1e6 / p->value[NETEM_RATE]);
+        at = p->link_free_ns;
+    }
+    if (p->value[NETEM_REORDER] > 0 && netem_uniform() * 100 < p->value[NETEM_REORDER]) {
+        p->reordered++;
+    } else {
+        double ms = p->value[NETEM_DELAY] + (netem_uniform() * 2 - 1) * p->value[NETEM_JITTER];
+        if (ms > 0) at += (uint64_t)(ms * 1e6);
+    }
+
+    if (at <= now) {
+        pthread_mutex_unlock(&netem.lock);
+        return real_sendto(fd, buf, len, flags, to, tolen);
+    }
+    if (!netem.sender_started) start_sender();
+    char *data = malloc(len);
+    if (!netem.sender_started || netem.queue_len == NETEM_QUEUE_MAX || !data || tolen > sizeof(struct sockaddr_storage)) {
+        free(data);
+        p->queue_dropped++;
+        pthread_mutex_unlock(&netem.lock);
+        return len;
+    }
+    struct Datagram d = {at, netem.seq++, fd, flags};
+    memcpy(&d.to, to, tolen);
+    d.tolen = tolen;
+    memcpy(data, buf, len);
+    d.data = data;
+    d.len = len;
+    queue_push(&d);
+    p->delayed++;
+    pthread_cond_signal(&netem.cond);
+    pthread_mutex_unlock(&netem.lock);
+    return len;
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen) {
+    if (!real_recvfrom) {
+        pthread_mutex_lock(&netem.lock);
+        if (!netem.inited) netem_init();
+        pthread_mutex_unlock(&netem.lock);
+    }
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    ssize_t n = real_recvfrom(fd, buf, len, flags, (struct sockaddr *)&addr, &addrlen);
+    if (n >= 0 && netem.enabled) {
+        int from_port = loopback_port((struct sockaddr *)&addr, addrlen);
+        if (from_port >= 0) {
+            pthread_mutex_lock(&netem.lock);
+            struct Pair *p = get_pair(from_port, local_port(fd));
+            if (p) p->received++;
+            pthread_mutex_unlock(&netem.lock);
+        }
+    }
+    if (n >= 0 && from && fromlen) {
+        memcpy(from, &addr, addrlen < *fromlen ? addrlen : *fromlen);
+        *fromlen = addrlen;
+    }
+    return n;
+}
+
+__attribute__((destructor)) static void netem_report(void) {
+    if (!netem.enabled) return;
+    pthread_mutex_lock(&netem.lock);
+    for (int i = 0; i < netem.npairs; i++) {
+        struct Pair *p = &netem.pairs[i];
+        if (p->sent == 0 && p->received == 0) continue;
+        fprintf(stderr, "netshim: %5d -> %-5d sent %llu lost %llu queue-dropped %llu reordered %llu delayed %llu"
+                " | received %llu\n", p->from, p->to, (unsigned long long)p->sent, (unsigned long long)p->lost,
+                (unsigned long long)p->queue_dropped, (unsigned long long)p->reordered,
+                (unsigned long long)p->delayed, (unsigned long long)p->received);
+    }
+    pthread_mutex_unlock(&netem.lock);
+}
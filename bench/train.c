@@ -0,0 +1,91 @@
+/*
+ * MiniTox - Training workload for profile-guided builds
+ *
+ * Linked with minitox and the mock toxcore(or included by bench.c, for
+ * `minitox_bench --train`), with tox_new & tox_iterate wrapped at link
+ * time(see Makefile), this plays a busy session against the
+ * real main loop: friends and group peers flood messages, peers join & leave,
+ * friends go on & offline, while commands come from bench/train.txt on stdin.
+ * After TRAIN_ROUNDS iterations it sends itself SIGTERM, so shutdown gets its
+ * share of the profile too.
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mock_tox.h"
+
+#define TRAIN_ROUNDS 100 // tox_iterate calls before shutting down, 50ms apart
+#define TRAIN_FRIENDS 20
+#define TRAIN_PEERS 200 // most peers a group churns up to
+#define TRAIN_STORM 40 // messages from every friend and group in a storm round, every 4th round
+
+Tox *__real_tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error);
+void __real_tox_iterate(Tox *tox, void *user_data);
+
+bool train_active = true; // the wrappers only pass through if false, as in the benchmarks
+uint64_t train_round;
+
+static const char *train_words[] = {
+    "ping", "the deploy is done", "lunch?", "see the log above", "ok", "brb", "who broke the build",
+    "https://example.org/some/long/path?with=query&and=more", "has anyone tried the new release yet",
+};
+
+#define TRAIN_WORDS (sizeof(train_words) / sizeof(train_words[0]))
+
+Tox *__wrap_tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error) {
+    Tox *tox = __real_tox_new(options, error);
+    if (!tox || !train_active) return tox;
+    // before minitox lists its friends, as if they were in savedata
+    for (uint32_t i = tox_self_get_friend_list_size(tox); i < TRAIN_FRIENDS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "friend-%u", i);
+        mock_tox_add_friend(tox, name, "training");
+    }
+    mock_tox_set_loopback(tox, true); // what we send comes back, through the receiving paths
+    return tox;
+}
+
+void __wrap_tox_iterate(Tox *tox, void *user_data) {
+    __real_tox_iterate(tox, user_data);
+    if (!train_active) return;
+    uint64_t r = train_round++;
+    if (r == TRAIN_ROUNDS) raise(SIGTERM);
+    if (r >= TRAIN_ROUNDS) return; // shutting down
+
+    char msg[256];
+    int n = r % 4 == 0 ? TRAIN_STORM : 1;
+
+    size_t nfriends = tox_self_get_friend_list_size(tox);
+    uint32_t friends[nfriends + 1];
+    tox_self_get_friend_list(tox, friends);
+    for (size_t i = 0; i < nfriends; i++) {
+        for (int k = 0; k < n; k++) {
+            int len = snprintf(msg, sizeof(msg), "%s (%llu)", train_words[(r + i + k) % TRAIN_WORDS],
+                               (unsigned long long)r);
+            mock_tox_friend_message(tox, friends[i], (const uint8_t *)msg, len);
+        }
+    }
+    // all come online at first, then a friend drops and comes back every other round
+    if (r == 0) {
+        for (size_t i = 0; i < nfriends; i++) mock_tox_set_friend_connection(tox, friends[i], TOX_CONNECTION_UDP);
+    } else if (nfriends) {
+        mock_tox_set_friend_connection(tox, friends[r / 2 % nfriends],
+                                       r % 2 ? TOX_CONNECTION_UDP : TOX_CONNECTION_NONE);
+    }
+
+    size_t ngroups = tox_conference_get_chatlist_size(tox);
+    uint32_t groups[ngroups + 1];
+    tox_conference_get_chatlist(tox, groups);
+    for (size_t i = 0; i < ngroups; i++) {
+        // peers join and leave every round, the list is rebuilt each time
+        uint32_t npeers = 1 + (r * 37 + i * 11) % TRAIN_PEERS;
+        mock_tox_set_conference_peers(tox, groups[i], npeers);
+        for (int k = 0; k < n; k++) {
+            int len = snprintf(msg, sizeof(msg), "%s", train_words[(r * 7 + k) % TRAIN_WORDS]);
+            mock_tox_conference_message(tox, groups[i], 1 + k % npeers, (const uint8_t *)msg, len);
+        }
+    }
+}
@@ -5,6 +5,12 @@
 #ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #endif
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE // for syscall(2)
+#endif
+#if defined(MINITOX_ALLOC_PROFILE) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // for dladdr(3)
+#endif
 
 #include <stdio.h>
 #include <stdint.h>
@@ -12,13 +18,33 @@
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#ifdef MINITOX_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 #include <tox/tox.h>
 
+#include "minitox_plugin.h"
+
 /*******************************************************************************
  *
  * Consts & Macros
@@ -30,10 +56,25 @@
 const char *savedata_filename = "./savedata.tox";
 const char *savedata_tmp_filename = "./savedata.tox.tmp";
 
+// where to save the checkpoint of minitox's own state(contacts, recent history),
+// which makes restart faster. it's written along with the tox data.
+// if don't want to save, set it to NULL.
+const char *checkpoint_filename = "./minitox.ckpt";
+const char *checkpoint_tmp_filename = "./minitox.ckpt.tmp";
+
+// with `--daemon`, minitox runs in background and UI clients attach to it
+// through this unix socket, by `--attach`.
+const char *socket_filename = "./minitox.sock";
+
+// settings which can be changed without restarting, read at startup and again
+// on SIGHUP or `/reload`. see "Config" for what can be set there.
+// if don't want to use one, set it to NULL.
+const char *config_filename = "./minitox.conf";
+
 struct DHT_node {
     const char *ip;
     uint16_t port;
-    const char key_hex[TOX_PUBLIC_KEY_SIZE*2 + 1];
+    char key_hex[TOX_PUBLIC_KEY_SIZE*2 + 1];
 };
 
 struct DHT_node bootstrap_nodes[] = {
@@ -45,7 +86,7 @@ struct DHT_node bootstrap_nodes[] = {
     {"2400:6180:0:d0::17a:a001",   33445, "B05C8869DBB4EDDD308F43C1A974A20A725A36EACCA123862FDE9945BF9D3E09"},
 };
 
-#define LINE_MAX_SIZE 512  // If input line's length surpassed this value, it will be truncated.
+#define LINE_MAX_SIZE 8192  // If input line's length surpassed this value, it will be truncated. longer messages than TOX_MAX_MESSAGE_LENGTH are sent in pieces.
 
 #define PORT_RANGE_START 33445     // tox listen port range
 #define PORT_RANGE_END   34445
@@ -54,8 +95,48 @@ struct DHT_node bootstrap_nodes[] = {
 
 #define DEFAULT_CHAT_HIST_COUNT  20 // how many items of chat history to show by default;
 
+#define MAX_CHAT_HIST_COUNT 0 // max items of chat history per contact, the oldest ones are dropped and reused. 0 for no limit.
+#define BODY_SHARE_MAX 4096 // message bodies up to this length are stored once for all records with the same text
+
+#define COLD_HIST_AFTER 600 // unit: second. history no one has read for this long is compressed in the background,
+#define HOT_HIST_COUNT 50   // except for the latest items of it.
+#define HIST_BLOCK_COUNT 100 // how many items are compressed together
+#define COLD_SCAN_INTERVAL 10 // unit: second. how often to look for cold history
+
+#define EVENT_LOG_RING_SIZE (4 * 1024 * 1024) // events waiting to be written by `--log`, must be a power of 2. more are dropped.
+#define EVENT_LOG_LINE_MAX (1024 * 1024) // an event longer than this is dropped
+#define EVENT_LOG_FLUSH_MS 200 // how often the log writer wakes up, to write everything since last time at once
+#define EVENT_LOG_MAX_SIZE (16 * 1024 * 1024) // the log is rotated once it's this large,
+#define EVENT_LOG_MAX_AGE (24 * 3600) // or this old(unit: second),
+#define EVENT_LOG_KEEP 5 // keeping this many old ones as <file>.1 ~ <file>.N
+
+#define URING_ENTRIES 16 // io_uring queue size, with `make IO_URING=1`
+
+#define ALLOC_SITES 1024 // call sites told apart with `make ALLOC_PROFILE=1`, must be a power of 2. more are counted as others
+#define ALLOC_TOP 15 // how many call sites `/allocstats` shows, by count and by bytes
+
+#define HIST_NAME_SIZE 13 // chat history keeps at most 12 chars of sender's name, as message prefixes show.
+
+#define OUTBUF_SIZE (64 * 1024) // terminal output is buffered and written once per loop iteration.
+#define CLIENT_OUTBUF_SIZE (256 * 1024) // output buffered for an attached client; if it can't keep up, the overflow is dropped.
+
 #define SAVEDATA_AFTER_COMMAND true // whether save data after executing any command
 
+#define SHUTDOWN_DEADLINE_MS 3000 // on quitting, how long to wait at most for sent messages to be received
+
+#define NOTIFY_INTERVAL 0 // unit: second. a friend's messages are noticed at most once in this long, while you talk to someone else
+
+#define CHECKPOINT_HIST_COUNT 20 // how many items of chat history per friend to keep in checkpoint
+
+#define MAX_PLUGINS 16 // how many `--plugin`s can be loaded
+#define PLUGIN_CALL_BUDGET_US 2000 // a plugin hook running longer than this is counted as slow
+
+#define MAX_MENTIONS 200 // how many mentions `/mentions` remembers
+
+#define MAX_REASSEMBLED_SIZE (64 * 1024) // a split message longer than this is shown in parts
+
+#define MAX_LARGE_MESSAGE_SIZE (1024 * 1024) // longest message sent compressed to another minitox, e.g. by `/paste`
+
 /// Macros for terminal display
 
 #define CODE_ERASE_LINE    "\r\033[2K"
@@ -64,6 +145,7 @@ struct DHT_node bootstrap_nodes[] = {
 #define SELF_TALK_COLOR    "\x01b[35m"  // magenta
 #define GUEST_TALK_COLOR   "\x01b[90m" // bright black
 #define CMD_PROMPT_COLOR   "\x01b[34m" // blue
+#define MENTION_COLOR      "\x01b[1;33m" // bold yellow
 
 #define CMD_PROMPT   CMD_PROMPT_COLOR "> " RESET_COLOR // green
 #define FRIEND_TALK_PROMPT  CMD_PROMPT_COLOR "%-.12s << " RESET_COLOR
@@ -73,15 +155,24 @@ struct DHT_node bootstrap_nodes[] = {
 #define SELF_MSG_PREFIX  SELF_TALK_COLOR "%s  %12.12s | " RESET_COLOR
 #define CMD_MSG_PREFIX  CMD_PROMPT
 
-#define PRINT(_fmt, ...) \
-    fputs(CODE_ERASE_LINE,stdout);\
-    printf(_fmt "\n", ##__VA_ARGS__);
+// print to the view being served, or to all views if there's none(e.g. in tox callbacks).
+#define LEVEL_PRINT(_level, _fmt, ...) do { \
+        struct View *_only = view; \
+        for (view = _only ? _only : views; view; view = _only ? NULL : view->next) { \
+            if (view->json) json_log(_level, _fmt, ##__VA_ARGS__); \
+            else out_printf(CODE_ERASE_LINE _fmt "\n", ##__VA_ARGS__); \
+        } \
+        view = _only; \
+    } while (0);
+
+#define PRINT(_fmt, ...) LEVEL_PRINT("print", _fmt, ##__VA_ARGS__)
 
-#define COLOR_PRINT(_color, _fmt,...) PRINT(_color _fmt RESET_COLOR, ##__VA_ARGS__)
+#define COLOR_PRINT(_level, _color, _fmt,...) LEVEL_PRINT(_level, _color _fmt RESET_COLOR, ##__VA_ARGS__)
 
-#define INFO(_fmt,...) COLOR_PRINT("\x01b[36m", _fmt, ##__VA_ARGS__)  // cyran
-#define WARN(_fmt,...) COLOR_PRINT("\x01b[33m", _fmt, ##__VA_ARGS__) // yellow
-#define ERROR(_fmt,...) COLOR_PRINT("\x01b[31m", _fmt, ##__VA_ARGS__) // red
+// INFO & WARN are left out if `log_level` of the config is higher.
+#define INFO(_fmt,...) do { if (config.log_level <= LOG_LEVEL_INFO) COLOR_PRINT("info", "\x01b[36m", _fmt, ##__VA_ARGS__) } while (0);  // cyran
+#define WARN(_fmt,...) do { if (config.log_level <= LOG_LEVEL_WARN) COLOR_PRINT("warn", "\x01b[33m", _fmt, ##__VA_ARGS__) } while (0); // yellow
+#define ERROR(_fmt,...) COLOR_PRINT("error", "\x01b[31m", _fmt, ##__VA_ARGS__) // red
 
 
 /*******************************************************************************
@@ -92,6 +183,28 @@ struct DHT_node bootstrap_nodes[] = {
 
 Tox *tox;
 
+enum { LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR };
+
+// settings which can be changed without restarting, see "Config".
+struct Config {
+    uint32_t history_size;      // MAX_CHAT_HIST_COUNT
+    uint32_t history_shown;     // DEFAULT_CHAT_HIST_COUNT
+    uint32_t cold_history_after;  // COLD_HIST_AFTER
+    uint32_t hot_history_count; // HOT_HIST_COUNT
+    uint32_t notify_interval;   // NOTIFY_INTERVAL
+    uint32_t plugin_call_budget_us;  // PLUGIN_CALL_BUDGET_US
+    uint32_t save_after_command;  // SAVEDATA_AFTER_COMMAND
+    uint32_t log_level;         // LOG_LEVEL_*
+    struct DHT_node *nodes;     // bootstrap nodes
+    size_t node_count;
+};
+
+#define DEFAULT_CONFIG {MAX_CHAT_HIST_COUNT, DEFAULT_CHAT_HIST_COUNT, COLD_HIST_AFTER, HOT_HIST_COUNT, NOTIFY_INTERVAL, \
+        PLUGIN_CALL_BUDGET_US, SAVEDATA_AFTER_COMMAND, LOG_LEVEL_INFO, \
+        bootstrap_nodes, sizeof(bootstrap_nodes)/sizeof(struct DHT_node)}
+
+struct Config config = DEFAULT_CONFIG;
+
 typedef void CommandHandler(int narg, char **args);
 
 struct Command {
@@ -124,10 +237,67 @@ struct Request {
     struct Request *next;
 };
 
+// a message body, shared by all history records with the same text, see body_get().
+struct Body {
+    struct Body *next;  // in the same bucket of body_store
+    uint32_t hash;
+    uint32_t refs;
+    bool shared;        // whether it's in body_store
+    size_t len;
+    size_t cap;
+    char data[];
+};
+
 struct ChatHist {
-    char *msg;
-    struct ChatHist *next;
-    struct ChatHist *prev;
+    uint64_t serial;  // increases with every record, identifies it even after it's reused
+    time_t time;
+    bool is_self;
+    uint8_t name_len;
+    char name[HIST_NAME_SIZE];
+    struct ChatHist *next;  // older one
+    struct ChatHist *prev;  // newer one
+    struct Body *body;
+    const char *msg;  // message body without prefix, NUL-terminated. same as body->data
+    size_t msg_len;
+};
+
+// items of history packed & compressed, see freeze_hist().
+struct HistBlock {
+    struct HistBlock *next;   // older one
+    struct HistBlock *qnext;  // in the compressor's queue
+    uint32_t count;           // how many items
+    size_t hist_bytes;        // memory the items took before being packed
+    size_t raw_len;           // packed length
+    uint8_t *data;            // packed items, compressed if `compressed`
+    size_t data_len;
+    bool compressed;          // these three are guarded by compressor.lock
+    bool queued;
+    bool busy;
+};
+
+struct History {
+    struct ChatHist *newest;
+    struct ChatHist *oldest;
+    size_t count;
+    struct HistBlock *blocks;  // items older than `oldest`, newest block first
+    size_t packed_count;
+    time_t last_read;          // when it was last shown, by coarse_time()
+};
+
+// pieces received of a long message, see reassemble().
+struct Pending {
+    struct Body *body;  // joined right into the body it's kept in
+};
+
+// a large message being received over custom packets, see send_large_message().
+struct Inbound {
+    uint32_t id;
+    uint8_t codec;      // LARGE_CODEC_*
+    uint32_t raw_len;   // length of the message
+    uint8_t *buf;       // the payload, compressed or not
+    struct Body *body;  // where the message goes, also holding `buf` if it's not compressed
+    size_t len;         // how much of it has arrived
+    size_t cap;         // its whole length
 };
 
 struct GroupPeer {
@@ -141,7 +311,8 @@ struct Group {
     struct GroupPeer *peers;
     size_t peers_count;
 
-    struct ChatHist *hist;
+    struct History hist;
+    uint32_t unread;  // messages came while no one is talking here
 
     struct Group *next;
 };
@@ -153,13 +324,73 @@ struct Friend {
     uint8_t pubkey[TOX_PUBLIC_KEY_SIZE];
     TOX_CONNECTION connection;
 
-    struct ChatHist *hist;
+    struct History hist;
+    struct Pending pending;
+    uint8_t caps;  // CAP_* the friend announced, 0 if it's not minitox
+    struct Inbound inbound;
+    time_t notified_at;  // when you were last told of a message from this friend
+    uint32_t unreceipted;  // messages sent, but not receipted by the friend yet
+    uint32_t unacked;  // large messages sent, but not acked by the friend yet
 
     struct Friend *next;
 };
 
 int NEW_STDIN_FILENO = STDIN_FILENO;
 
+struct OutBuf {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fd;
+    bool nonblock;      // never wait for the fd, drop output when the buffer is full.
+    bool fresh;         // written since the prompt was redrawn
+    uint64_t dropped;   // bytes dropped since last notice
+    size_t line_start;  // where the unfinished line begins, output is dropped by whole lines
+    bool skip_line;     // dropping until the end of current line
+};
+
+struct AsyncREPL {
+    char *line;
+    char *prompt;
+    size_t sz;
+    int  nbuf;
+    int nstack;
+    uint32_t escaped;
+};
+
+// A View is a UI attached to minitox: the local terminal, or a client over
+// the unix socket in daemon mode. Each one has its own input line, output
+// buffer and conversation.
+struct View {
+    int fd;
+    struct OutBuf out;
+    struct AsyncREPL repl;
+
+    uint32_t talking_to;    // contact index, or TALK_TYPE_NULL
+    uint32_t hist_scroll;   // how many items from the oldest `/history` has shown
+    bool json;              // print events as JSON lines
+    bool is_client;         // attached over the socket
+    bool handshaked;        // client has sent its `ATTACH` line
+    bool closing;
+
+    struct View *next;
+};
+
+struct View *views = NULL;
+struct View *view = NULL; // the view being served, output goes there
+
+bool json_mode = false;  // `--json`
+void json_log(const char *level, const char *fmt, ...);
+
+struct Event;
+void plugins_dispatch(const struct Event *e);
+void drop_oldest_block(struct History *hist);
+void drop_inbound(struct Inbound *in);
+void log_event(const struct Event *e);
+void flush_file_writes(void);
+void flush_views(void);
+void run_command(char *line);
+
 struct Request *requests = NULL;
 
 struct Friend *friends = NULL;
@@ -168,8 +399,6 @@ struct Group *groups = NULL;
 
 enum TALK_TYPE { TALK_TYPE_FRIEND, TALK_TYPE_GROUP, TALK_TYPE_COUNT, TALK_TYPE_NULL = UINT32_MAX };
 
-uint32_t TalkingTo = TALK_TYPE_NULL;
-
 
 /*******************************************************************************
  *
@@ -177,6 +406,101 @@ uint32_t TalkingTo = TALK_TYPE_NULL;
  *
  ******************************************************************************/
 
+void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        data += n;
+        len -= n;
+    }
+}
+
+// write out as much as possible. returns false if something is left,
+// which only happens to non-blocking ones.
+bool outbuf_flush(struct OutBuf *ob) {
+    size_t off = 0;
+    while (off < ob->len) {
+        ssize_t n = write(ob->fd, ob->buf + off, ob->len - off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+    if (!ob->nonblock) off = ob->len;  // can't be written, drop it rather than pile up
+    memmove(ob->buf, ob->buf + off, ob->len - off);
+    ob->len -= off;
+    ob->line_start = ob->line_start > off ? ob->line_start - off : 0;
+    return ob->len == 0;
+}
+
+void outbuf_write(struct OutBuf *ob, const void *data, size_t len) {
+    ob->fresh = true;
+    bool eol = len > 0 && ((const char *)data)[len - 1] == '\n';
+    if (ob->skip_line) {
+        ob->dropped += len;
+        if (eol) ob->skip_line = false;
+        return;
+    }
+    if (ob->len + len > ob->cap) {
+        outbuf_flush(ob);
+        if (ob->len + len > ob->cap) {
+            if (ob->nonblock) {
+                // drop the whole line, so that a client never gets a broken one
+                ob->dropped += len + ob->len - ob->line_start;
+                ob->len = ob->line_start;
+                ob->skip_line = !eol;
+            } else {
+                write_all(ob->fd, data, len);  // rare, larger than the whole buffer
+            }
+            return;
+        }
+    }
+    memcpy(ob->buf + ob->len, data, len);
+    ob->len += len;
+    if (eol) ob->line_start = ob->len;
+}
+
+void out_flush(void) {
+    outbuf_flush(&view->out);
+}
+
+void out_write(const void *data, size_t len) {
+    outbuf_write(&view->out, data, len);
+}
+
+// for string literals, whose length is known at compile time.
+#define OUT_PUTS(_s) out_write(_s, sizeof(_s) - 1)
+
+void out_printf(const char *fmt, ...) {
+    struct OutBuf *ob = &view->out;
+    ob->fresh = true;
+    va_list va;
+    va_start(va, fmt);
+    va_list va2;
+    va_copy(va2, va);
+    size_t room = ob->skip_line ? 0 : ob->cap - ob->len;
+    int n = vsnprintf(room ? ob->buf + ob->len : NULL, room, fmt, va2);
+    va_end(va2);
+
+    if (n >= 0 && (size_t)n >= room) {  // didn't fit
+        outbuf_flush(ob);
+        if (!ob->skip_line && (size_t)n < ob->cap - ob->len) {
+            vsnprintf(ob->buf + ob->len, ob->cap - ob->len, fmt, va);
+        } else {
+            char *tmp = malloc(n + 1);
+            vsnprintf(tmp, n + 1, fmt, va);
+            outbuf_write(ob, tmp, n);
+            free(tmp);
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        ob->len += n;
+        if (ob->buf[ob->len - 1] == '\n') ob->line_start = ob->len;
+    }
+    va_end(va);
+}
+
 #define RESIZE(key, size_key, length) \
     if ((size_key) < (length + 1)) { \
         size_key = (length+1);\
@@ -202,35 +526,384 @@ bool str2uint(char *str, uint32_t *num) {
     return true;
 }
 
-char* genmsg(struct ChatHist **pp, const char *fmt, ...) {
-    va_list va;
-    va_start(va, fmt);
+#ifdef CLOCK_MONOTONIC_COARSE
+#define COARSE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define COARSE_CLOCK CLOCK_MONOTONIC
+#endif
 
-    va_list va2;
-    va_copy(va2, va);
-    size_t len = vsnprintf(NULL, 0, fmt, va2);
-    va_end(va2);
+#define CLOCK_RESYNC_INTERVAL 60 // unit: second
+#define CLOCK_JUMP_NS 1000000000 // the wall clock is only followed if it's off by more than this
+
+// Wall clock in seconds, driven by the coarse monotonic clock, which is much
+// cheaper to read. Every CLOCK_RESYNC_INTERVAL it's checked against the real
+// clock, to nanoseconds, and re-anchored if the wall clock jumped. Smaller
+// differences, such as the coarse clock lagging by a tick, are left alone,
+// otherwise stored times could step back a second.
+time_t coarse_time(void) {
+    static int64_t anchor = 0;  // wall clock - monotonic clock, unit: nanosecond
+    static time_t resync_at = 0;
+
+    struct timespec ts;
+    clock_gettime(COARSE_CLOCK, &ts);
+    int64_t mono = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (ts.tv_sec >= resync_at) {
+        struct timespec real;
+        clock_gettime(CLOCK_REALTIME, &real);
+        int64_t diff = (int64_t)real.tv_sec * 1000000000 + real.tv_nsec - mono;
+        if (resync_at == 0 || llabs(diff - anchor) > CLOCK_JUMP_NS) anchor = diff;
+        resync_at = ts.tv_sec + CLOCK_RESYNC_INTERVAL;
+    }
+    return (mono + anchor) / 1000000000;
+}
+
+// format `t` as "%H:%M:%S". UTC offsets are whole minutes, so localtime() is
+// only needed when the minute changes; in between only the seconds are patched.
+const char *fmttime(time_t t) {
+    static char timebuf[16];
+    static time_t cached = -1;
+
+    if (t == cached) return timebuf;
+    if (cached == -1 || t / 60 != cached / 60) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(timebuf, sizeof(timebuf), "%H:%M:%S", &tm);
+    } else {
+        int sec = t % 60;
+        if (sec < 0) sec += 60;
+        timebuf[6] = '0' + sec / 10;
+        timebuf[7] = '0' + sec % 10;
+    }
+    cached = t;
+    return timebuf;
+}
+
+const char *getftime(void) {
+    return fmttime(coarse_time());
+}
+
+// copy a length-delimited string(e.g. from toxcore) into a NUL-terminated one.
+char *setstr(char *str, const void *src, size_t len) {
+    str = realloc(str, len + 1);
+    memcpy(str, src, len);
+    str[len] = '\0';
+    return str;
+}
+
+// hash 8 bytes a step, much faster than strhash() for message bodies.
+uint32_t memhash(const char *s, size_t len) {
+    uint64_t h = len * 0x9E3779B97F4A7C15u, v;
+    for (; len >= 8; s += 8, len -= 8) {
+        memcpy(&v, s, 8);
+        h = (h ^ v) * 0xFF51AFD7ED558CCDu;
+        h ^= h >> 32;
+    }
+    v = 0;
+    memcpy(&v, s, len);
+    h = (h ^ v) * 0xFF51AFD7ED558CCDu;
+    return h ^ h >> 32;
+}
+
+/// Message bodies are content addressed: the same text sent to many contacts,
+/// like a broadcast announcement, is stored once and shared by refcount.
+/// Bodies longer than BODY_SHARE_MAX are rarely repeated, and aren't hashed.
+
+struct BodyStore {
+    struct Body **buckets;
+    size_t nbuckets;    // power of 2
+    size_t count;       // shared bodies
+    size_t bytes;       // allocated for all bodies
+    size_t text_bytes;  // what they would take if every record had its own copy
+    uint64_t copied;    // bytes of received and sent messages copied on their way into bodies
+} body_store;
+
+void body_unshare(struct Body *b) {
+    struct Body **p = &body_store.buckets[b->hash & (body_store.nbuckets - 1)];
+    LIST_FIND(p, *p == b);
+    *p = b->next;
+    b->shared = false;
+    body_store.count--;
+}
+
+void body_put(struct Body *b) {
+    if (!b) return;
+    body_store.text_bytes -= b->len;
+    if (--b->refs > 0) return;
+    if (b->shared) body_unshare(b);
+    body_store.bytes -= sizeof(struct Body) + b->cap;
+    free(b);
+}
+
+void body_grow_buckets(void) {
+    size_t nbuckets = body_store.nbuckets ? body_store.nbuckets * 2 : 256;
+    struct Body **buckets = calloc(nbuckets, sizeof(struct Body *));
+    for (size_t i = 0; i < body_store.nbuckets; i++) {
+        while (body_store.buckets[i]) {
+            struct Body *b = body_store.buckets[i];
+            body_store.buckets[i] = b->next;
+            b->next = buckets[b->hash & (nbuckets - 1)];
+            buckets[b->hash & (nbuckets - 1)] = b;
+        }
+    }
+    free(body_store.buckets);
+    body_store.buckets = buckets;
+    body_store.nbuckets = nbuckets;
+}
+
+struct Body *body_find(const char *msg, size_t len, uint32_t hash) {
+    if (body_store.nbuckets == 0) return NULL;
+    struct Body *b = body_store.buckets[hash & (body_store.nbuckets - 1)];
+    for (; b; b = b->next) {
+        if (b->hash == hash && b->len == len && memcmp(b->data, msg, len) == 0) return b;
+    }
+    return NULL;
+}
+
+void body_share(struct Body *b) {
+    if (body_store.count >= body_store.nbuckets) body_grow_buckets();
+    struct Body **bucket = &body_store.buckets[b->hash & (body_store.nbuckets - 1)];
+    b->next = *bucket;
+    *bucket = b;
+    b->shared = true;
+    body_store.count++;
+}
+
+// get a reference to the body with `msg`, and drop the one to `old`, whose
+// memory is reused if no one else has it. So replacing a body costs no heap
+// traffic, unless it has to grow.
+struct Body *body_get(const char *msg, size_t len, struct Body *old) {
+    bool share = len <= BODY_SHARE_MAX;
+    uint32_t hash = 0;
+    if (share) {
+        hash = memhash(msg, len);
+        struct Body *b = body_find(msg, len, hash);
+        if (b) {
+            b->refs++;
+            body_store.text_bytes += len;
+            body_put(old);
+            return b;
+        }
+    }
+
+    struct Body *b = NULL;
+    if (old && old->refs == 1 && old->cap >= len + 1) {
+        b = old;
+        body_store.text_bytes -= b->len;
+        if (b->shared) body_unshare(b);
+    } else {
+        body_put(old);
+        size_t cap = 64 - sizeof(struct Body);
+        while (cap < len + 1) cap = cap * 2 + sizeof(struct Body);
+        b = malloc(sizeof(struct Body) + cap);
+        b->cap = cap;
+        b->refs = 1;
+        b->shared = false;
+        body_store.bytes += sizeof(struct Body) + cap;
+    }
+    b->hash = hash;
+    b->len = len;
+    memcpy(b->data, msg, len);
+    b->data[len] = '\0';
+    body_store.copied += len;
+    body_store.text_bytes += len;
+    if (share) body_share(b);
+    return b;
+}
+
+// Messages which come in pieces or packets are put together right in a body of
+// their own, which is then adopted as is, so their text isn't copied again.
+
+// make room for `need` bytes and the NUL in a body not adopted yet, NULL for a new one.
+struct Body *body_reserve(struct Body *b, size_t need) {
+    if (b && b->cap > need) return b;
+    size_t cap = b ? b->cap * 2 : 16 * 1024;  // most long messages fit at once
+    if (cap <= need) cap = need + 1;
+    struct Body *nb = realloc(b, sizeof(struct Body) + cap);
+    if (!b) {
+        nb->hash = 0;
+        nb->refs = 1;
+        nb->shared = false;
+        nb->len = 0;
+    }
+    nb->cap = cap;
+    return nb;
+}
+
+// take over `b`, filled with b->len bytes, or a reference to an equal body if there's one.
+struct Body *body_adopt(struct Body *b) {
+    b->data[b->len] = '\0';
+    body_store.text_bytes += b->len;
+    if (b->len <= BODY_SHARE_MAX) {
+        b->hash = memhash(b->data, b->len);
+        struct Body *found = body_find(b->data, b->len, b->hash);
+        if (found) {
+            found->refs++;
+            free(b);
+            return found;
+        }
+    }
+    if (b->cap > b->len + 1 + b->len / 4) {  // shrinks in place
+        b = realloc(b, sizeof(struct Body) + b->len + 1);
+        b->cap = b->len + 1;
+    }
+    body_store.bytes += sizeof(struct Body) + b->cap;
+    if (b->len <= BODY_SHARE_MAX) body_share(b);
+    return b;
+}
+
+// If `history_size` is set, once a contact has that many items, the oldest one
+// is recycled for the new message, along with its body if it's not shared. So
+// there is no heap traffic per message in the steady state.
+uint64_t hist_serial = 0;
+
+// a new item, without its body yet, which is in `*old` if the item is recycled.
+struct ChatHist *newhist(struct History *hist, time_t time, bool is_self, const char *name, struct Body **old) {
+    struct ChatHist *h = NULL;
+    *old = NULL;
+    uint32_t max = config.history_size;
+    if (max > 0 && hist->packed_count > 0 && hist->count + hist->packed_count >= max) {
+        drop_oldest_block(hist);
+    }
+    if (max > 0 && hist->count >= max) {
+        h = hist->oldest;
+        hist->oldest = h->prev;
+        if (hist->oldest) hist->oldest->next = NULL;
+        else hist->newest = NULL;
+        hist->count--;
+        *old = h->body;
+    } else {
+        h = malloc(sizeof(struct ChatHist));
+    }
+
+    h->serial = ++hist_serial;
+    h->time = time;
+    h->is_self = is_self;
+    h->name_len = name ? strnlen(name, HIST_NAME_SIZE - 1) : 0;
+    // if it's cut, not inside a UTF-8 char
+    for (int k = 0; k < 3 && h->name_len > 0 && ((uint8_t)name[h->name_len] & 0xC0) == 0x80; k++) h->name_len--;
+    memcpy(h->name, name, h->name_len);
+    h->name[h->name_len] = '\0';
 
-    struct ChatHist *h = malloc(sizeof(struct ChatHist));
     h->prev = NULL;
-    h->next = (*pp);
-    if (*pp) (*pp)->prev = h;
-    *pp = h;
-    h->msg = malloc(len+1);
+    h->next = hist->newest;
+    if (hist->newest) hist->newest->prev = h;
+    else hist->oldest = h;
+    hist->newest = h;
+    hist->count++;
+    return h;
+}
 
-    vsnprintf(h->msg, len+1, fmt, va);
-    va_end(va);
+struct ChatHist *addhist(struct History *hist, time_t time, bool is_self, const char *name, const char *msg, size_t len) {
+    struct Body *old;
+    struct ChatHist *h = newhist(hist, time, is_self, name, &old);
+    h->body = body_get(msg, len, old);
+    h->msg = h->body->data;
+    h->msg_len = len;
+    return h;
+}
 
-    return h->msg;
+// same as addhist(), but the message is already in `body`, see body_adopt().
+struct ChatHist *addhist_body(struct History *hist, time_t time, bool is_self, const char *name, struct Body *body) {
+    struct Body *old;
+    struct ChatHist *h = newhist(hist, time, is_self, name, &old);
+    body_put(old);
+    h->body = body_adopt(body);
+    h->msg = h->body->data;
+    h->msg_len = h->body->len;
+    return h;
 }
 
-char* getftime(void) {
-    static char timebuf[64];
+void freehist(struct History *hist) {
+    while (hist->newest) {
+        struct ChatHist *tmp = hist->newest;
+        hist->newest = tmp->next;
+        body_put(tmp->body);
+        free(tmp);
+    }
+    hist->oldest = NULL;
+    hist->count = 0;
+    while (hist->blocks) drop_oldest_block(hist);
+}
 
-    time_t tt = time(NULL);
-    struct tm *tm = localtime(&tt);
-    strftime(timebuf, sizeof(timebuf), "%H:%M:%S", tm);
-    return timebuf;
+// drop the oldest items, until at most `max` are left.
+void trimhist(struct History *hist, size_t max) {
+    while (hist->blocks && hist->count + hist->packed_count > max) drop_oldest_block(hist);
+    while (hist->count > max) {
+        struct ChatHist *tmp = hist->oldest;
+        hist->oldest = tmp->prev;
+        if (hist->oldest) hist->oldest->next = NULL;
+        else hist->newest = NULL;
+        hist->count--;
+        body_put(tmp->body);
+        free(tmp);
+    }
+}
+
+/// Messages longer than TOX_MAX_MESSAGE_LENGTH are sent in pieces, split on
+/// word or UTF-8 boundaries. To a friend who announced CAP_LARGE_MESSAGE, every
+/// piece but the last ends with SPLIT_MARK, an invisible separator(U+2063), by
+/// which minitox joins the pieces back into one message. Other clients, and
+/// groups, where no one announces anything, get plain pieces.
+
+#define SPLIT_MARK "\xE2\x81\xA3"
+#define SPLIT_MARK_LEN (sizeof(SPLIT_MARK) - 1)
+
+// length of the next piece to send, leaving room for SPLIT_MARK if `mark`.
+size_t split_message(const char *msg, size_t len, bool mark) {
+    if (len <= TOX_MAX_MESSAGE_LENGTH) return len;
+
+    size_t max = TOX_MAX_MESSAGE_LENGTH - (mark ? SPLIT_MARK_LEN : 0);
+    for (size_t i = max; i > max * 3 / 4; i--) {  // after a space, if there's one near the end
+        if (msg[i - 1] == ' ' || msg[i - 1] == '\n') return i;
+    }
+    // not inside a UTF-8 char, which is 4 bytes at most. cut anyway if it's not valid UTF-8
+    for (size_t cut = max; cut > max - 4; cut--) {
+        if (((uint8_t)msg[cut] & 0xC0) != 0x80) return cut;
+    }
+    return max;
+}
+
+// feed a received piece. returns false if more are coming. Otherwise `*body`
+// is set to the whole message for addhist_body(), or NULL if it's a plain
+// message, as almost all are, which is left in msg & len.
+bool reassemble(struct Pending *p, const char *msg, size_t len, struct Body **body) {
+    *body = NULL;
+    bool more = len > SPLIT_MARK_LEN && memcmp(msg + len - SPLIT_MARK_LEN, SPLIT_MARK, SPLIT_MARK_LEN) == 0;
+    if (more) len -= SPLIT_MARK_LEN;
+    if (!more && !p->body) return true;
+
+    struct Body *b = p->body = body_reserve(p->body, (p->body ? p->body->len : 0) + len);
+    memcpy(b->data + b->len, msg, len);
+    body_store.copied += len;
+    b->len += len;
+    if (more && b->len < MAX_REASSEMBLED_SIZE) return false;
+
+    *body = b;
+    p->body = NULL;
+    return true;
+}
+
+// Same as PRINT(*_MSG_PREFIX "%s", ...), but assembled from fragments whose
+// lengths are known, instead of parsing a format string for every message.
+void json_hist(struct ChatHist *h);
+
+void print_hist(struct ChatHist *h) {
+    static const char spaces[] = "            ";
+    if (json_mode) {
+        json_hist(h);
+        return;
+    }
+
+    OUT_PUTS(CODE_ERASE_LINE);
+    if (h->is_self) OUT_PUTS(SELF_TALK_COLOR);
+    else OUT_PUTS(GUEST_TALK_COLOR);
+    out_write(fmttime(h->time), 8);
+    OUT_PUTS("  ");
+    out_write(spaces, 12 - h->name_len);  // right aligned, as %12.12s
+    out_write(h->name, h->name_len);
+    OUT_PUTS(" | " RESET_COLOR);
+    out_write(h->msg, h->msg_len);
+    OUT_PUTS("\n");
 }
 
 const char * connection_enum2text(TOX_CONNECTION conn) {
@@ -258,6 +931,7 @@ struct Friend *addfriend(uint32_t friend_num) {
     friends = f;
     f->friend_num = friend_num;
     f->connection = TOX_CONNECTION_NONE;
+    f->hist.last_read = coarse_time();  // not cold right after startup
     tox_friend_get_public_key(tox, friend_num, f->pubkey, NULL);
     return f;
 }
@@ -271,11 +945,9 @@ bool delfriend(uint32_t friend_num) {
         *p = f->next;
         if (f->name) free(f->name);
         if (f->status_message) free(f->status_message);
-        while (f->hist) {
-            struct ChatHist *tmp = f->hist;
-            f->hist = f->hist->next;
-            free(tmp);
-        }
+        freehist(&f->hist);
+        free(f->pending.body);
+        drop_inbound(&f->inbound);
         free(f);
         return 1;
     }
@@ -288,6 +960,7 @@ struct Group *addgroup(uint32_t group_num) {
     groups = cf;
 
     cf->group_num = group_num;
+    cf->hist.last_read = coarse_time();
 
     return cf;
 }
@@ -300,11 +973,7 @@ bool delgroup(uint32_t group_num) {
         *p = cf->next;
         if (cf->peers) free(cf->peers);
         if (cf->title) free(cf->title);
-        while (cf->hist) {
-            struct ChatHist *tmp = cf->hist;
-            cf->hist = cf->hist->next;
-            free(tmp);
-        }
+        freehist(&cf->hist);
         free(cf);
         return 1;
     }
@@ -317,31 +986,396 @@ struct Group *getgroup(uint32_t group_num) {
     return *p;
 }
 
-uint8_t *hex2bin(const char *hex)
-{
-    size_t len = strlen(hex) / 2;
-    uint8_t *bin = malloc(len);
+// value+1 of every hex digit, 0 for anything else.
+static const uint8_t hex_digits[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+// decode `len` hex chars into `bin`, which should have room for len/2 bytes.
+// return false if `len` is odd or there is any non-hex char.
+bool hex2bin(uint8_t *bin, const char *hex, size_t len) {
+    if (len % 2 != 0) return false;
+
+    uint8_t bad = 0;
+    for (size_t i = 0; i < len / 2; i++, hex += 2) {
+        uint8_t hi = hex_digits[(uint8_t)hex[0]];
+        uint8_t lo = hex_digits[(uint8_t)hex[1]];
+        bad |= (hi == 0) | (lo == 0);
+        bin[i] = ((hi - 1) << 4) | ((lo - 1) & 0xF);
+    }
+    return !bad;
+}
+
+// `hex` should have room for 2*length+1 chars.
+char *bin2hex(char *hex, const uint8_t *bin, size_t length) {
+    static const char digits[16] = "0123456789ABCDEF";
+    for (size_t i = 0; i < length; i++) {
+        hex[2*i] = digits[bin[i] >> 4];
+        hex[2*i + 1] = digits[bin[i] & 0xF];
+    }
+    hex[2*length] = '\0';
+    return hex;
+}
+
+/// LZ compressor for large messages, in the LZ4 block format: sequences of
+/// [token][literal length..][literals][offset(2, LE)][match length..], where the
+/// token holds 4 bits of each length and 255-bytes follow if they're longer.
+/// Chat text compresses well with just a small hash table of 4-byte prefixes.
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5  // the format ends with literals
+#define LZ_MATCH_LIMIT 12   // no match starts in the last bytes
+#define LZ_ERROR ((size_t)-1)
+
+#define LZ_HASH(v) (((v) * 2654435761u) >> (32 - LZ_HASH_BITS))
+
+// max compressed length of `len` bytes, for incompressible data.
+size_t lz_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+uint64_t lz_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// copy 8 bytes at a time, so up to 7 bytes past `dst + len` may be written.
+void lz_wildcopy(uint8_t *dst, const uint8_t *src, size_t len) {
+    uint8_t *end = dst + len;
+    do {
+        memcpy(dst, src, 8);
+        dst += 8;
+        src += 8;
+    } while (dst < end);
+}
+
+uint8_t *lz_put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
 
-    for (size_t i = 0; i < len; ++i, hex += 2) {
-        sscanf(hex, "%2hhx", &bin[i]);
+uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) op = lz_put_len(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (offset == 0) return op;  // the last one
+
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    *token |= match_len >= 15 ? 15 : match_len;
+    if (match_len >= 15) op = lz_put_len(op, match_len - 15);
+    return op;
+}
+
+// `dst` should have room for lz_compress_bound(len) bytes. returns the compressed length.
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0};  // position + 1 of where a prefix was last seen
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    uint8_t *op = dst;
+
+    if (len > LZ_MATCH_LIMIT) {
+        const uint8_t *limit = end - LZ_MATCH_LIMIT;
+        while (ip < limit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = LZ_HASH(seq);
+            size_t pos = table[h];
+            table[h] = ip - src + 1;
+            const uint8_t *ref = pos ? src + pos - 1 : NULL;
+            if (!ref || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+                ip += 1 + ((ip - anchor) >> 6);  // skip faster through incompressible data
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mend = ip + LZ_MIN_MATCH, *r = ref + LZ_MIN_MATCH;
+            while (mend + 8 <= end - LZ_LAST_LITERALS && lz_read64(mend) == lz_read64(r)) {
+                mend += 8;
+                r += 8;
+            }
+            while (mend < end - LZ_LAST_LITERALS && *mend == *r) {
+                mend++;
+                r++;
+            }
+            op = lz_put_sequence(op, anchor, ip - anchor, ip - ref, mend - ip);
+            table[LZ_HASH(lz_read32(mend - 2))] = mend - 2 - src + 1;
+            ip = anchor = mend;
+        }
+    }
+    op = lz_put_sequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+// returns the decompressed length, or LZ_ERROR if `src` is corrupted or doesn't fit in `cap`.
+size_t lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *end = src + len;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= end) return LZ_ERROR;
+                lit_len += b = *ip++;
+            } while (b == 255);
+        }
+        if ((size_t)(end - ip) < lit_len || (size_t)(oend - op) < lit_len) return LZ_ERROR;
+        if ((size_t)(end - ip) >= lit_len + 8 && (size_t)(oend - op) >= lit_len + 8) {
+            lz_wildcopy(op, ip, lit_len);
+        } else {
+            memcpy(op, ip, lit_len);
+        }
+        op += lit_len;
+        ip += lit_len;
+        if (ip == end) break;  // the last sequence has no match
+
+        if (end - ip < 2) return LZ_ERROR;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return LZ_ERROR;
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= end) return LZ_ERROR;
+                match_len += b = *ip++;
+            } while (b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < match_len) return LZ_ERROR;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= 8 && (size_t)(oend - op) >= match_len + 8) {
+            lz_wildcopy(op, ref, match_len);
+            op += match_len;
+        } else if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            while (match_len--) *op++ = *ref++;  // overlapping, repeats the last `offset` bytes
+        }
+    }
+    return op - dst;
+}
+
+/// Aho-Corasick automaton, to find any number of keywords in a text in one pass.
+// Keywords are matched ignoring ASCII case. Adding one only adds trie nodes,
+// ac_prune() frees them again once no keyword needs them. The failure links
+// are recomputed by ac_build(), or on the first match after any change.
+
+#define AC_LOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+struct ACNode {
+    uint32_t child;     // first edge, 0 if none. the next free node, if it's free
+    uint32_t fail;      // the longest proper suffix which is also in the trie
+    uint32_t dict;      // next node on the fail chain which has `out`, 0 if none
+    void *out;          // set by user on nodes which end a keyword
+};
+
+struct ACEdge {         // edges[v] is the one to nodes[v]
+    uint32_t from;
+    uint32_t to;        // 0 if free
+    uint32_t sibling;   // next edge from the same node
+    uint8_t c;
+};
+
+struct AhoCorasick {
+    struct ACNode *nodes;   // nodes[0] is the root
+    uint32_t nnodes, nodes_cap;
+    struct ACEdge *edges;   // edges[0] is unused
+    uint32_t nedges, edges_cap;
+    uint32_t *slots;        // open addressing hash of (from, c) -> edge
+    uint32_t slots_mask;
+    uint32_t free_nodes;    // pruned ones, linked by `child`
+    bool dirty;             // failure links are out of date
+};
+
+typedef void ACMatchFn(void *ctx, void *out, size_t end);
+
+uint32_t ac_slot(uint32_t from, uint8_t c, uint32_t mask) {
+    return (uint32_t)((((uint64_t)from << 8 | c) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+uint32_t ac_goto(const struct AhoCorasick *ac, uint32_t from, uint8_t c) {
+    for (uint32_t i = ac_slot(from, c, ac->slots_mask); ac->slots[i]; i = (i + 1) & ac->slots_mask) {
+        const struct ACEdge *e = &ac->edges[ac->slots[i]];
+        if (e->from == from && e->c == c) return e->to;
+    }
+    return 0;
+}
+
+void ac_grow_slots(struct AhoCorasick *ac) {
+    uint32_t size = ac->slots ? (ac->slots_mask + 1) * 2 : 64;
+    free(ac->slots);
+    ac->slots = calloc(size, sizeof(uint32_t));
+    ac->slots_mask = size - 1;
+    for (uint32_t e = 1; e < ac->nedges; e++) {
+        if (ac->edges[e].to == 0) continue;
+        uint32_t i = ac_slot(ac->edges[e].from, ac->edges[e].c, ac->slots_mask);
+        while (ac->slots[i]) i = (i + 1) & ac->slots_mask;
+        ac->slots[i] = e;
     }
+}
+
+// returns the node where the keyword ends, set `out` of it by ac_set_out().
+uint32_t ac_insert(struct AhoCorasick *ac, const char *key, size_t len) {
+    if (ac->nnodes == 0) {
+        ac->nodes_cap = ac->edges_cap = 64;
+        ac->nodes = calloc(ac->nodes_cap, sizeof(struct ACNode));
+        ac->edges = calloc(ac->edges_cap, sizeof(struct ACEdge));
+        ac->nnodes = ac->nedges = 1;
+        ac_grow_slots(ac);
+    }
+
+    uint32_t s = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = AC_LOWER((uint8_t)key[i]);
+        uint32_t t = ac_goto(ac, s, c);
+        if (t == 0) {
+            if (ac->free_nodes) {
+                t = ac->free_nodes;
+                ac->free_nodes = ac->nodes[t].child;
+            } else {
+                if (ac->nnodes == ac->nodes_cap) {
+                    ac->nodes_cap *= 2;
+                    ac->nodes = realloc(ac->nodes, ac->nodes_cap * sizeof(struct ACNode));
+                }
+                if (ac->nedges == ac->edges_cap) {
+                    ac->edges_cap *= 2;
+                    ac->edges = realloc(ac->edges, ac->edges_cap * sizeof(struct ACEdge));
+                }
+                if ((ac->nedges + 1) * 2 > ac->slots_mask + 1) ac_grow_slots(ac);
+                t = ac->nnodes++;
+                ac->nedges++;
+            }
+            memset(&ac->nodes[t], 0, sizeof(struct ACNode));
+            uint32_t e = t;
+            ac->edges[e].from = s;
+            ac->edges[e].to = t;
+            ac->edges[e].c = c;
+            ac->edges[e].sibling = ac->nodes[s].child;
+            ac->nodes[s].child = e;
+
+            uint32_t slot = ac_slot(s, c, ac->slots_mask);
+            while (ac->slots[slot]) slot = (slot + 1) & ac->slots_mask;
+            ac->slots[slot] = e;
+            ac->dirty = true;
+        }
+        s = t;
+    }
+    return s;
+}
+
+void ac_set_out(struct AhoCorasick *ac, uint32_t node, void *out) {
+    if ((ac->nodes[node].out == NULL) != (out == NULL)) ac->dirty = true;
+    ac->nodes[node].out = out;
+}
+
+// remove edge `e` from the slots, moving back the ones after it which would
+// no longer be found past the hole.
+void ac_unslot(struct AhoCorasick *ac, uint32_t e) {
+    uint32_t mask = ac->slots_mask;
+    uint32_t i = ac_slot(ac->edges[e].from, ac->edges[e].c, mask);
+    while (ac->slots[i] != e) i = (i + 1) & mask;
+    for (uint32_t j = (i + 1) & mask; ac->slots[j]; j = (j + 1) & mask) {
+        const struct ACEdge *x = &ac->edges[ac->slots[j]];
+        uint32_t k = ac_slot(x->from, x->c, mask);
+        if (((j - k) & mask) >= ((j - i) & mask)) {  // its home isn't in (i, j]
+            ac->slots[i] = ac->slots[j];
+            i = j;
+        }
+    }
+    ac->slots[i] = 0;
+}
 
-    return bin;
+// free `node` and its parents up the trie, as long as no keyword ends at or
+// goes through them. call it after ac_set_out(ac, node, NULL).
+void ac_prune(struct AhoCorasick *ac, uint32_t node) {
+    while (node != 0 && ac->nodes[node].child == 0 && ac->nodes[node].out == NULL) {
+        uint32_t parent = ac->edges[node].from;
+        uint32_t *p = &ac->nodes[parent].child;
+        while (*p != node) p = &ac->edges[*p].sibling;
+        *p = ac->edges[node].sibling;
+        ac_unslot(ac, node);
+        memset(&ac->edges[node], 0, sizeof(struct ACEdge));
+        ac->nodes[node].child = ac->free_nodes;
+        ac->free_nodes = node;
+        ac->dirty = true;
+        node = parent;
+    }
+}
+
+// compute failure links, breadth first.
+void ac_build(struct AhoCorasick *ac) {
+    uint32_t *queue = malloc(ac->nnodes * sizeof(uint32_t));
+    uint32_t head = 0, tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        uint32_t u = queue[head++];
+        for (uint32_t e = ac->nodes[u].child; e; e = ac->edges[e].sibling) {
+            uint32_t v = ac->edges[e].to;
+            uint8_t c = ac->edges[e].c;
+            uint32_t f = 0;
+            if (u != 0) {
+                f = ac->nodes[u].fail;
+                while (f != 0 && ac_goto(ac, f, c) == 0) f = ac->nodes[f].fail;
+                f = ac_goto(ac, f, c);
+            }
+            ac->nodes[v].fail = f;
+            ac->nodes[v].dict = ac->nodes[f].out ? f : ac->nodes[f].dict;
+            queue[tail++] = v;
+        }
+    }
+    free(queue);
+    ac->dirty = false;
 }
 
-char *bin2hex(const uint8_t *bin, size_t length) {
-    char *hex = malloc(2*length + 1);
-    char *saved = hex;
-    for (int i=0; i<length;i++,hex+=2) {
-        sprintf(hex, "%02X",bin[i]);
+// call `fn` for every occurrence of every keyword in text, in O(len + occurrences).
+void ac_match(struct AhoCorasick *ac, const char *text, size_t len, ACMatchFn *fn, void *ctx) {
+    if (ac->nnodes == 0) return;
+    if (ac->dirty) ac_build(ac);
+
+    uint32_t s = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = AC_LOWER((uint8_t)text[i]);
+        uint32_t t;
+        while ((t = ac_goto(ac, s, c)) == 0 && s != 0) s = ac->nodes[s].fail;
+        s = t;
+        for (uint32_t o = ac->nodes[s].out ? s : ac->nodes[s].dict; o; o = ac->nodes[o].dict) {
+            fn(ctx, ac->nodes[o].out, i + 1);
+        }
     }
-    return saved;
 }
 
-struct ChatHist ** get_current_histp(void) {
-    if (TalkingTo == TALK_TYPE_NULL) return NULL;
-    uint32_t num = INDEX_TO_NUM(TalkingTo);
-    switch (INDEX_TO_TYPE(TalkingTo)) {
+void ac_free(struct AhoCorasick *ac) {
+    free(ac->nodes);
+    free(ac->edges);
+    free(ac->slots);
+    memset(ac, 0, sizeof(struct AhoCorasick));
+}
+
+struct History *get_histp(uint32_t contact) {
+    if (contact == TALK_TYPE_NULL) return NULL;
+    uint32_t num = INDEX_TO_NUM(contact);
+    switch (INDEX_TO_TYPE(contact)) {
         case TALK_TYPE_FRIEND: {
             struct Friend *f = getfriend(num);
             if (f) return &f->hist;
@@ -356,41 +1390,510 @@ struct ChatHist ** get_current_histp(void) {
     return NULL;
 }
 
+struct History *get_current_histp(void) {
+    return view ? get_histp(view->talking_to) : NULL;
+}
+
 /*******************************************************************************
  *
- * Async REPL
+ * Cold History
  *
  ******************************************************************************/
 
-struct AsyncREPL {
-    char *line;
-    char *prompt;
-    size_t sz;
-    int  nbuf;
-    int nstack;
+/// History no one has read for COLD_HIST_AFTER seconds is packed in blocks of
+/// HIST_BLOCK_COUNT items, but the latest HOT_HIST_COUNT, which events and
+/// checkpoints need. Packing is cheap and done here; compressing the blocks is
+/// left to a background thread, so the tox loop isn't held up. Blocks are
+/// unpacked into plain items again once the history is read, see thaw_hist().
+///
+/// The compressor thread only touches blocks in its queue, and the one it's
+/// compressing(`busy`). The main thread claims a block back before reading or
+/// freeing it.
+
+struct Compressor {
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // a block was queued
+    pthread_cond_t done;  // a block is no longer busy
+    struct HistBlock *queue;
+    bool started;
+} compressor = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, false};
+
+void *compressor_main(void *arg) {
+    pthread_mutex_lock(&compressor.lock);
+    for (;;) {
+        while (!compressor.queue) pthread_cond_wait(&compressor.work, &compressor.lock);
+        struct HistBlock *b = compressor.queue;
+        compressor.queue = b->qnext;
+        b->queued = false;
+        b->busy = true;
+        pthread_mutex_unlock(&compressor.lock);
+
+        uint8_t *out = malloc(lz_compress_bound(b->raw_len));
+        size_t len = lz_compress(b->data, b->raw_len, out);
+
+        pthread_mutex_lock(&compressor.lock);
+        if (len < b->raw_len) {
+            free(b->data);
+            b->data = realloc(out, len);
+            b->data_len = len;
+            b->compressed = true;
+        } else {
+            free(out);
+        }
+        b->busy = false;
+        pthread_cond_broadcast(&compressor.done);
+    }
+    return NULL;
+}
+
+void compress_block(struct HistBlock *b) {
+    if (!compressor.started) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, compressor_main, NULL) != 0) {
+            return;  // keep it packed only
+        }
+        pthread_detach(thread);
+        compressor.started = true;
+    }
+    pthread_mutex_lock(&compressor.lock);
+    b->qnext = compressor.queue;
+    compressor.queue = b;
+    b->queued = true;
+    pthread_cond_signal(&compressor.work);
+    pthread_mutex_unlock(&compressor.lock);
+}
+
+// take a block back from the compressor, after that it's only touched by the main thread.
+void claim_block(struct HistBlock *b) {
+    pthread_mutex_lock(&compressor.lock);
+    if (b->queued) {
+        struct HistBlock **p = &compressor.queue;
+        while (*p != b) p = &(*p)->qnext;
+        *p = b->qnext;
+        b->queued = false;
+    }
+    while (b->busy) pthread_cond_wait(&compressor.done, &compressor.lock);
+    pthread_mutex_unlock(&compressor.lock);
+}
+
+void drop_oldest_block(struct History *hist) {
+    struct HistBlock **p = &hist->blocks;
+    while ((*p)->next) p = &(*p)->next;
+    struct HistBlock *b = *p;
+    *p = NULL;
+    claim_block(b);
+    hist->packed_count -= b->count;
+    free(b->data);
+    free(b);
+}
+
+// each item is packed as [serial(8)][time(8)][is_self(1)][name_len(1)][name][msg_len(4)][msg]
+#define PACKED_HIST_HEADER_SIZE 22
+
+// pack the oldest HIST_BLOCK_COUNT items, as long as HOT_HIST_COUNT are left,
+// which is at least 1.
+void freeze_hist(struct History *hist) {
+    while (hist->count >= config.hot_history_count + HIST_BLOCK_COUNT) {
+        struct ChatHist *first = hist->oldest;  // newest of the block
+        for (int i = 1; i < HIST_BLOCK_COUNT; i++) first = first->prev;
+
+        struct HistBlock *b = calloc(1, sizeof(struct HistBlock));
+        for (struct ChatHist *h = first; h; h = h->next) {
+            b->raw_len += PACKED_HIST_HEADER_SIZE + h->name_len + h->msg_len;
+            b->hist_bytes += sizeof(struct ChatHist);
+            if (h->body->refs == 1) b->hist_bytes += sizeof(struct Body) + h->body->cap;
+        }
+        b->data = malloc(b->raw_len);
+        b->data_len = b->raw_len;
+        uint8_t *p = b->data;
+        hist->oldest = first->prev;
+        hist->oldest->next = NULL;
+        while (first) {
+            struct ChatHist *h = first;
+            first = h->next;
+            uint64_t time = h->time;
+            uint32_t msg_len = h->msg_len;
+            memcpy(p, &h->serial, 8);
+            memcpy(p + 8, &time, 8);
+            p[16] = h->is_self;
+            p[17] = h->name_len;
+            memcpy(p + 18, h->name, h->name_len);
+            p += 18 + h->name_len;
+            memcpy(p, &msg_len, 4);
+            memcpy(p + 4, h->msg, h->msg_len);
+            p += 4 + h->msg_len;
+
+            body_put(h->body);
+            free(h);
+            b->count++;
+        }
+        hist->count -= b->count;
+        hist->packed_count += b->count;
+        b->next = hist->blocks;
+        hist->blocks = b;
+        compress_block(b);
+    }
+}
+
+// unpack every block back into plain items, which is quick enough to do
+// whenever an old item may be needed.
+void thaw_hist(struct History *hist) {
+    hist->last_read = coarse_time();
+    while (hist->blocks) {
+        struct HistBlock *b = hist->blocks;
+        claim_block(b);
+        hist->blocks = b->next;
+        hist->packed_count -= b->count;
+        uint8_t *raw = b->data;
+        if (b->compressed) {
+            raw = malloc(b->raw_len);
+            if (lz_decompress(b->data, b->data_len, raw, b->raw_len) != b->raw_len) {
+                ERROR("! history block corrupted, %u items dropped", b->count);
+                free(raw);
+                free(b->data);
+                free(b);
+                continue;
+            }
+        }
+        const uint8_t *p = raw;
+        for (uint32_t i = 0; i < b->count; i++) {
+            struct ChatHist *h = malloc(sizeof(struct ChatHist));
+            uint64_t time;
+            uint32_t msg_len;
+            memcpy(&h->serial, p, 8);
+            memcpy(&time, p + 8, 8);
+            h->time = time;
+            h->is_self = p[16];
+            h->name_len = p[17];
+            memcpy(h->name, p + 18, h->name_len);
+            h->name[h->name_len] = '\0';
+            p += 18 + h->name_len;
+            memcpy(&msg_len, p, 4);
+            h->body = body_get((const char *)p + 4, msg_len, NULL);
+            h->msg = h->body->data;
+            h->msg_len = msg_len;
+            p += 4 + msg_len;
+
+            h->next = NULL;
+            h->prev = hist->oldest;
+            if (hist->oldest) hist->oldest->next = h;
+            else hist->newest = h;
+            hist->oldest = h;
+        }
+        hist->count += b->count;
+        if (raw != b->data) free(raw);
+        free(b->data);
+        free(b);
+    }
+}
+
+bool hist_is_cold(struct History *hist, uint32_t contact, time_t now) {
+    if (hist->count < config.hot_history_count + HIST_BLOCK_COUNT || now - hist->last_read < config.cold_history_after) return false;
+    for (struct View *v = views; v; v = v->next) {
+        if (v->talking_to == contact) return false;
+    }
+    return true;
+}
+
+void freeze_cold_hists(void) {
+    time_t now = coarse_time();
+    for (struct Friend *f = friends; f; f = f->next) {
+        if (hist_is_cold(&f->hist, GEN_INDEX(f->friend_num, TALK_TYPE_FRIEND), now)) freeze_hist(&f->hist);
+    }
+    for (struct Group *cf = groups; cf; cf = cf->next) {
+        if (hist_is_cold(&cf->hist, GEN_INDEX(cf->group_num, TALK_TYPE_GROUP), now)) freeze_hist(&cf->hist);
+    }
+}
+
+// memory taken by items in blocks, before and after being packed.
+void hist_block_bytes(struct History *hist, size_t *before, size_t *after) {
+    *before = *after = 0;
+    pthread_mutex_lock(&compressor.lock);
+    for (struct HistBlock *b = hist->blocks; b; b = b->next) {
+        *before += b->hist_bytes;
+        *after += sizeof(struct HistBlock) + b->data_len;
+    }
+    pthread_mutex_unlock(&compressor.lock);
+}
+
+/*******************************************************************************
+ *
+ * File Writes
+ *
+ ******************************************************************************/
+
+/// Savedata and checkpoints are written as a whole to a temporary file, which
+/// is then renamed over the old one. With `make IO_URING=1`, the write is
+/// submitted to io_uring and the main loop only polls for its completion,
+/// instead of waiting for the disk. Without it, or if the kernel refuses
+/// io_uring, files are written on the spot.
+///
+/// A file being written when it's updated again gets the newer content queued,
+/// replacing anything queued before, as only the latest one matters.
+
+struct FileWrite {
+    const char *path;
+    const char *tmp_path;
+    char *buf;          // being written
+    size_t len;
+    size_t done;
+    int fd;
+    char *next;         // to be written after `buf`
+    size_t next_len;
 };
 
-struct termios saved_tattr;
+struct FileWrite savedata_write, checkpoint_write;
+
+// write `buf` to `fw->tmp_path` at once, and move it to `fw->path` if that worked.
+void write_file_now(struct FileWrite *fw, const char *buf, size_t len) {
+    int fd = open(fw->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) return;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    if (close(fd) == 0 && done == len) {
+        rename(fw->tmp_path, fw->path);
+    } else {
+        unlink(fw->tmp_path);
+    }
+}
+
+#ifdef MINITOX_IO_URING
+
+struct Uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned in_flight;
+    bool tried;
+    bool unusable;  // new writes are done on the spot
+} uring = {-1};
+
+bool setup_uring(void) {
+    uring.tried = true;
+    uring.unusable = true;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd == -1) return false;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+    }
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);  // the mappings are small, and this only happens once
+        return false;
+    }
+
+    uring.fd = fd;
+    uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    uring.sqes = sqes;
+    uring.sq_entries = p.sq_entries;
+    uring.unusable = false;
+    atexit(flush_file_writes);
+    return true;
+}
+
+// submit a write of what's left of `fw->buf`. returns false if it can't be submitted.
+bool uring_submit_write(struct FileWrite *fw) {
+    unsigned tail = *uring.sq_tail;
+    if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries) return false;
+    unsigned i = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fw->fd;
+    sqe->addr = (uintptr_t)(fw->buf + fw->done);
+    sqe->len = fw->len - fw->done;
+    sqe->off = fw->done;
+    sqe->user_data = (uintptr_t)fw;
+    uring.sq_array[i] = i;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, uring.fd, 1, 0, 0, NULL, 0) != 1) {
+        __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);  // not taken by the kernel
+        return false;
+    }
+    uring.in_flight++;
+    return true;
+}
+
+void start_file_write(struct FileWrite *fw) {
+    fw->done = 0;
+    fw->fd = open(fw->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fw->fd != -1 && !uring.unusable && uring_submit_write(fw)) return;
+
+    if (fw->fd != -1) close(fw->fd);
+    write_file_now(fw, fw->buf, fw->len);
+    free(fw->buf);
+    fw->buf = NULL;
+}
+
+void finish_file_write(struct FileWrite *fw, int res) {
+    uring.in_flight--;
+    if (res > 0) {
+        fw->done += res;
+        if (fw->done < fw->len && uring_submit_write(fw)) return;
+    }
+    if (res == -EINVAL || res == -EOPNOTSUPP) {
+        // the kernel is too old for IORING_OP_WRITE, stop using io_uring
+        uring.unusable = true;
+    }
+    if (close(fw->fd) == 0 && fw->done == fw->len) {
+        rename(fw->tmp_path, fw->path);
+    } else if (res > 0 || uring.unusable) {  // couldn't resubmit, or io_uring can't write
+        write_file_now(fw, fw->buf, fw->len);
+    } else {
+        unlink(fw->tmp_path);
+        ERROR("! write %s failed: %s", fw->path, strerror(res < 0 ? -res : EIO));
+    }
+    free(fw->buf);
+    fw->buf = NULL;
+    if (fw->next) {
+        fw->buf = fw->next;
+        fw->len = fw->next_len;
+        fw->next = NULL;
+        start_file_write(fw);
+    }
+}
+
+// reap completed writes, `wait` for at least one if any is in flight.
+void poll_file_writes(bool wait) {
+    if (uring.fd == -1 || uring.in_flight == 0) return;
+    if (wait) syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+    unsigned head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        struct FileWrite *fw = (struct FileWrite *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+        finish_file_write(fw, res);
+        head = *uring.cq_head;
+    }
+}
+
+bool file_writes_pending(void) {
+    return uring.fd != -1 && uring.in_flight > 0;
+}
+
+// `buf` is taken over, and freed once written.
+void write_file(struct FileWrite *fw, char *buf, size_t len) {
+    if (!uring.tried) setup_uring();
+    if (uring.unusable) {
+        write_file_now(fw, buf, len);
+        free(buf);
+        return;
+    }
+    if (fw->buf) {  // being written, replace what's queued
+        free(fw->next);
+        fw->next = buf;
+        fw->next_len = len;
+        return;
+    }
+    fw->buf = buf;
+    fw->len = len;
+    start_file_write(fw);
+}
+
+#else
+
+void poll_file_writes(bool wait) {}
+
+bool file_writes_pending(void) {
+    return false;
+}
+
+void write_file(struct FileWrite *fw, char *buf, size_t len) {
+    write_file_now(fw, buf, len);
+    free(buf);
+}
+
+#endif
+
+// wait for all writes, e.g. before exiting.
+void flush_file_writes(void) {
+    while (file_writes_pending()) poll_file_writes(true);
+}
+
+/*******************************************************************************
+ *
+ * Async REPL
+ *
+ ******************************************************************************/
 
-struct AsyncREPL *async_repl;
+struct termios saved_tattr;
 
 void arepl_exit(void) {
     tcsetattr(NEW_STDIN_FILENO, TCSAFLUSH, &saved_tattr);
 }
 
+struct View *new_view(int fd, int out_fd, bool is_client, bool json) {
+    struct View *v = calloc(1, sizeof(struct View));
+    v->fd = fd;
+    v->out.fd = out_fd;
+    v->out.nonblock = is_client;
+    v->out.cap = is_client ? CLIENT_OUTBUF_SIZE : OUTBUF_SIZE;
+    v->out.buf = malloc(v->out.cap);
+    v->repl.sz = LINE_MAX_SIZE;
+    v->repl.line = malloc(LINE_MAX_SIZE);
+    v->repl.prompt = calloc(1, LINE_MAX_SIZE);
+    if (!json) strcpy(v->repl.prompt, CMD_PROMPT);
+    v->talking_to = TALK_TYPE_NULL;
+    v->json = json;
+    v->is_client = is_client;
+
+    struct View **p = &views;
+    while (*p) p = &(*p)->next;
+    *p = v;
+    return v;
+}
+
+void del_view(struct View *v) {
+    struct View **p = &views;
+    while (*p && *p != v) p = &(*p)->next;
+    if (*p) *p = v->next;
+    if (v->is_client) close(v->fd);
+    free(v->out.buf);
+    free(v->repl.line);
+    free(v->repl.prompt);
+    free(v);
+}
+
 void setup_arepl(void) {
+    if (json_mode) { // no terminal, read lines from stdin as they come
+        int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+        fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+        new_view(STDIN_FILENO, STDOUT_FILENO, false, true);
+        return;
+    }
+
     if (!(isatty(STDIN_FILENO) && isatty(STDOUT_FILENO))) {
         fputs("! stdout & stdin should be connected to tty", stderr);
         exit(1);
     }
-    async_repl = malloc(sizeof(struct AsyncREPL));
-    async_repl->nbuf = 0;
-    async_repl->nstack = 0;
-    async_repl->sz = LINE_MAX_SIZE;
-    async_repl->line = malloc(LINE_MAX_SIZE);
-    async_repl->prompt = malloc(LINE_MAX_SIZE);
-
-    strcpy(async_repl->prompt, CMD_PROMPT);
 
     // stdin and stdout may share the same file obj,
     // reopen stdin to avoid accidentally getting stdout modified.
@@ -402,10 +1905,12 @@ void setup_arepl(void) {
         exit(1);
     }
 #else  // linux
-    if (readlink("/proc/self/fd/0", stdin_path, sizeof(stdin_path)) == -1) {
+    ssize_t path_len = readlink("/proc/self/fd/0", stdin_path, sizeof(stdin_path) - 1);
+    if (path_len == -1) {
         fputs("! get stdin filename failed", stderr);
         exit(1);
     }
+    stdin_path[path_len] = '\0';  // readlink() doesn't terminate it
 #endif
 
     NEW_STDIN_FILENO = open(stdin_path, O_RDONLY);
@@ -429,30 +1934,37 @@ void setup_arepl(void) {
     tcsetattr(NEW_STDIN_FILENO, TCSAFLUSH, &tattr);
 
     atexit(arepl_exit);
+
+    new_view(NEW_STDIN_FILENO, STDOUT_FILENO, false, false);
 }
 
 void arepl_reprint(struct AsyncREPL *arepl) {
-    fputs(CODE_ERASE_LINE, stdout);
-    if (arepl->prompt) fputs(arepl->prompt, stdout);
-    if (arepl->nbuf > 0) printf("%.*s", arepl->nbuf, arepl->line);
+    if (view->json) {
+        out_flush();
+        view->out.fresh = false;
+        return;
+    }
+    OUT_PUTS(CODE_ERASE_LINE);
+    if (arepl->prompt) out_write(arepl->prompt, strlen(arepl->prompt));
+    if (arepl->nbuf > 0) out_write(arepl->line, arepl->nbuf);
     if (arepl->nstack > 0) {
-        printf("%.*s",(int)arepl->nstack, arepl->line + arepl->sz - arepl->nstack);
-        printf("\033[%dD",arepl->nstack); // move cursor
+        out_write(arepl->line + arepl->sz - arepl->nstack, arepl->nstack);
+        out_printf("\033[%dD",arepl->nstack); // move cursor
     }
-    fflush(stdout);
+    out_flush();
+    view->out.fresh = false;
 }
 
 #define _AREPL_CURSOR_LEFT() arepl->line[arepl->sz - (++arepl->nstack)] = arepl->line[--arepl->nbuf]
 #define _AREPL_CURSOR_RIGHT() arepl->line[arepl->nbuf++] = arepl->line[arepl->sz - (arepl->nstack--)]
 
 int arepl_readline(struct AsyncREPL *arepl, char c, char *line, size_t sz){
-    static uint32_t escaped = 0;
     if (c == '\033') { // mark escape code
-        escaped = 1;
+        arepl->escaped = 1;
         return 0;
     }
 
-    if (escaped>0) escaped++;
+    if (arepl->escaped>0) arepl->escaped++;
 
     switch (c) {
         case '\n': {
@@ -491,17 +2003,1069 @@ int arepl_readline(struct AsyncREPL *arepl, char c, char *line, size_t sz){
 
         case 'D':
         case 'C':
-            if (escaped == 3 && arepl->nbuf >= 1 && arepl->line[arepl->nbuf-1] == '[') { // arrow keys
+            if (arepl->escaped == 3 && arepl->nbuf >= 1 && arepl->line[arepl->nbuf-1] == '[') { // arrow keys
                 arepl->nbuf--;
                 if (c == 'D' && arepl->nbuf > 0) _AREPL_CURSOR_LEFT(); // left arrow: \033[D
                 if (c == 'C' && arepl->nstack > 0) _AREPL_CURSOR_RIGHT(); // right arrow: \033[C
                 break;
             }
-            // fall through to default case
-        default:
-            arepl->line[arepl->nbuf++] = c;
+            // fall through to default case
+        default:
+            if (arepl->nbuf + arepl->nstack < arepl->sz - 1) arepl->line[arepl->nbuf++] = c;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Large Messages
+ *
+ ******************************************************************************/
+
+/// Between two minitox, a message too long for one tox message is compressed
+/// and sent as one payload over lossless custom packets, instead of in pieces.
+/// Both sides announce what they support with PACKET_CAPS when they get
+/// connected; other clients never answer, so they keep getting plain pieces.
+///
+///     PACKET_CAPS         [id][caps][is_reply]
+///     PACKET_LARGE_START  [id][msg id(4)][message length(4)][payload length(4)][codec]
+///     PACKET_LARGE_DATA   [id][msg id(4)][payload...]
+///     PACKET_LARGE_ABORT  [id][msg id(4)]
+///     PACKET_LARGE_ACK    [id][msg id(4)]
+///
+/// Integers are little endian. Lossless packets arrive in order, so the data
+/// packets are just appended. If a packet can't be sent half way, the rest is
+/// given up with PACKET_LARGE_ABORT, and the message goes as pieces instead.
+/// The receiver answers a whole message with PACKET_LARGE_ACK, which is what
+/// a read receipt is to plain messages.
+
+#define PACKET_CAPS        160  // lossless custom packet ids are 160~191
+#define PACKET_LARGE_START 161
+#define PACKET_LARGE_DATA  162
+#define PACKET_LARGE_ABORT 163
+#define PACKET_LARGE_ACK   164
+
+#define CAP_LARGE_MESSAGE 0x01
+#define SELF_CAPS CAP_LARGE_MESSAGE
+
+#define LARGE_CODEC_STORED 0
+#define LARGE_CODEC_LZ     1
+
+#define LARGE_START_SIZE 14
+#define LARGE_DATA_HEADER_SIZE 5
+#define LARGE_ABORT_SIZE 5
+#define LARGE_ACK_SIZE 5
+
+uint32_t large_message_seq = 0;
+
+void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+uint32_t get32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void send_caps(struct Friend *f, bool is_reply) {
+    uint8_t packet[3] = {PACKET_CAPS, SELF_CAPS, is_reply};
+    tox_friend_send_lossless_packet(tox, f->friend_num, packet, sizeof(packet), NULL);
+}
+
+// send a message as one payload, compressed if that makes it shorter. returns
+// false, quietly, if it couldn't all go.
+bool send_large_message(struct Friend *f, const char *msg, size_t len) {
+    uint8_t *payload = malloc(lz_compress_bound(len));
+    size_t payload_len = lz_compress((const uint8_t *)msg, len, payload);
+    uint8_t codec = LARGE_CODEC_LZ;
+    if (payload_len >= len) {
+        memcpy(payload, msg, len);
+        payload_len = len;
+        codec = LARGE_CODEC_STORED;
+    }
+
+    uint8_t packet[TOX_MAX_CUSTOM_PACKET_SIZE];
+    uint32_t id = ++large_message_seq;
+    packet[0] = PACKET_LARGE_START;
+    put32(packet + 1, id);
+    put32(packet + 5, len);
+    put32(packet + 9, payload_len);
+    packet[13] = codec;
+    TOX_ERR_FRIEND_CUSTOM_PACKET err;
+    bool ok = tox_friend_send_lossless_packet(tox, f->friend_num, packet, LARGE_START_SIZE, &err);
+    bool started = ok;
+
+    packet[0] = PACKET_LARGE_DATA;
+    size_t n;
+    for (size_t off = 0; ok && off < payload_len; off += n) {
+        n = payload_len - off;
+        if (n > sizeof(packet) - LARGE_DATA_HEADER_SIZE) n = sizeof(packet) - LARGE_DATA_HEADER_SIZE;
+        memcpy(packet + LARGE_DATA_HEADER_SIZE, payload + off, n);
+        ok = tox_friend_send_lossless_packet(tox, f->friend_num, packet, LARGE_DATA_HEADER_SIZE + n, &err);
+    }
+    free(payload);
+    if (!ok && started) {
+        // if this can't go either, the peer drops it on the next START, or when we go offline
+        packet[0] = PACKET_LARGE_ABORT;
+        tox_friend_send_lossless_packet(tox, f->friend_num, packet, LARGE_ABORT_SIZE, NULL);
+    }
+    if (ok) f->unacked++;
+    return ok;
+}
+
+void drop_inbound(struct Inbound *in) {
+    if (in->body) free(in->body);
+    else free(in->buf);
+    in->body = NULL;
+    in->buf = NULL;
+}
+
+// feed a received PACKET_LARGE_*. once a message is complete, returns the body
+// it's in, for addhist_body(), otherwise NULL.
+struct Body *receive_large_message(struct Friend *f, const uint8_t *data, size_t length) {
+    struct Inbound *in = &f->inbound;
+    if (data[0] == PACKET_LARGE_ABORT) {
+        if (length >= LARGE_ABORT_SIZE && get32(data + 1) == in->id) drop_inbound(in);
+        return NULL;
+    }
+    if (data[0] == PACKET_LARGE_START) {
+        drop_inbound(in);
+        if (length < LARGE_START_SIZE) return NULL;
+        in->id = get32(data + 1);
+        in->raw_len = get32(data + 5);
+        in->cap = get32(data + 9);
+        in->codec = data[13];
+        in->len = 0;
+        if (in->raw_len == 0 || in->raw_len > MAX_LARGE_MESSAGE_SIZE || in->cap == 0
+                || (in->codec == LARGE_CODEC_STORED && in->cap != in->raw_len)
+                || (in->codec == LARGE_CODEC_LZ && in->cap > lz_compress_bound(in->raw_len))
+                || in->codec > LARGE_CODEC_LZ) {
+            WARN("! Invalid large message from %s", f->name);
+            return NULL;
+        }
+        if (in->codec == LARGE_CODEC_STORED) {
+            in->body = body_reserve(NULL, in->raw_len);
+            in->buf = (uint8_t *)in->body->data;
+        } else {
+            in->buf = malloc(in->cap);
+        }
+        return NULL;
+    }
+
+    if (length < LARGE_DATA_HEADER_SIZE || !in->buf || get32(data + 1) != in->id) return NULL;
+    size_t n = length - LARGE_DATA_HEADER_SIZE;
+    if (n > in->cap - in->len) {
+        WARN("! Invalid large message from %s", f->name);
+        drop_inbound(in);
+        return NULL;
+    }
+    memcpy(in->buf + in->len, data + LARGE_DATA_HEADER_SIZE, n);
+    body_store.copied += n;
+    in->len += n;
+    if (in->len < in->cap) return NULL;
+
+    uint8_t ack[LARGE_ACK_SIZE] = {PACKET_LARGE_ACK};
+    put32(ack + 1, in->id);
+    tox_friend_send_lossless_packet(tox, f->friend_num, ack, sizeof(ack), NULL);
+
+    size_t raw_len = in->len;
+    if (in->codec == LARGE_CODEC_LZ) {
+        in->body = body_reserve(NULL, in->raw_len);
+        raw_len = lz_decompress(in->buf, in->len, (uint8_t *)in->body->data, in->raw_len);
+        free(in->buf);
+    }
+    struct Body *b = in->body;
+    in->body = NULL;
+    in->buf = NULL;
+    if (raw_len != in->raw_len) {
+        WARN("! Corrupted large message from %s", f->name);
+        free(b);
+        return NULL;
+    }
+    b->len = raw_len;
+    return b;
+}
+
+/*******************************************************************************
+ *
+ * Events
+ *
+ ******************************************************************************/
+
+// Everything that happens(incoming messages, state changes, commands) is
+// turned into an Event by the callbacks, then shown by emit_event(), either
+// as text on the terminal or as one JSON object per line(`--json`).
+
+enum EventType {
+    EVENT_SELF_CONNECTION,
+    EVENT_FRIEND_CONNECTION,
+    EVENT_FRIEND_NAME,
+    EVENT_FRIEND_STATUS_MESSAGE,
+    EVENT_FRIEND_REQUEST,
+    EVENT_FRIEND_MESSAGE,
+    EVENT_GROUP_INVITE,
+    EVENT_GROUP_TITLE,
+    EVENT_GROUP_MESSAGE,
+    EVENT_GROUP_PEER_LIST,
+    EVENT_GROUP_PEER_NAME,
+    EVENT_MESSAGE_SENT,
+    EVENT_COMMAND,
+    EVENT_TYPE_COUNT,
+};
+
+const char *event_names[EVENT_TYPE_COUNT] = {
+    "self_connection",
+    "friend_connection",
+    "friend_name",
+    "friend_status_message",
+    "friend_request",
+    "friend_message",
+    "group_invite",
+    "group_title",
+    "group_message",
+    "group_peer_list",
+    "group_peer_name",
+    "message_sent",
+    "command",
+};
+
+struct Event {
+    enum EventType type;
+    time_t time;
+    uint32_t contact;        // contact index, TALK_TYPE_NULL if there is none
+    uint32_t peer;           // peer number of groups
+    uint32_t value;          // connection status, request id, peer count, or whether to notify of a friend message, depending on type
+    const char *name;        // who did it, may be NULL
+    const char *text;        // message, title, status message, command line..., may be NULL
+    size_t text_len;
+    const uint8_t *pubkey;   // of friend requests
+    struct ChatHist *hist;   // the history item of messages
+    struct View *source;     // the view which sent the message or command
+    bool mention;            // a group message which mentions you, or a highlighted keyword
+};
+
+// length of the UTF-8 char at `s`, which starts with a byte >= 0x80, or 0 if
+// it's not valid(overlong, a surrogate, over U+10FFFF or cut short).
+size_t utf8_len(const uint8_t *s, size_t len) {
+    uint8_t lo = 0x80, hi = 0xBF;  // of the second byte
+    size_t n;
+    if (s[0] >= 0xC2 && s[0] <= 0xDF) n = 2;
+    else if (s[0] >= 0xE0 && s[0] <= 0xEF) n = 3;
+    else if (s[0] >= 0xF0 && s[0] <= 0xF4) n = 4;
+    else return 0;
+    if (s[0] == 0xE0) lo = 0xA0;
+    else if (s[0] == 0xED) hi = 0x9F;
+    else if (s[0] == 0xF0) lo = 0x90;
+    else if (s[0] == 0xF4) hi = 0x8F;
+
+    if (len < n || s[1] < lo || s[1] > hi) return 0;
+    for (size_t i = 2; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80) return 0;
+    }
+    return n;
+}
+
+// a JSON string, with invalid UTF-8 replaced by U+FFFD.
+void json_str(const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    OUT_PUTS("\"");
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = s[i];
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') continue;
+        if (c >= 0x80) {
+            size_t n = utf8_len((const uint8_t *)s + i, len - i);
+            if (n > 0) {
+                i += n - 1;
+                continue;
+            }
+        }
+
+        out_write(s + start, i - start);
+        start = i + 1;
+        switch (c) {
+            case '"':  OUT_PUTS("\\\""); break;
+            case '\\': OUT_PUTS("\\\\"); break;
+            case '\n': OUT_PUTS("\\n"); break;
+            case '\r': OUT_PUTS("\\r"); break;
+            case '\t': OUT_PUTS("\\t"); break;
+            default: {
+                if (c >= 0x80) {
+                    OUT_PUTS("\\ufffd");
+                    break;
+                }
+                char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                out_write(esc, sizeof(esc));
+            }
+        }
+    }
+    out_write(s + start, len - start);
+    OUT_PUTS("\"");
+}
+
+void json_uint(uint64_t v) {
+    char buf[20];
+    int i = sizeof(buf);
+    do {
+        buf[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    out_write(buf + i, sizeof(buf) - i);
+}
+
+void json_field_str(const char *key, const char *s, size_t len) {
+    OUT_PUTS(",\"");
+    out_write(key, strlen(key));
+    OUT_PUTS("\":");
+    json_str(s ? s : "", s ? len : 0);
+}
+
+void json_field_uint(const char *key, uint64_t v) {
+    OUT_PUTS(",\"");
+    out_write(key, strlen(key));
+    OUT_PUTS("\":");
+    json_uint(v);
+}
+
+void json_event(const struct Event *e) {
+    OUT_PUTS("{\"type\":\"");
+    out_write(event_names[e->type], strlen(event_names[e->type]));
+    OUT_PUTS("\"");
+    json_field_uint("time", e->time);
+
+    if (e->contact != TALK_TYPE_NULL) {
+        json_field_uint("contact", e->contact);
+        json_field_uint(INDEX_TO_TYPE(e->contact) == TALK_TYPE_FRIEND ? "friend" : "group", INDEX_TO_NUM(e->contact));
+    }
+    switch (e->type) {
+        case EVENT_SELF_CONNECTION:
+        case EVENT_FRIEND_CONNECTION: {
+            const char *status = connection_enum2text(e->value);
+            json_field_str("status", status, strlen(status));
+            break;
+        }
+        case EVENT_FRIEND_REQUEST:
+        case EVENT_GROUP_INVITE:
+            json_field_uint("id", e->value);
+            break;
+        case EVENT_GROUP_MESSAGE:
+            if (e->mention) OUT_PUTS(",\"mention\":true");
+            // fall through
+        case EVENT_GROUP_PEER_NAME:
+            json_field_uint("peer", e->peer);
+            break;
+        case EVENT_GROUP_PEER_LIST:
+            json_field_uint("count", e->value);
+            break;
+        default:
+            break;
+    }
+    if (e->pubkey) {
+        char hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        json_field_str("public_key", bin2hex(hex, e->pubkey, TOX_PUBLIC_KEY_SIZE), TOX_PUBLIC_KEY_SIZE * 2);
+    }
+    if (e->name) json_field_str("name", e->name, strlen(e->name));
+    if (e->text) json_field_str("text", e->text, e->text_len);
+    OUT_PUTS("}\n");
+}
+
+// PRINT & co in json mode: {"type":"output","level":...,"text":...}, with
+// terminal control sequences stripped.
+void json_log(const char *level, const char *fmt, ...) {
+    char buf[1024];
+    char *text = buf;
+    va_list va;
+    va_start(va, fmt);
+    va_list va2;
+    va_copy(va2, va);
+    int n = vsnprintf(buf, sizeof(buf), fmt, va2);
+    va_end(va2);
+    if (n >= (int)sizeof(buf)) {
+        text = malloc(n + 1);
+        vsnprintf(text, n + 1, fmt, va);
+    }
+    va_end(va);
+    if (n < 0) return;
+
+    // strip "\033[...<letter>" and '\r' in place
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        if (text[i] == '\033') {
+            while (i + 1 < n && !((text[i+1] >= 'A' && text[i+1] <= 'Z') || (text[i+1] >= 'a' && text[i+1] <= 'z'))) i++;
+            i++;
+            continue;
+        }
+        if (text[i] != '\r') text[len++] = text[i];
+    }
+    while (len > 0 && text[len-1] == '\n') len--;
+
+    OUT_PUTS("{\"type\":\"output\",\"level\":\"");
+    out_write(level, strlen(level));
+    OUT_PUTS("\"");
+    json_field_str("text", text, len);
+    OUT_PUTS("}\n");
+
+    if (text != buf) free(text);
+}
+
+// history items shown by `/history`
+void json_hist(struct ChatHist *h) {
+    OUT_PUTS("{\"type\":\"history\"");
+    json_field_uint("time", h->time);
+    OUT_PUTS(",\"self\":");
+    if (h->is_self) OUT_PUTS("true");
+    else OUT_PUTS("false");
+    json_field_str("name", h->name, h->name_len);
+    json_field_str("text", h->msg, h->msg_len);
+    OUT_PUTS("}\n");
+}
+
+void print_event(const struct Event *e) {
+    switch (e->type) {
+        case EVENT_SELF_CONNECTION:
+            INFO("* You are %s", connection_enum2text(e->value));
+            break;
+        case EVENT_FRIEND_CONNECTION:
+            INFO("* %s is %s", e->name, connection_enum2text(e->value));
+            break;
+        case EVENT_FRIEND_NAME:
+            if (e->contact == view->talking_to) {
+                INFO("* Opposite changed name to %s", e->name);
+                sprintf(view->repl.prompt, FRIEND_TALK_PROMPT, e->name);
+            }
+            break;
+        case EVENT_FRIEND_REQUEST:
+            INFO("* receive friend request(use `/accept` to see).");
+            break;
+        case EVENT_FRIEND_MESSAGE:
+            if (e->contact == view->talking_to) {
+                print_hist(e->hist);
+            } else if (e->value) {
+                INFO("* receive message from %s, use `/go <contact_index>` to talk\n", e->name);
+            }
+            break;
+        case EVENT_GROUP_INVITE:
+            INFO("* %s invites you to a group(try `/accept` to see)", e->name);
+            break;
+        case EVENT_GROUP_TITLE:
+            if (e->contact == view->talking_to) {
+                INFO("* Group title changed to %s", e->text);
+                sprintf(view->repl.prompt, GROUP_TALK_PROMPT, e->text);
+            }
+            break;
+        case EVENT_GROUP_MESSAGE:
+            if (e->contact == view->talking_to) {
+                print_hist(e->hist);
+            } else {
+                // mentions are shown at once, others only by a notice for the first unread one
+                struct Group *cf = getgroup(INDEX_TO_NUM(e->contact));
+                if (!cf) break;
+                if (e->mention) {
+                    COLOR_PRINT("mention", MENTION_COLOR, "* %s mentioned you in group %s: %.*s", e->name, cf->title, (int)e->text_len, e->text);
+                } else if (cf->unread == 1) {
+                    INFO("* new messages in group %s, use `/go %u` to read", cf->title, e->contact);
+                }
+            }
+            break;
+        case EVENT_MESSAGE_SENT:
+            if (e->contact == view->talking_to) print_hist(e->hist);
+            break;
+        default:
+            break;
+    }
+}
+
+// show the event in every view, except that commands are only echoed to
+// where they were typed. then let plugins see it.
+void emit_event(struct Event *e) {
+    if (e->time == 0) e->time = coarse_time();
+    struct View *saved = view;
+    for (view = views; view; view = view->next) {
+        if (e->type == EVENT_COMMAND && view != e->source) continue;
+        if (view->json) {
+            json_event(e);
+        } else {
+            print_event(e);
+        }
+    }
+    view = saved;
+    log_event(e);
+    plugins_dispatch(e);
+}
+
+// send a message to a contact, and show it as sent. returns false if there's no such contact.
+bool send_message(uint32_t contact, const char *msg, size_t len, struct View *source) {
+    struct History *hp = get_histp(contact);
+    if (!hp) return false;
+
+    struct ChatHist *h = addhist(hp, coarse_time(), true, self.name, msg, len);
+    struct Event e = {EVENT_MESSAGE_SENT, h->time, contact};
+    e.name = self.name;
+    e.text = h->msg;
+    e.text_len = h->msg_len;
+    e.hist = h;
+    e.source = source;
+    emit_event(&e);
+
+    // only another minitox takes a large message, or joins pieces back
+    bool mark = false;
+    if (INDEX_TO_TYPE(contact) == TALK_TYPE_FRIEND) {
+        struct Friend *f = getfriend(INDEX_TO_NUM(contact));
+        mark = f && (f->caps & CAP_LARGE_MESSAGE);
+        if (mark && h->msg_len > TOX_MAX_MESSAGE_LENGTH) {
+            if (send_large_message(f, h->msg, h->msg_len)) return true;
+            INFO("* sending as pieces");  // if the packets can't go
+        }
+    }
+
+    const char *p = h->msg;
+    size_t left = h->msg_len;
+    char piece[TOX_MAX_MESSAGE_LENGTH];
+    while (left > 0) {
+        size_t n = split_message(p, left, mark);
+        const char *data = p;
+        size_t data_len = n;
+        if (mark && n < left) {
+            memcpy(piece, p, n);
+            memcpy(piece + n, SPLIT_MARK, SPLIT_MARK_LEN);
+            data = piece;
+            data_len = n + SPLIT_MARK_LEN;
+        }
+        bool ok = true;
+        switch (INDEX_TO_TYPE(contact)) {
+            case TALK_TYPE_FRIEND: {
+                TOX_ERR_FRIEND_SEND_MESSAGE err;
+                tox_friend_send_message(tox, INDEX_TO_NUM(contact), TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)data, data_len, &err);
+                ok = err == TOX_ERR_FRIEND_SEND_MESSAGE_OK;
+                if (!ok) ERROR("! send message failed, errcode:%d", err);
+                struct Friend *f = getfriend(INDEX_TO_NUM(contact));
+                if (ok && f) f->unreceipted++;
+                break;
+            }
+            case TALK_TYPE_GROUP: {
+                TOX_ERR_CONFERENCE_SEND_MESSAGE err;
+                tox_conference_send_message(tox, INDEX_TO_NUM(contact), TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)data, data_len, &err);
+                ok = err == TOX_ERR_CONFERENCE_SEND_MESSAGE_OK;
+                if (!ok) ERROR("! send message failed, errcode:%d", err);
+                break;
+            }
+        }
+        if (!ok) break;
+        p += n;
+        left -= n;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *
+ * Event Log
+ *
+ ******************************************************************************/
+
+/// `--log <file>` appends every event to a file, as the JSON lines `--json`
+/// prints. Callbacks never wait for the disk: lines are put in a single-producer
+/// single-consumer ring, which a writer thread drains every EVENT_LOG_FLUSH_MS
+/// in one write. If the ring is full, the line is dropped and counted, and the
+/// count is logged by the writer as a "log_dropped" line.
+///
+/// `head` is only written by the main thread, `tail` only by the writer.
+/// Both only grow, their difference is how much is in the ring.
+
+struct EventLog {
+    char *path;
+    int fd;
+    char *ring;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;        // lines, by the main thread
+    bool stop;
+    bool started;
+    pthread_t thread;
+    struct View scratch;     // where json_event() renders a line
+
+    // of the writer thread
+    uint64_t reported_drops;
+    size_t size;             // of the current file
+    time_t opened;           // when the current file was started
+} eventlog = {.fd = -1};
+
+void open_eventlog(const char *path) {
+    eventlog.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (eventlog.fd == -1) {
+        fprintf(stderr, "! open log %s failed: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    struct stat st;
+    fstat(eventlog.fd, &st);
+    eventlog.size = st.st_size;
+    eventlog.opened = time(NULL);
+    eventlog.path = strdup(path);
+}
+
+void rotate_eventlog(void) {
+    size_t len = strlen(eventlog.path) + 16;
+    char from[len], to[len];
+    for (int i = EVENT_LOG_KEEP - 1; i >= 1; i--) {
+        snprintf(from, len, "%s.%d", eventlog.path, i);
+        snprintf(to, len, "%s.%d", eventlog.path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, len, "%s.1", eventlog.path);
+    rename(eventlog.path, to);
+    int fd = open(eventlog.path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd == -1) return;  // keep writing to the renamed one
+    close(eventlog.fd);
+    eventlog.fd = fd;
+    eventlog.size = 0;
+    eventlog.opened = time(NULL);
+}
+
+// write all lines in the ring, returns how many bytes. runs in the writer thread.
+size_t drain_eventlog(void) {
+    uint64_t head = __atomic_load_n(&eventlog.head, __ATOMIC_ACQUIRE);
+    uint64_t dropped = __atomic_load_n(&eventlog.dropped, __ATOMIC_RELAXED);
+    uint64_t tail = eventlog.tail;
+    if (head == tail && dropped == eventlog.reported_drops) return 0;
+
+    if (eventlog.size >= EVENT_LOG_MAX_SIZE || time(NULL) - eventlog.opened >= EVENT_LOG_MAX_AGE) {
+        rotate_eventlog();
+    }
+    if (dropped != eventlog.reported_drops) {
+        char line[96];
+        int n = snprintf(line, sizeof(line), "{\"type\":\"log_dropped\",\"time\":%lld,\"count\":%llu}\n",
+                         (long long)time(NULL), (unsigned long long)(dropped - eventlog.reported_drops));
+        write_all(eventlog.fd, line, n);
+        eventlog.size += n;
+        eventlog.reported_drops = dropped;
+    }
+    // at most two writes, when the lines wrap around the end of the ring
+    while (tail != head) {
+        size_t i = tail & (EVENT_LOG_RING_SIZE - 1);
+        size_t n = head - tail;
+        if (n > EVENT_LOG_RING_SIZE - i) n = EVENT_LOG_RING_SIZE - i;
+        write_all(eventlog.fd, eventlog.ring + i, n);
+        eventlog.size += n;
+        tail += n;
+    }
+    size_t written = tail - eventlog.tail;
+    __atomic_store_n(&eventlog.tail, tail, __ATOMIC_RELEASE);
+    return written;
+}
+
+void *eventlog_main(void *arg) {
+    struct timespec pause = {0, EVENT_LOG_FLUSH_MS * 1000 * 1000};
+    for (;;) {
+        bool stop = __atomic_load_n(&eventlog.stop, __ATOMIC_ACQUIRE);
+        size_t written = drain_eventlog();
+        if (stop) break;
+        if (written < EVENT_LOG_RING_SIZE / 4) nanosleep(&pause, NULL);  // keep up with bursts
+    }
+    return NULL;
+}
+
+// write out what's left, at exit.
+void stop_eventlog(void) {
+    __atomic_store_n(&eventlog.stop, true, __ATOMIC_RELEASE);
+    pthread_join(eventlog.thread, NULL);
+    close(eventlog.fd);
+}
+
+// after daemonize(), as threads don't survive fork().
+void start_eventlog(void) {
+    if (eventlog.fd == -1) return;
+    eventlog.ring = malloc(EVENT_LOG_RING_SIZE);
+    eventlog.scratch.json = true;
+    eventlog.scratch.out.fd = -1;
+    eventlog.scratch.out.nonblock = true;
+    eventlog.scratch.out.cap = EVENT_LOG_LINE_MAX;
+    eventlog.scratch.out.buf = malloc(EVENT_LOG_LINE_MAX);
+    if (pthread_create(&eventlog.thread, NULL, eventlog_main, NULL) != 0) {
+        fputs("! start log writer failed\n", stderr);
+        exit(1);
+    }
+    eventlog.started = true;
+    atexit(stop_eventlog);
+}
+
+void log_event(const struct Event *e) {
+    if (!eventlog.started) return;
+
+    struct OutBuf *ob = &eventlog.scratch.out;
+    ob->len = ob->line_start = 0;
+    ob->dropped = 0;
+    ob->skip_line = false;
+    struct View *saved = view;
+    view = &eventlog.scratch;
+    json_event(e);
+    view = saved;
+
+    uint64_t head = eventlog.head;
+    uint64_t tail = __atomic_load_n(&eventlog.tail, __ATOMIC_ACQUIRE);
+    if (ob->dropped || ob->len > EVENT_LOG_RING_SIZE - (head - tail)) {
+        __atomic_store_n(&eventlog.dropped, eventlog.dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t i = head & (EVENT_LOG_RING_SIZE - 1);
+    size_t first = ob->len < EVENT_LOG_RING_SIZE - i ? ob->len : EVENT_LOG_RING_SIZE - i;
+    memcpy(eventlog.ring + i, ob->buf, first);
+    memcpy(eventlog.ring, ob->buf + first, ob->len - first);
+    __atomic_store_n(&eventlog.head, head + ob->len, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ *
+ * Plugins
+ *
+ ******************************************************************************/
+
+// Plugins are shared objects loaded by `--plugin <path>`, see minitox_plugin.h.
+// Their hooks are driven by events, and every call is timed.
+
+struct Plugin {
+    char *path;
+    void *handle;
+    minitox_plugin_init_fn *init;
+    const struct MinitoxPlugin *p;
+
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t slow_calls;    // over `plugin_call_budget_us`
+};
+
+struct Plugin plugins[MAX_PLUGINS];
+int plugin_count = 0;
+bool in_plugin = false;  // don't hook what a plugin does in its own hook
+
+uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void plugin_account(struct Plugin *pl, uint64_t ns) {
+    pl->calls++;
+    pl->total_ns += ns;
+    if (ns > pl->max_ns) pl->max_ns = ns;
+    if (ns > config.plugin_call_budget_us * 1000ULL) {
+        if (pl->slow_calls++ == 0) {
+            WARN("! plugin %s took %.1fms in a hook, see `/plugins`", pl->p->name, ns / 1e6);
+        }
+    }
+}
+
+#define PLUGIN_CALL(_pl, _hook, ...) do { \
+        if ((_pl)->p->_hook) { \
+            uint64_t _t0 = mono_ns(); \
+            in_plugin = true; \
+            (_pl)->p->_hook((_pl)->p->ctx, __VA_ARGS__); \
+            in_plugin = false; \
+            plugin_account(_pl, mono_ns() - _t0); \
+        } \
+    } while (0)
+
+void plugins_dispatch(const struct Event *e) {
+    if (in_plugin) return;
+    for (int i = 0; i < plugin_count; i++) {
+        struct Plugin *pl = &plugins[i];
+        switch (e->type) {
+            case EVENT_FRIEND_MESSAGE:
+            case EVENT_GROUP_MESSAGE:
+                PLUGIN_CALL(pl, on_message, e->contact, false, e->name, e->text, e->text_len);
+                break;
+            case EVENT_MESSAGE_SENT:
+                PLUGIN_CALL(pl, on_message, e->contact, true, e->name, e->text, e->text_len);
+                break;
+            case EVENT_SELF_CONNECTION:
+            case EVENT_FRIEND_CONNECTION:
+                PLUGIN_CALL(pl, on_connection, e->contact, (int)e->value);
+                break;
+            case EVENT_COMMAND:
+                PLUGIN_CALL(pl, on_command, e->text, e->text_len);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void plugin_send_message(uint32_t contact, const char *text, size_t len) {
+    send_message(contact, text, len, NULL);
+}
+
+void plugin_log(const char *fmt, ...) {
+    char buf[LINE_MAX_SIZE];
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, va);
+    va_end(va);
+    PRINT("%s", buf);
+}
+
+struct MinitoxAPI plugin_api = {
+    MINITOX_PLUGIN_ABI,
+    NULL,
+    plugin_send_message,
+    plugin_log,
+};
+
+// only opens the shared object, it's initialized later when tox is ready.
+void load_plugin(const char *path) {
+    if (plugin_count == MAX_PLUGINS) {
+        fprintf(stderr, "! too many plugins, at most %d\n", MAX_PLUGINS);
+        exit(1);
+    }
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "! load plugin failed: %s\n", dlerror());
+        exit(1);
+    }
+    struct Plugin *pl = &plugins[plugin_count];
+    *(void **)&pl->init = dlsym(handle, MINITOX_PLUGIN_INIT);
+    if (!pl->init) {
+        fprintf(stderr, "! %s is not a minitox plugin: no " MINITOX_PLUGIN_INIT "\n", path);
+        exit(1);
+    }
+    pl->path = strdup(path);
+    pl->handle = handle;
+    plugin_count++;
+}
+
+void unload_plugins(void) {
+    for (int i = 0; i < plugin_count; i++) {
+        const struct MinitoxPlugin *p = plugins[i].p;
+        if (p->unload) p->unload(p->ctx);
+    }
+    plugin_count = 0;
+}
+
+void init_plugins(void) {
+    plugin_api.tox = tox;
+    int n = 0;
+    for (int i = 0; i < plugin_count; i++) {
+        struct Plugin *pl = &plugins[i];
+        pl->p = pl->init(&plugin_api);
+        if (!pl->p || pl->p->abi != MINITOX_PLUGIN_ABI) {
+            ERROR("! plugin %s refused to load, or was built for another version", pl->path);
+            dlclose(pl->handle);
+            free(pl->path);
+            continue;
+        }
+        INFO("* plugin %s loaded", pl->p->name);
+        plugins[n++] = *pl;
+    }
+    plugin_count = n;
+    atexit(unload_plugins);
+}
+
+/*******************************************************************************
+ *
+ * Triggers
+ *
+ ******************************************************************************/
+
+// Triggers are keywords watched in every incoming message, which make minitox
+// reply, run a command or notify you. All keywords are compiled into one
+// Aho-Corasick automaton, so a message is scanned once however many there are.
+// It's rebuilt by `/trigger` and `/untrigger`, rather than on the next message.
+
+enum TriggerAction { TRIGGER_REPLY, TRIGGER_CMD, TRIGGER_NOTIFY, TRIGGER_ACTION_COUNT };
+
+const char *trigger_action_names[] = {"reply", "cmd", "notify"};
+
+struct Trigger {
+    uint32_t id;
+    char *keyword;
+    enum TriggerAction action;
+    char *arg;          // reply text, command line or notice
+
+    uint32_t node;      // where the keyword ends in the automaton
+    uint64_t hits;
+    uint64_t last_msg;  // fires at most once per message
+
+    struct Trigger *same;   // other triggers with the same keyword
+    struct Trigger *next;
+};
+
+struct Trigger *triggers = NULL;
+struct AhoCorasick trigger_ac;
+uint32_t trigger_next_id = 1;
+uint64_t trigger_msg_seq = 0;
+
+struct Trigger *addtrigger(const char *keyword, enum TriggerAction action, const char *arg) {
+    struct Trigger *t = calloc(1, sizeof(struct Trigger));
+    t->id = trigger_next_id++;
+    t->keyword = strdup(keyword);
+    t->action = action;
+    t->arg = strdup(arg);
+    t->node = ac_insert(&trigger_ac, keyword, strlen(keyword));
+    t->same = trigger_ac.nodes[t->node].out;
+    ac_set_out(&trigger_ac, t->node, t);
+
+    t->next = triggers;
+    triggers = t;
+    return t;
+}
+
+bool deltrigger(uint32_t id) {
+    struct Trigger **p = &triggers;
+    LIST_FIND(p, (*p)->id == id);
+    struct Trigger *t = *p;
+    if (!t) return false;
+    *p = t->next;
+
+    struct Trigger *head = trigger_ac.nodes[t->node].out;
+    if (head == t) {
+        head = t->same;
+    } else {
+        struct Trigger *q = head;
+        while (q->same != t) q = q->same;
+        q->same = t->same;
+    }
+    ac_set_out(&trigger_ac, t->node, head);
+    if (!head) ac_prune(&trigger_ac, t->node);
+
+    free(t->keyword);
+    free(t->arg);
+    free(t);
+    return true;
+}
+
+struct TriggerHits {
+    uint32_t *ids;      // ids, since an action may delete triggers
+    size_t n, cap;
+    uint32_t buf[16];   // ids is this, until more hit one message
+};
+
+void trigger_hit_cb(void *ctx, void *out, size_t end) {
+    struct TriggerHits *hits = ctx;
+    for (struct Trigger *t = out; t; t = t->same) {
+        if (t->last_msg == trigger_msg_seq) continue;
+        t->last_msg = trigger_msg_seq;
+        if (hits->n == hits->cap) {
+            hits->cap *= 2;
+            if (hits->ids == hits->buf) {
+                hits->ids = malloc(hits->cap * sizeof(uint32_t));
+                memcpy(hits->ids, hits->buf, sizeof(hits->buf));
+            } else {
+                hits->ids = realloc(hits->ids, hits->cap * sizeof(uint32_t));
+            }
+        }
+        hits->ids[hits->n++] = t->id;
     }
-    return 0;
+}
+
+// check an incoming message against all triggers. the contact may be gone
+// when it returns, callers must not touch it after.
+void triggers_match(uint32_t contact, const char *name, const char *msg, size_t len) {
+    if (!triggers) return;
+    trigger_msg_seq++;
+    struct TriggerHits hits;
+    hits.ids = hits.buf;
+    hits.n = 0;
+    hits.cap = sizeof(hits.buf) / sizeof(hits.buf[0]);
+    ac_match(&trigger_ac, msg, len, trigger_hit_cb, &hits);
+
+    // commands go last, since one may delete the contact, and with it `name` &
+    // `msg`, or triggers which are yet to run.
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < hits.n; i++) {
+            struct Trigger **p = &triggers;
+            LIST_FIND(p, (*p)->id == hits.ids[i]);
+            struct Trigger *t = *p;
+            if (!t || (t->action == TRIGGER_CMD) != (pass == 1)) continue;
+            t->hits++;
+            switch (t->action) {
+                case TRIGGER_REPLY:
+                    send_message(contact, t->arg, strlen(t->arg), NULL);
+                    break;
+                case TRIGGER_CMD: {
+                    char line[LINE_MAX_SIZE];
+                    snprintf(line, sizeof(line), "%s", t->arg);
+                    run_command(line);
+                    break;
+                }
+                case TRIGGER_NOTIFY:
+                    INFO("* [%s] %s: %.*s", t->arg, name, (int)len, msg);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    if (hits.ids != hits.buf) free(hits.ids);
+}
+
+/*******************************************************************************
+ *
+ * Highlights
+ *
+ ******************************************************************************/
+
+// Group messages which contain your name or any of the highlighted keywords
+// (whole words, ignoring case) are mentions: they are shown even when you are
+// not in that group, and remembered for `/mentions`.
+
+struct Highlight {
+    char *keyword;
+    size_t len;
+    struct Highlight *next;
+};
+
+struct Highlight *highlights = NULL;
+struct Highlight self_highlight;  // your own name
+struct AhoCorasick highlight_ac;
+
+// where mentions are in history, the latest MAX_MENTIONS ones.
+struct Mention {
+    uint32_t contact;
+    uint64_t serial;    // of the ChatHist
+} mentions[MAX_MENTIONS];
+uint64_t mention_count = 0;
+
+// highlights change rarely, just build it again.
+void highlights_rebuild(void) {
+    ac_free(&highlight_ac);
+    self_highlight.keyword = self.name;
+    self_highlight.len = self.name ? strlen(self.name) : 0;
+    if (self_highlight.len > 0) {
+        ac_set_out(&highlight_ac, ac_insert(&highlight_ac, self.name, self_highlight.len), &self_highlight);
+    }
+    for (struct Highlight *h = highlights; h; h = h->next) {
+        ac_set_out(&highlight_ac, ac_insert(&highlight_ac, h->keyword, h->len), h);
+    }
+}
+
+#define IS_WORD_CHAR(c) (((c) >= '0' && (c) <= '9') || ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || (c) == '_')
+
+struct HighlightMatch {
+    const char *text;
+    size_t len;
+    bool hit;
+};
+
+void highlight_hit_cb(void *ctx, void *out, size_t end) {
+    struct HighlightMatch *m = ctx;
+    const struct Highlight *h = out;
+    size_t start = end - h->len;
+    if (start > 0 && IS_WORD_CHAR(m->text[start - 1])) return;
+    if (end < m->len && IS_WORD_CHAR(m->text[end])) return;
+    m->hit = true;
+}
+
+bool is_mention(const char *msg, size_t len) {
+    struct HighlightMatch m = {msg, len, false};
+    ac_match(&highlight_ac, msg, len, highlight_hit_cb, &m);
+    return m.hit;
+}
+
+void add_mention(uint32_t contact, const struct ChatHist *h) {
+    struct Mention *m = &mentions[mention_count++ % MAX_MENTIONS];
+    m->contact = contact;
+    m->serial = h->serial;
 }
 
 /*******************************************************************************
@@ -510,6 +3074,21 @@ int arepl_readline(struct AsyncREPL *arepl, char c, char *line, size_t sz){
  *
  ******************************************************************************/
 
+// `body` is the message if it's put together by reassemble() or receive_large_message(), otherwise NULL.
+void friend_message_show(struct Friend *f, const char *msg, size_t length, struct Body *body) {
+    struct ChatHist *h = body ? addhist_body(&f->hist, coarse_time(), false, f->name, body)
+                              : addhist(&f->hist, coarse_time(), false, f->name, msg, length);
+    struct Event e = {EVENT_FRIEND_MESSAGE, h->time, GEN_INDEX(f->friend_num, TALK_TYPE_FRIEND)};
+    e.value = h->time - f->notified_at >= config.notify_interval;
+    if (e.value) f->notified_at = h->time;
+    e.name = f->name;
+    e.text = h->msg;
+    e.text_len = h->msg_len;
+    e.hist = h;
+    emit_event(&e);
+    triggers_match(e.contact, f->name, h->msg, h->msg_len);
+}
+
 void friend_message_cb(Tox *tox, uint32_t friend_num, TOX_MESSAGE_TYPE type, const uint8_t *message,
                                    size_t length, void *user_data)
 {
@@ -520,32 +3099,59 @@ void friend_message_cb(Tox *tox, uint32_t friend_num, TOX_MESSAGE_TYPE type, con
         return;
     }
 
-    char *msg = genmsg(&f->hist, GUEST_MSG_PREFIX "%.*s", getftime(), f->name, (int)length, (char*)message);
-    if (GEN_INDEX(friend_num, TALK_TYPE_FRIEND) == TalkingTo) {
-        PRINT("%s", msg);
-    } else {
-        INFO("* receive message from %s, use `/go <contact_index>` to talk\n",f->name);
+    struct Body *body;
+    if (!reassemble(&f->pending, (const char *)message, length, &body)) return;
+    friend_message_show(f, (const char *)message, length, body);
+}
+
+void friend_lossless_packet_cb(Tox *tox, uint32_t friend_num, const uint8_t *data, size_t length, void *user_data) {
+    struct Friend *f = getfriend(friend_num);
+    if (!f) return;
+
+    switch (data[0]) {
+        case PACKET_CAPS:
+            if (length < 3) return;
+            f->caps = data[1] & SELF_CAPS;
+            if (!data[2]) send_caps(f, true);
+            break;
+        case PACKET_LARGE_ACK:
+            if (f->unacked > 0) f->unacked--;
+            break;
+        case PACKET_LARGE_START:
+        case PACKET_LARGE_DATA:
+        case PACKET_LARGE_ABORT: {
+            struct Body *body = receive_large_message(f, data, length);
+            if (body) friend_message_show(f, NULL, 0, body);
+            break;
+        }
     }
 }
 
+void friend_read_receipt_cb(Tox *tox, uint32_t friend_num, uint32_t message_id, void *user_data) {
+    struct Friend *f = getfriend(friend_num);
+    if (f && f->unreceipted > 0) f->unreceipted--;
+}
+
 void friend_name_cb(Tox *tox, uint32_t friend_num, const uint8_t *name, size_t length, void *user_data) {
     struct Friend *f = getfriend(friend_num);
 
     if (f) {
-        f->name = realloc(f->name, length+1);
-        sprintf(f->name, "%.*s", (int)length, (char*)name);
-        if (GEN_INDEX(friend_num, TALK_TYPE_FRIEND) == TalkingTo) {
-            INFO("* Opposite changed name to %.*s", (int)length, (char*)name)
-            sprintf(async_repl->prompt, FRIEND_TALK_PROMPT, f->name);
-        }
+        f->name = setstr(f->name, name, length);
+        struct Event e = {EVENT_FRIEND_NAME, 0, GEN_INDEX(friend_num, TALK_TYPE_FRIEND)};
+        e.name = f->name;
+        emit_event(&e);
     }
 }
 
 void friend_status_message_cb(Tox *tox, uint32_t friend_num, const uint8_t *message, size_t length, void *user_data) {
     struct Friend *f = getfriend(friend_num);
     if (f) {
-        f->status_message = realloc(f->status_message, length + 1);
-        sprintf(f->status_message, "%.*s",(int)length, (char*)message);
+        f->status_message = setstr(f->status_message, message, length);
+        struct Event e = {EVENT_FRIEND_STATUS_MESSAGE, 0, GEN_INDEX(friend_num, TALK_TYPE_FRIEND)};
+        e.name = f->name;
+        e.text = f->status_message;
+        e.text_len = length;
+        emit_event(&e);
     }
 }
 
@@ -553,30 +3159,47 @@ void friend_connection_status_cb(Tox *tox, uint32_t friend_num, TOX_CONNECTION c
 {
     struct Friend *f = getfriend(friend_num);
     if (f) {
+        if (connection_status == TOX_CONNECTION_NONE) {
+            f->caps = 0;
+            f->unreceipted = 0;
+            f->unacked = 0;
+            drop_inbound(&f->inbound);
+        } else if (f->connection == TOX_CONNECTION_NONE) {
+            send_caps(f, false);
+        }
         f->connection = connection_status;
-        INFO("* %s is %s", f->name, connection_enum2text(connection_status));
+        struct Event e = {EVENT_FRIEND_CONNECTION, 0, GEN_INDEX(friend_num, TALK_TYPE_FRIEND)};
+        e.value = connection_status;
+        e.name = f->name;
+        emit_event(&e);
     }
 }
 
 void friend_request_cb(Tox *tox, const uint8_t *public_key, const uint8_t *message, size_t length, void *user_data) {
-    INFO("* receive friend request(use `/accept` to see).");
-
     struct Request *req = malloc(sizeof(struct Request));
 
     req->id = 1 + ((requests != NULL) ? requests->id : 0);
     req->is_friend_request = true;
     memcpy(req->userdata.friend.pubkey, public_key, TOX_PUBLIC_KEY_SIZE);
-    req->msg = malloc(length + 1);
-    sprintf(req->msg, "%.*s", (int)length, (char*)message);
+    req->msg = setstr(NULL, message, length);
 
     req->next = requests;
     requests = req;
+
+    struct Event e = {EVENT_FRIEND_REQUEST, 0, TALK_TYPE_NULL};
+    e.value = req->id;
+    e.pubkey = req->userdata.friend.pubkey;
+    e.text = req->msg;
+    e.text_len = length;
+    emit_event(&e);
 }
 
 void self_connection_status_cb(Tox *tox, TOX_CONNECTION connection_status, void *user_data)
 {
     self.connection = connection_status;
-    INFO("* You are %s", connection_enum2text(connection_status));
+    struct Event e = {EVENT_SELF_CONNECTION, 0, TALK_TYPE_NULL};
+    e.value = connection_status;
+    emit_event(&e);
 }
 
 void group_invite_cb(Tox *tox, uint32_t friend_num, TOX_CONFERENCE_TYPE type, const uint8_t *cookie, size_t length, void *user_data) {
@@ -586,7 +3209,6 @@ void group_invite_cb(Tox *tox, uint32_t friend_num, TOX_CONFERENCE_TYPE type, co
             WARN("* %s invites you to an AV group, which has not been supported.", f->name);
             return;
         }
-        INFO("* %s invites you to a group(try `/accept` to see)",f->name);
         struct Request *req = malloc(sizeof(struct Request));
         req->id = 1 + ((requests != NULL) ? requests->id : 0);
         req->next = requests;
@@ -600,19 +3222,47 @@ void group_invite_cb(Tox *tox, uint32_t friend_num, TOX_CONFERENCE_TYPE type, co
         int sz = snprintf(NULL, 0, "%s%s", "From ", f->name);
         req->msg = malloc(sz + 1);
         sprintf(req->msg, "%s%s", "From ", f->name);
+
+        struct Event e = {EVENT_GROUP_INVITE, 0, GEN_INDEX(friend_num, TALK_TYPE_FRIEND)};
+        e.value = req->id;
+        e.name = f->name;
+        emit_event(&e);
     }
 }
 
 void group_title_cb(Tox *tox, uint32_t group_num, uint32_t peer_number, const uint8_t *title, size_t length, void *user_data) {
     struct Group *cf = getgroup(group_num);
     if (cf) {
-        cf->title = realloc(cf->title, length+1);
-        sprintf(cf->title, "%.*s", (int)length, (char*)title);
-        if (GEN_INDEX(group_num, TALK_TYPE_GROUP) == TalkingTo) {
-            INFO("* Group title changed to %s", cf->title);
-            sprintf(async_repl->prompt, GROUP_TALK_PROMPT, cf->title);
-        }
+        cf->title = setstr(cf->title, title, length);
+        struct Event e = {EVENT_GROUP_TITLE, 0, GEN_INDEX(group_num, TALK_TYPE_GROUP)};
+        e.peer = peer_number;
+        e.text = cf->title;
+        e.text_len = length;
+        emit_event(&e);
+    }
+}
+
+void group_message_show(struct Group *cf, uint32_t peer_number, const char *msg, size_t length) {
+    struct GroupPeer *peer = &cf->peers[peer_number];
+    struct ChatHist *h = addhist(&cf->hist, coarse_time(), false, peer->name, msg, length);
+
+    struct Event e = {EVENT_GROUP_MESSAGE, h->time, GEN_INDEX(cf->group_num, TALK_TYPE_GROUP)};
+    e.mention = is_mention(h->msg, h->msg_len);
+    if (e.mention) add_mention(e.contact, h);
+
+    bool watched = false;
+    for (struct View *v = views; v; v = v->next) {
+        if (v->talking_to == e.contact) watched = true;
     }
+    if (!watched) cf->unread++;
+
+    e.peer = peer_number;
+    e.name = peer->name;
+    e.text = h->msg;
+    e.text_len = h->msg_len;
+    e.hist = h;
+    emit_event(&e);
+    triggers_match(e.contact, peer->name, h->msg, h->msg_len);
 }
 
 void group_message_cb(Tox *tox, uint32_t group_num, uint32_t peer_number, TOX_MESSAGE_TYPE type, const uint8_t *message, size_t length, void *user_data) {
@@ -630,14 +3280,7 @@ void group_message_cb(Tox *tox, uint32_t group_num, uint32_t peer_number, TOX_ME
         return;
     }
 
-    struct GroupPeer *peer = &cf->peers[peer_number];
-    char *msg = genmsg(&cf->hist, GUEST_MSG_PREFIX "%.*s", getftime(), peer->name, (int)length, (char*)message);
-
-    if (GEN_INDEX(group_num, TALK_TYPE_GROUP) == TalkingTo) {
-        PRINT("%s", msg);
-    } else {
-        INFO("* receive group message from %s, in group %s",peer->name, cf->title);
-    }
+    group_message_show(cf, peer_number, (const char *)message, length);
 }
 
 void group_peer_list_changed_cb(Tox *tox, uint32_t group_num, void *user_data) {
@@ -659,6 +3302,10 @@ void group_peer_list_changed_cb(Tox *tox, uint32_t group_num, void *user_data) {
         tox_conference_peer_get_name(tox, group_num, i, (uint8_t*)p->name, NULL);
         tox_conference_peer_get_public_key(tox, group_num, i, p->pubkey,NULL);
     }
+
+    struct Event e = {EVENT_GROUP_PEER_LIST, 0, GEN_INDEX(group_num, TALK_TYPE_GROUP)};
+    e.value = count;
+    emit_event(&e);
 }
 void group_peer_name_cb(Tox *tox, uint32_t group_num, uint32_t peer_num, const uint8_t *name, size_t length, void *user_data) {
     struct Group *cf = getgroup(group_num);
@@ -668,9 +3315,655 @@ void group_peer_name_cb(Tox *tox, uint32_t group_num, uint32_t peer_num, const u
     }
 
     struct GroupPeer *p = &cf->peers[peer_num];
-    sprintf(p->name, "%.*s", (int)length, (char*)name);
+    if (length > TOX_MAX_NAME_LENGTH) length = TOX_MAX_NAME_LENGTH;
+    memcpy(p->name, name, length);
+    p->name[length] = '\0';
+
+    struct Event e = {EVENT_GROUP_PEER_NAME, 0, GEN_INDEX(group_num, TALK_TYPE_GROUP)};
+    e.peer = peer_num;
+    e.name = p->name;
+    emit_event(&e);
+}
+
+
+/*******************************************************************************
+ *
+ * Checkpoint
+ *
+ ******************************************************************************/
+
+// A checkpoint is a snapshot of minitox's own state, so that on restart we can
+// mmap it and fill in contacts directly, instead of asking toxcore for every
+// field of every friend. It's only trusted for friends whose friend_num and
+// public key still match the savedata.
+//
+// Layout(native endian, the file is not meant to be portable):
+//
+//     struct CheckpointHeader
+//     struct CheckpointFriend  friends[friend_count]  // sorted by friend_num
+//     struct CheckpointHist    hist[hist_count]       // oldest first of every friend
+//     char                     strtab[strtab_size]    // interned, NUL-terminated
+
+#define CHECKPOINT_MAGIC   "MTXCKPT"
+#define CHECKPOINT_VERSION 2
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t friend_count;
+    uint32_t hist_count;
+    uint32_t strtab_size;
+};
+
+struct CheckpointFriend {
+    uint32_t friend_num;
+    uint8_t pubkey[TOX_PUBLIC_KEY_SIZE];
+    uint32_t name;            // strtab offset
+    uint32_t status_message;  // strtab offset
+    uint32_t hist_start;      // index of hist
+    uint32_t hist_count;
+};
+
+struct CheckpointHist {
+    int64_t time;
+    uint32_t is_self;
+    uint32_t name;  // strtab offset
+    uint32_t msg;   // strtab offset
+    uint32_t reserved;
+};
+
+struct Checkpoint {
+    void *map;
+    size_t size;
+    const struct CheckpointHeader *header;
+    const struct CheckpointFriend *friends;
+    const struct CheckpointHist *hist;
+    const char *strtab;
+};
+
+struct StrTab {
+    char *buf;
+    size_t len, cap;
+    uint32_t *slots;  // open addressing, offset+1 of the interned string, 0 means empty
+    size_t nslots, nused;
+};
+
+uint32_t strhash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+uint32_t strtab_intern(struct StrTab *st, const char *s) {
+    if (!s) s = "";
+    size_t len = strlen(s);
+
+    if (st->nused * 2 >= st->nslots) { // grow & rehash
+        size_t nslots = st->nslots ? st->nslots * 2 : 256;
+        uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+        for (size_t i = 0; i < st->nslots; i++) {
+            if (st->slots[i] == 0) continue;
+            const char *old = st->buf + st->slots[i] - 1;
+            size_t j = strhash(old, strlen(old)) & (nslots - 1);
+            while (slots[j]) j = (j + 1) & (nslots - 1);
+            slots[j] = st->slots[i];
+        }
+        free(st->slots);
+        st->slots = slots;
+        st->nslots = nslots;
+    }
+
+    size_t i = strhash(s, len) & (st->nslots - 1);
+    for (; st->slots[i] != 0; i = (i + 1) & (st->nslots - 1)) {
+        const char *old = st->buf + st->slots[i] - 1;
+        if (strcmp(old, s) == 0) return st->slots[i] - 1;
+    }
+
+    if (st->len + len + 1 > st->cap) {
+        while (st->len + len + 1 > st->cap) st->cap = st->cap ? st->cap * 2 : 4096;
+        st->buf = realloc(st->buf, st->cap);
+    }
+    uint32_t off = st->len;
+    memcpy(st->buf + off, s, len + 1);
+    st->len += len + 1;
+
+    st->slots[i] = off + 1;
+    st->nused++;
+    return off;
+}
+
+int _cmp_friend_num(const void *a, const void *b) {
+    uint32_t x = (*(struct Friend * const *)a)->friend_num;
+    uint32_t y = (*(struct Friend * const *)b)->friend_num;
+    return (x > y) - (x < y);
+}
+
+void update_checkpoint_file(void) {
+    if (!(checkpoint_filename && checkpoint_tmp_filename)) return;
+
+    size_t nfriend = 0;
+    for (struct Friend *f = friends; f != NULL; f = f->next) nfriend++;
+
+    struct Friend **sorted = malloc(sizeof(struct Friend*) * (nfriend + 1));
+    nfriend = 0;
+    for (struct Friend *f = friends; f != NULL; f = f->next) sorted[nfriend++] = f;
+    qsort(sorted, nfriend, sizeof(struct Friend*), _cmp_friend_num);
+
+    struct CheckpointFriend *cfs = calloc(nfriend + 1, sizeof(struct CheckpointFriend));
+    struct CheckpointHist *hist = calloc(nfriend * CHECKPOINT_HIST_COUNT + 1, sizeof(struct CheckpointHist));
+    uint32_t nhist = 0;
+    struct StrTab st = {0};
+
+    for (size_t i = 0; i < nfriend; i++) {
+        struct Friend *f = sorted[i];
+        struct CheckpointFriend *cf = &cfs[i];
+        cf->friend_num = f->friend_num;
+        memcpy(cf->pubkey, f->pubkey, TOX_PUBLIC_KEY_SIZE);
+        cf->name = strtab_intern(&st, f->name);
+        cf->status_message = strtab_intern(&st, f->status_message);
+
+        // hist is newest first, keep the newest ones but store them oldest first.
+        struct ChatHist *h = f->hist.newest;
+        for (int n = 1; n < CHECKPOINT_HIST_COUNT && h && h->next; n++) h = h->next;
+        cf->hist_start = nhist;
+        for (; h != NULL; h = h->prev, nhist++) {
+            hist[nhist].time = h->time;
+            hist[nhist].is_self = h->is_self;
+            hist[nhist].name = strtab_intern(&st, h->name);
+            hist[nhist].msg = strtab_intern(&st, h->msg);
+        }
+        cf->hist_count = nhist - cf->hist_start;
+    }
+
+    struct CheckpointHeader header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, nfriend, nhist, st.len};
+
+    size_t sizes[4] = {sizeof(header), sizeof(struct CheckpointFriend) * nfriend, sizeof(struct CheckpointHist) * nhist, st.len};
+    const void *parts[4] = {&header, cfs, hist, st.buf};
+    char *buf = malloc(sizes[0] + sizes[1] + sizes[2] + sizes[3]);
+    size_t len = 0;
+    for (int i = 0; i < 4; i++) {
+        if (sizes[i]) memcpy(buf + len, parts[i], sizes[i]);
+        len += sizes[i];
+    }
+    checkpoint_write.path = checkpoint_filename;
+    checkpoint_write.tmp_path = checkpoint_tmp_filename;
+    write_file(&checkpoint_write, buf, len);
+
+    free(st.buf);
+    free(st.slots);
+    free(hist);
+    free(cfs);
+    free(sorted);
+}
+
+void unload_checkpoint(struct Checkpoint *ckpt) {
+    if (ckpt->map) munmap(ckpt->map, ckpt->size);
+    memset(ckpt, 0, sizeof(struct Checkpoint));
+}
+
+bool load_checkpoint(struct Checkpoint *ckpt) {
+    memset(ckpt, 0, sizeof(struct Checkpoint));
+    if (!checkpoint_filename) return false;
+
+    int fd = open(checkpoint_filename, O_RDONLY);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct CheckpointHeader)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    ckpt->map = map;
+    ckpt->size = st.st_size;
+
+    const struct CheckpointHeader *header = map;
+    uint64_t expect = sizeof(struct CheckpointHeader)
+                      + (uint64_t)header->friend_count * sizeof(struct CheckpointFriend)
+                      + (uint64_t)header->hist_count * sizeof(struct CheckpointHist)
+                      + header->strtab_size;
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+            || header->version != CHECKPOINT_VERSION || expect != ckpt->size) {
+        goto FAIL;
+    }
+
+    ckpt->header = header;
+    ckpt->friends = (const struct CheckpointFriend *)(header + 1);
+    ckpt->hist = (const struct CheckpointHist *)(ckpt->friends + header->friend_count);
+    ckpt->strtab = (const char *)(ckpt->hist + header->hist_count);
+
+    // validate all offsets once, so that lookups below can trust them.
+    if (header->strtab_size == 0 || ckpt->strtab[header->strtab_size - 1] != '\0') goto FAIL;
+    for (uint32_t i = 0; i < header->hist_count; i++) {
+        if (ckpt->hist[i].name >= header->strtab_size || ckpt->hist[i].msg >= header->strtab_size) goto FAIL;
+    }
+    for (uint32_t i = 0; i < header->friend_count; i++) {
+        const struct CheckpointFriend *cf = &ckpt->friends[i];
+        if ((i > 0 && cf->friend_num <= cf[-1].friend_num)
+                || cf->name >= header->strtab_size || cf->status_message >= header->strtab_size
+                || cf->hist_start > header->hist_count || cf->hist_count > header->hist_count - cf->hist_start) {
+            goto FAIL;
+        }
+    }
+    return true;
+
+FAIL:
+    unload_checkpoint(ckpt);
+    return false;
+}
+
+int _cmp_checkpoint_friend(const void *key, const void *elem) {
+    uint32_t x = *(const uint32_t *)key;
+    uint32_t y = ((const struct CheckpointFriend *)elem)->friend_num;
+    return (x > y) - (x < y);
+}
+
+// restore f from the checkpoint, if it has a matching record.
+bool restore_friend(struct Checkpoint *ckpt, struct Friend *f) {
+    if (!ckpt->header) return false;
+    const struct CheckpointFriend *cf = bsearch(&f->friend_num, ckpt->friends, ckpt->header->friend_count,
+                                                sizeof(struct CheckpointFriend), _cmp_checkpoint_friend);
+    if (!cf || memcmp(cf->pubkey, f->pubkey, TOX_PUBLIC_KEY_SIZE) != 0) return false;
+
+    f->name = strdup(ckpt->strtab + cf->name);
+    f->status_message = strdup(ckpt->strtab + cf->status_message);
+    for (uint32_t i = 0; i < cf->hist_count; i++) {
+        const struct CheckpointHist *h = &ckpt->hist[cf->hist_start + i];
+        const char *msg = ckpt->strtab + h->msg;
+        addhist(&f->hist, h->time, h->is_self, ckpt->strtab + h->name, msg, strlen(msg));
+    }
+    return true;
+}
+
+/*******************************************************************************
+ *
+ * Perf Counters
+ *
+ ******************************************************************************/
+
+/// With `--perf`, hardware counters of the main thread are read around
+/// tox_iterate(), repl_iterate() and every tox callback, by perf_event_open(2),
+/// and summed up per section for `/stats`. Callbacks run inside tox_iterate(),
+/// whose numbers include theirs. Counters the system doesn't offer, e.g. in
+/// most VMs, are left out, and at worst only time is taken.
+
+enum PerfSection {
+    PERF_TOX_ITERATE,
+    PERF_REPL_ITERATE,
+    PERF_SELF_CONNECTION,
+    PERF_FRIEND_REQUEST,
+    PERF_FRIEND_MESSAGE,
+    PERF_FRIEND_READ_RECEIPT,
+    PERF_FRIEND_NAME,
+    PERF_FRIEND_STATUS_MESSAGE,
+    PERF_FRIEND_CONNECTION,
+    PERF_FRIEND_LOSSLESS_PACKET,
+    PERF_GROUP_INVITE,
+    PERF_GROUP_TITLE,
+    PERF_GROUP_MESSAGE,
+    PERF_GROUP_PEER_LIST,
+    PERF_GROUP_PEER_NAME,
+    PERF_SECTION_COUNT,
+};
+
+const char *perf_section_names[PERF_SECTION_COUNT] = {
+    "tox_iterate",
+    "repl_iterate",
+    "self_connection_cb",
+    "friend_request_cb",
+    "friend_message_cb",
+    "friend_read_receipt_cb",
+    "friend_name_cb",
+    "friend_status_message_cb",
+    "friend_connection_cb",
+    "friend_lossless_packet_cb",
+    "group_invite_cb",
+    "group_title_cb",
+    "group_message_cb",
+    "group_peer_list_cb",
+    "group_peer_name_cb",
+};
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_BRANCH_MISSES, PERF_COUNTER_COUNT };
+
+struct PerfStats {
+    uint64_t calls;
+    uint64_t ns;
+    uint64_t max_ns;
+    uint64_t counters[PERF_COUNTER_COUNT];
+};
+
+struct Perf {
+    bool enabled;                   // `--perf`
+    int group_fd;                   // -1 if no counter is available
+    int nr;                         // counters in the group
+    int slot[PERF_COUNTER_COUNT];   // where each counter is in a group read, -1 if unavailable
+    char unavailable[128];          // why, if some counter is
+    struct PerfStats stats[PERF_SECTION_COUNT];
+} perf = {.group_fd = -1};
+
+struct PerfSample {
+    uint64_t ns;
+    uint64_t counters[PERF_COUNTER_COUNT];
+};
+
+// after daemonize(), as counters follow the thread which opens them.
+void start_perf(void) {
+    if (!perf.enabled) return;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) perf.slot[i] = -1;
+#ifdef __linux__
+    static const uint64_t configs[PERF_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = perf.group_fd == -1;  // the leader starts the group
+        attr.exclude_kernel = 1;              // allowed by the default perf_event_paranoid
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int fd = syscall(__NR_perf_event_open, &attr, 0, -1, perf.group_fd, 0);
+        if (fd == -1) {
+            snprintf(perf.unavailable, sizeof(perf.unavailable), "%s", strerror(errno));
+            continue;
+        }
+        if (perf.group_fd == -1) perf.group_fd = fd;
+        perf.slot[i] = perf.nr++;
+    }
+    if (perf.group_fd != -1) ioctl(perf.group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+    snprintf(perf.unavailable, sizeof(perf.unavailable), "not supported on this system");
+#endif
+    if (perf.nr < PERF_COUNTER_COUNT) {
+        WARN("! %d of %d hardware counters are unavailable(%s), see `/stats`",
+             PERF_COUNTER_COUNT - perf.nr, PERF_COUNTER_COUNT, perf.unavailable);
+    }
+}
+
+void perf_read(struct PerfSample *s) {
+    s->ns = mono_ns();
+    memset(s->counters, 0, sizeof(s->counters));
+    if (perf.group_fd == -1) return;
+    struct {
+        uint64_t nr;
+        uint64_t values[PERF_COUNTER_COUNT];
+    } buf;
+    if (read(perf.group_fd, &buf, sizeof(buf)) <= 0) return;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (perf.slot[i] != -1) s->counters[i] = buf.values[perf.slot[i]];
+    }
+}
+
+void perf_begin(struct PerfSample *s) {
+    if (perf.enabled) perf_read(s);
+}
+
+void perf_end(struct PerfSample *begin, enum PerfSection section) {
+    if (!perf.enabled) return;
+    struct PerfSample end;
+    perf_read(&end);
+    struct PerfStats *st = &perf.stats[section];
+    uint64_t ns = end.ns - begin->ns;
+    st->calls++;
+    st->ns += ns;
+    if (ns > st->max_ns) st->max_ns = ns;
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) st->counters[i] += end.counters[i] - begin->counters[i];
+}
+
+// `<cb>_perf`, the same callback, counted as `_section`.
+#define PERF_CALLBACK(_section, _cb, _params, _args) \
+    void _cb##_perf _params { \
+        struct PerfSample _s; \
+        perf_begin(&_s); \
+        _cb _args; \
+        perf_end(&_s, _section); \
+    }
+
+// what to register as a callback
+#define PERF_CB(_cb) (perf.enabled ? _cb##_perf : _cb)
+
+PERF_CALLBACK(PERF_SELF_CONNECTION, self_connection_status_cb,
+              (Tox *tox, TOX_CONNECTION connection_status, void *user_data),
+              (tox, connection_status, user_data))
+PERF_CALLBACK(PERF_FRIEND_REQUEST, friend_request_cb,
+              (Tox *tox, const uint8_t *public_key, const uint8_t *message, size_t length, void *user_data),
+              (tox, public_key, message, length, user_data))
+PERF_CALLBACK(PERF_FRIEND_MESSAGE, friend_message_cb,
+              (Tox *tox, uint32_t friend_num, TOX_MESSAGE_TYPE type, const uint8_t *message, size_t length, void *user_data),
+              (tox, friend_num, type, message, length, user_data))
+PERF_CALLBACK(PERF_FRIEND_READ_RECEIPT, friend_read_receipt_cb,
+              (Tox *tox, uint32_t friend_num, uint32_t message_id, void *user_data),
+              (tox, friend_num, message_id, user_data))
+PERF_CALLBACK(PERF_FRIEND_NAME, friend_name_cb,
+              (Tox *tox, uint32_t friend_num, const uint8_t *name, size_t length, void *user_data),
+              (tox, friend_num, name, length, user_data))
+PERF_CALLBACK(PERF_FRIEND_STATUS_MESSAGE, friend_status_message_cb,
+              (Tox *tox, uint32_t friend_num, const uint8_t *message, size_t length, void *user_data),
+              (tox, friend_num, message, length, user_data))
+PERF_CALLBACK(PERF_FRIEND_CONNECTION, friend_connection_status_cb,
+              (Tox *tox, uint32_t friend_num, TOX_CONNECTION connection_status, void *user_data),
+              (tox, friend_num, connection_status, user_data))
+PERF_CALLBACK(PERF_FRIEND_LOSSLESS_PACKET, friend_lossless_packet_cb,
+              (Tox *tox, uint32_t friend_num, const uint8_t *data, size_t length, void *user_data),
+              (tox, friend_num, data, length, user_data))
+PERF_CALLBACK(PERF_GROUP_INVITE, group_invite_cb,
+              (Tox *tox, uint32_t friend_num, TOX_CONFERENCE_TYPE type, const uint8_t *cookie, size_t length, void *user_data),
+              (tox, friend_num, type, cookie, length, user_data))
+PERF_CALLBACK(PERF_GROUP_TITLE, group_title_cb,
+              (Tox *tox, uint32_t group_num, uint32_t peer_number, const uint8_t *title, size_t length, void *user_data),
+              (tox, group_num, peer_number, title, length, user_data))
+PERF_CALLBACK(PERF_GROUP_MESSAGE, group_message_cb,
+              (Tox *tox, uint32_t group_num, uint32_t peer_number, TOX_MESSAGE_TYPE type, const uint8_t *message, size_t length, void *user_data),
+              (tox, group_num, peer_number, type, message, length, user_data))
+PERF_CALLBACK(PERF_GROUP_PEER_LIST, group_peer_list_changed_cb,
+              (Tox *tox, uint32_t group_num, void *user_data),
+              (tox, group_num, user_data))
+PERF_CALLBACK(PERF_GROUP_PEER_NAME, group_peer_name_cb,
+              (Tox *tox, uint32_t group_num, uint32_t peer_num, const uint8_t *name, size_t length, void *user_data),
+              (tox, group_num, peer_num, name, length, user_data))
+
+/*******************************************************************************
+ *
+ * Alloc Profile
+ *
+ ******************************************************************************/
+
+/// `make ALLOC_PROFILE=1` builds minitox with its malloc, calloc, realloc, free
+/// and strdup calls wrapped(ld --wrap), so every allocation is counted under
+/// the address it's called from. `/allocstats` and exit show the top call
+/// sites, named by dladdr(3), with how many allocations each made since the
+/// last `/allocstats`, which is what should stay at zero in the steady state.
+///
+/// Every block carries a header telling which site it's from, so that frees
+/// are taken off the site's live count.
+
+#ifdef MINITOX_ALLOC_PROFILE
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+#define ALLOC_MAGIC 0x414C4F43
+
+struct AllocHeader {  // 16 bytes, keeps blocks aligned
+    uint32_t magic;
+    uint32_t site;
+    uint64_t size;
+};
+
+struct AllocSite {
+    void *addr;             // the return address of the call, NULL for others
+    uint64_t count;         // allocations, reallocations included
+    uint64_t bytes;
+    uint64_t live_count;    // not freed yet
+    uint64_t live_bytes;
+    uint64_t shown_count;   // `count` at the last `/allocstats`
+};
+
+struct AllocProfile {
+    pthread_mutex_t lock;   // the compressor and log writer threads allocate too
+    struct AllocSite sites[ALLOC_SITES];  // open addressing, sites[0] is others
+    size_t used;
+} alloc_profile = {PTHREAD_MUTEX_INITIALIZER};
+
+// count `h`, just allocated with `size` bytes for the caller, under `addr`.
+void *alloc_track(struct AllocHeader *h, size_t size, void *addr) {
+    if (!h) return NULL;
+    pthread_mutex_lock(&alloc_profile.lock);
+    uint32_t i = (uint32_t)((uintptr_t)addr * 0x9E3779B97F4A7C15u >> 40) & (ALLOC_SITES - 1);
+    while (true) {
+        struct AllocSite *st = &alloc_profile.sites[i];
+        if (i != 0 && st->addr == addr) break;
+        if (i != 0 && !st->addr) {
+            if (alloc_profile.used >= ALLOC_SITES * 3 / 4) {
+                i = 0;
+                break;
+            }
+            st->addr = addr;
+            alloc_profile.used++;
+            break;
+        }
+        i = (i + 1) & (ALLOC_SITES - 1);
+    }
+    struct AllocSite *st = &alloc_profile.sites[i];
+    st->count++;
+    st->bytes += size;
+    st->live_count++;
+    st->live_bytes += size;
+    pthread_mutex_unlock(&alloc_profile.lock);
+
+    h->magic = ALLOC_MAGIC;
+    h->site = i;
+    h->size = size;
+    return h + 1;
+}
+
+// the header of `ptr`, taken off its site, or NULL if it's not from the wrappers.
+struct AllocHeader *alloc_untrack(void *ptr) {
+    struct AllocHeader *h = (struct AllocHeader *)ptr - 1;
+    if (h->magic != ALLOC_MAGIC) return NULL;
+    pthread_mutex_lock(&alloc_profile.lock);
+    struct AllocSite *st = &alloc_profile.sites[h->site];
+    st->live_count--;
+    st->live_bytes -= h->size;
+    pthread_mutex_unlock(&alloc_profile.lock);
+    h->magic = 0;
+    return h;
+}
+
+void *__wrap_malloc(size_t size) {
+    return alloc_track(__real_malloc(sizeof(struct AllocHeader) + size), size, __builtin_return_address(0));
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > (SIZE_MAX - sizeof(struct AllocHeader)) / size) return NULL;
+    return alloc_track(__real_calloc(1, sizeof(struct AllocHeader) + nmemb * size), nmemb * size,
+                       __builtin_return_address(0));
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    void *addr = __builtin_return_address(0);
+    if (!ptr) return alloc_track(__real_malloc(sizeof(struct AllocHeader) + size), size, addr);
+    struct AllocHeader *h = alloc_untrack(ptr);
+    if (!h) return __real_realloc(ptr, size);
+    struct AllocHeader *nh = __real_realloc(h, sizeof(struct AllocHeader) + size);
+    if (!nh) {  // `ptr` is still there
+        alloc_track(h, h->size, addr);
+        return NULL;
+    }
+    return alloc_track(nh, size, addr);
+}
+
+void __wrap_free(void *ptr) {
+    if (!ptr) return;
+    struct AllocHeader *h = alloc_untrack(ptr);
+    __real_free(h ? (void *)h : ptr);
+}
+
+char *__wrap_strdup(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *p = alloc_track(__real_malloc(sizeof(struct AllocHeader) + len), len, __builtin_return_address(0));
+    if (p) memcpy(p, s, len);
+    return p;
+}
+
+int _cmp_alloc_count(const void *a, const void *b) {
+    const struct AllocSite *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+int _cmp_alloc_bytes(const void *a, const void *b) {
+    const struct AllocSite *x = a, *y = b;
+    return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
 }
 
+// print the top sites to `fp`, or to the views if it's NULL.
+void print_alloc_profile(FILE *fp) {
+    static struct AllocSite sites[ALLOC_SITES];
+    size_t n = 0;
+    pthread_mutex_lock(&alloc_profile.lock);
+    for (size_t i = 0; i < ALLOC_SITES; i++) {
+        struct AllocSite *st = &alloc_profile.sites[i];
+        if (st->count == 0) continue;
+        sites[n++] = *st;
+        if (!fp) st->shown_count = st->count;
+    }
+    pthread_mutex_unlock(&alloc_profile.lock);
+
+    for (int by_bytes = 0; by_bytes < 2; by_bytes++) {
+        qsort(sites, n, sizeof(struct AllocSite), by_bytes ? _cmp_alloc_bytes : _cmp_alloc_count);
+        char line[256];
+        snprintf(line, sizeof(line), "#Top allocators by %s(call site|count|since last|KB|live count|live KB):",
+                 by_bytes ? "bytes" : "count");
+        if (fp) fprintf(fp, "%s\n", line);
+        else PRINT("%s", line);
+        for (size_t i = 0; i < n && i < ALLOC_TOP; i++) {
+            struct AllocSite *st = &sites[i];
+            char name[96] = "(others)";
+            Dl_info info;
+            if (st->addr && dladdr(st->addr, &info) && info.dli_sname) {
+                snprintf(name, sizeof(name), "%s+0x%lx", info.dli_sname, (unsigned long)((char *)st->addr - (char *)info.dli_saddr));
+            } else if (st->addr && dladdr(st->addr, &info) && info.dli_fname) {  // static, for addr2line(1)
+                const char *file = strrchr(info.dli_fname, '/');
+                snprintf(name, sizeof(name), "%s+0x%lx", file ? file + 1 : info.dli_fname,
+                         (unsigned long)((char *)st->addr - (char *)info.dli_fbase));
+            } else if (st->addr) {
+                snprintf(name, sizeof(name), "%p", st->addr);
+            }
+            snprintf(line, sizeof(line), "%-36s %10llu %10llu %10.1f %10llu %10.1f", name, (unsigned long long)st->count,
+                     (unsigned long long)(st->count - st->shown_count), st->bytes / 1024.0,
+                     (unsigned long long)st->live_count, st->live_bytes / 1024.0);
+            if (fp) fprintf(fp, "%s\n", line);
+            else PRINT("%s", line);
+        }
+    }
+}
+
+void alloc_profile_exit(void) {
+    print_alloc_profile(stderr);
+}
+
+void start_alloc_profile(void) {
+    atexit(alloc_profile_exit);
+}
+
+#else
+
+void print_alloc_profile(FILE *fp) {
+    WARN("^ build with `make ALLOC_PROFILE=1` to count allocations");
+}
+
+void start_alloc_profile(void) {}
+
+#endif
 
 /*******************************************************************************
  *
@@ -715,9 +4008,13 @@ void init_friends(void) {
 
     size_t len;
 
+    struct Checkpoint ckpt;
+    load_checkpoint(&ckpt);
+
     for (int i = 0;i<sz;i++) {
         uint32_t friend_num = friend_list[i];
         struct Friend *f = addfriend(friend_num);
+        if (restore_friend(&ckpt, f)) continue;
 
         len = tox_friend_get_name_size(tox, friend_num, NULL) + 1;
         f->name = calloc(1, len);
@@ -726,74 +4023,278 @@ void init_friends(void) {
         len = tox_friend_get_status_message_size(tox, friend_num, NULL) + 1;
         f->status_message = calloc(1, len);
         tox_friend_get_status_message(tox, friend_num, (uint8_t*)f->status_message, NULL);
-
-        tox_friend_get_public_key(tox, friend_num, f->pubkey, NULL);
     }
     free(friend_list);
+    unload_checkpoint(&ckpt);
 
     // add self
     self.friend_num = TALK_TYPE_NULL;
     len = tox_self_get_name_size(tox) + 1;
     self.name = calloc(1, len);
     tox_self_get_name(tox, (uint8_t*)self.name);
+    highlights_rebuild();
+
+    len = tox_self_get_status_message_size(tox) + 1;
+    self.status_message = calloc(1, len);
+    tox_self_get_status_message(tox, (uint8_t*)self.status_message);
+
+    tox_self_get_public_key(tox, self.pubkey);
+}
+
+void update_savedata_file(void)
+{
+    if (!(savedata_filename && savedata_tmp_filename)) return;
+
+    size_t size = tox_get_savedata_size(tox);
+    char *savedata = malloc(size);
+    tox_get_savedata(tox, (uint8_t*)savedata);
+
+    savedata_write.path = savedata_filename;
+    savedata_write.tmp_path = savedata_tmp_filename;
+    write_file(&savedata_write, savedata, size);
+
+    update_checkpoint_file();
+}
+
+void bootstrap(void)
+{
+    for (size_t i = 0; i < config.node_count; i ++) {
+        struct DHT_node *node = &config.nodes[i];
+        uint8_t bin[TOX_PUBLIC_KEY_SIZE];
+        if (!hex2bin(bin, node->key_hex, sizeof(bin) * 2)) {
+            WARN("! Invalid key of bootstrap node %s", node->ip);
+            continue;
+        }
+        tox_bootstrap(tox, node->ip, node->port, bin, NULL);
+    }
+}
+
+void setup_tox(void)
+{
+    create_tox();
+    init_friends();
+    bootstrap();
+
+    ////// register callbacks
+
+    // self
+    tox_callback_self_connection_status(tox, PERF_CB(self_connection_status_cb));
+
+    // friend
+    tox_callback_friend_request(tox, PERF_CB(friend_request_cb));
+    tox_callback_friend_message(tox, PERF_CB(friend_message_cb));
+    tox_callback_friend_read_receipt(tox, PERF_CB(friend_read_receipt_cb));
+    tox_callback_friend_name(tox, PERF_CB(friend_name_cb));
+    tox_callback_friend_status_message(tox, PERF_CB(friend_status_message_cb));
+    tox_callback_friend_connection_status(tox, PERF_CB(friend_connection_status_cb));
+    tox_callback_friend_lossless_packet(tox, PERF_CB(friend_lossless_packet_cb));
+
+    // group
+    tox_callback_conference_invite(tox, PERF_CB(group_invite_cb));
+    tox_callback_conference_title(tox, PERF_CB(group_title_cb));
+    tox_callback_conference_message(tox, PERF_CB(group_message_cb));
+    tox_callback_conference_peer_list_changed(tox, PERF_CB(group_peer_list_changed_cb));
+    tox_callback_conference_peer_name(tox, PERF_CB(group_peer_name_cb));
+}
+
+/*******************************************************************************
+ *
+ * Config
+ *
+ ******************************************************************************/
+
+/// `config_filename` holds settings which take effect without restarting, one
+/// `<name> = <value>` per line, `#` for comments, e.g.
+///
+///     history_size = 500
+///     log_level = warn
+///     bootstrap = 128.199.199.197 33445 B05C8869DBB4EDDD308F43C1A974A20A725A36EACCA123862FDE9945BF9D3E09
+///
+/// It's read at startup, and again on SIGHUP or `/reload`, while friends stay
+/// connected. Settings left out are back to their defaults, and a file with any
+/// error is not applied at all.
+
+const char *log_level_names[] = {"info", "warn", "error", NULL};
+
+struct Setting {
+    const char *name;
+    size_t offset;        // of the uint32_t in struct Config
+    uint32_t min, max;
+    const char **names;   // of the values, if it's not a number
+};
+
+struct Setting settings[] = {
+    {"history_size", offsetof(struct Config, history_size), 0, 1000000},
+    {"history_shown", offsetof(struct Config, history_shown), 1, 1000000},
+    {"cold_history_after", offsetof(struct Config, cold_history_after), 0, UINT32_MAX},
+    {"hot_history_count", offsetof(struct Config, hot_history_count), 1, 1000000},
+    {"notify_interval", offsetof(struct Config, notify_interval), 0, UINT32_MAX},
+    {"plugin_call_budget_us", offsetof(struct Config, plugin_call_budget_us), 0, UINT32_MAX},
+    {"save_after_command", offsetof(struct Config, save_after_command), 0, 1},
+    {"log_level", offsetof(struct Config, log_level), 0, LOG_LEVEL_ERROR, log_level_names},
+};
 
-    len = tox_self_get_status_message_size(tox) + 1;
-    self.status_message = calloc(1, len);
-    tox_self_get_status_message(tox, (uint8_t*)self.status_message);
+#define SETTING_COUNT (sizeof(settings)/sizeof(struct Setting))
 
-    tox_self_get_public_key(tox, self.pubkey);
+uint32_t *setting_value(struct Config *c, struct Setting *st) {
+    return (uint32_t *)((char *)c + st->offset);
 }
 
-void update_savedata_file(void)
-{
-    if (!(savedata_filename && savedata_tmp_filename)) return;
-
-    size_t size = tox_get_savedata_size(tox);
-    char *savedata = malloc(size);
-    tox_get_savedata(tox, (uint8_t*)savedata);
+const char *setting_text(struct Config *c, struct Setting *st, char *buf) {
+    uint32_t v = *setting_value(c, st);
+    if (st->names) return st->names[v];
+    sprintf(buf, "%u", v);
+    return buf;
+}
 
-    FILE *f = fopen(savedata_tmp_filename, "wb");
-    fwrite(savedata, size, 1, f);
-    fclose(f);
+bool parse_setting(struct Setting *st, const char *text, uint32_t *v) {
+    if (st->names) {
+        for (uint32_t i = 0; st->names[i]; i++) {
+            if (strcmp(st->names[i], text) == 0) {
+                *v = i;
+                return true;
+            }
+        }
+        return false;
+    }
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(text, &end, 10);
+    if (errno || end == text || *end || text[0] == '-' || n < st->min || n > st->max) return false;
+    *v = n;
+    return true;
+}
 
-    rename(savedata_tmp_filename, savedata_filename);
+bool parse_bootstrap(char *text, struct Config *c) {
+    char *ip = strtok(text, " \t");
+    char *port = strtok(NULL, " \t");
+    char *key = strtok(NULL, " \t");
+    if (!key || strtok(NULL, " \t") || strlen(key) != TOX_PUBLIC_KEY_SIZE * 2) return false;
+    uint8_t bin[TOX_PUBLIC_KEY_SIZE];
+    char *end;
+    unsigned long p = strtoul(port, &end, 10);
+    if (*end || p == 0 || p > UINT16_MAX || !hex2bin(bin, key, sizeof(bin) * 2)) return false;
+
+    c->nodes = realloc(c->nodes, (c->node_count + 1) * sizeof(struct DHT_node));
+    struct DHT_node *node = &c->nodes[c->node_count++];
+    node->ip = strdup(ip);
+    node->port = p;
+    memcpy(node->key_hex, key, sizeof(node->key_hex));
+    return true;
+}
 
-    free(savedata);
+void free_nodes(struct Config *c) {
+    if (c->nodes == bootstrap_nodes) return;
+    for (size_t i = 0; i < c->node_count; i++) free((char *)c->nodes[i].ip);
+    free(c->nodes);
 }
 
-void bootstrap(void)
-{
-    for (size_t i = 0; i < sizeof(bootstrap_nodes)/sizeof(struct DHT_node); i ++) {
-        uint8_t *bin = hex2bin(bootstrap_nodes[i].key_hex);
-        tox_bootstrap(tox, bootstrap_nodes[i].ip, bootstrap_nodes[i].port, bin, NULL);
-        free(bin);
+bool same_nodes(struct Config *a, struct Config *b) {
+    if (a->node_count != b->node_count) return false;
+    for (size_t i = 0; i < a->node_count; i++) {
+        if (strcmp(a->nodes[i].ip, b->nodes[i].ip) != 0 || a->nodes[i].port != b->nodes[i].port
+                || strcmp(a->nodes[i].key_hex, b->nodes[i].key_hex) != 0) return false;
     }
+    return true;
 }
 
-void setup_tox(void)
-{
-    create_tox();
-    init_friends();
-    bootstrap();
+// read `config_filename` into `c`. returns false on any error, which is warned.
+bool parse_config(FILE *fp, struct Config *c) {
+    bool ok = true;
+    char line[1024];
+    for (int lineno = 1; fgets(line, sizeof(line), fp); lineno++) {
+        char *p = strchr(line, '#');
+        if (p) *p = '\0';
+        char *name = line + strspn(line, " \t\r\n");
+        if (!*name) continue;
+
+        char *eq = strchr(name, '=');
+        char *value = eq ? eq + 1 : NULL;
+        if (eq) {
+            for (p = eq; p > name && strchr(" \t=", p[-1]); p--);
+            *p = '\0';
+            value += strspn(value, " \t");
+            for (p = value + strlen(value); p > value && strchr(" \t\r\n", p[-1]); p--);
+            *p = '\0';
+        }
+        if (!value || !*value) {
+            WARN("! %s:%d: expect `<name> = <value>`", config_filename, lineno);
+            ok = false;
+            continue;
+        }
 
-    ////// register callbacks
+        if (strcmp(name, "bootstrap") == 0) {
+            if (!parse_bootstrap(value, c)) {
+                WARN("! %s:%d: expect `bootstrap = <host> <port> <public_key>`", config_filename, lineno);
+                ok = false;
+            }
+            continue;
+        }
+        size_t i = 0;
+        while (i < SETTING_COUNT && strcmp(settings[i].name, name) != 0) i++;
+        if (i == SETTING_COUNT) {
+            WARN("! %s:%d: unknown setting `%s`", config_filename, lineno, name);
+            ok = false;
+        } else if (!parse_setting(&settings[i], value, setting_value(c, &settings[i]))) {
+            WARN("! %s:%d: invalid value of %s: %s", config_filename, lineno, name, value);
+            ok = false;
+        }
+    }
+    return ok;
+}
 
-    // self
-    tox_callback_self_connection_status(tox, self_connection_status_cb);
+// (re)load the config, and apply what's changed. On startup, no config file is fine.
+void load_config(bool reload) {
+    if (!config_filename) return;
+    FILE *fp = fopen(config_filename, "r");
+    if (!fp) {
+        if (reload) WARN("! can't read %s: %s", config_filename, strerror(errno));
+        return;
+    }
+    struct Config c = DEFAULT_CONFIG;
+    c.nodes = NULL;
+    c.node_count = 0;
+    bool ok = parse_config(fp, &c);
+    fclose(fp);
+    if (!ok) {
+        free_nodes(&c);
+        WARN("! %s has errors, settings are unchanged", config_filename);
+        return;
+    }
+    if (c.node_count == 0) {
+        c.nodes = bootstrap_nodes;
+        c.node_count = sizeof(bootstrap_nodes)/sizeof(struct DHT_node);
+    }
 
-    // friend
-    tox_callback_friend_request(tox, friend_request_cb);
-    tox_callback_friend_message(tox, friend_message_cb);
-    tox_callback_friend_name(tox, friend_name_cb);
-    tox_callback_friend_status_message(tox, friend_status_message_cb);
-    tox_callback_friend_connection_status(tox, friend_connection_status_cb);
+    struct Config old = config;
+    config = c;
+    int changed = 0;
+    for (size_t i = 0; i < SETTING_COUNT; i++) {
+        if (*setting_value(&old, &settings[i]) == *setting_value(&c, &settings[i])) continue;
+        char before[16], after[16];
+        if (reload) INFO("* %s: %s -> %s", settings[i].name, setting_text(&old, &settings[i], before),
+                         setting_text(&c, &settings[i], after));
+        changed++;
+    }
+    if (c.history_size > 0 && (old.history_size == 0 || c.history_size < old.history_size)) {
+        for (struct Friend *f = friends; f; f = f->next) trimhist(&f->hist, c.history_size);
+        for (struct Group *cf = groups; cf; cf = cf->next) trimhist(&cf->hist, c.history_size);
+    }
+    if (!same_nodes(&old, &c)) {
+        if (reload) {
+            INFO("* bootstrap nodes: %zu", c.node_count);
+            bootstrap();  // only adds nodes, connections are kept
+        }
+        changed++;
+    }
+    free_nodes(&old);
+    if (reload) INFO("* Reloaded %s, %d settings changed", config_filename, changed);
+}
 
-    // group
-    tox_callback_conference_invite(tox, group_invite_cb);
-    tox_callback_conference_title(tox, group_title_cb);
-    tox_callback_conference_message(tox, group_message_cb);
-    tox_callback_conference_peer_list_changed(tox, group_peer_list_changed_cb);
-    tox_callback_conference_peer_name(tox, group_peer_name_cb);
+volatile sig_atomic_t reload_requested = 0;
+
+void on_sighup(int sig) {
+    reload_requested = 1;
 }
 
 /*******************************************************************************
@@ -827,16 +4328,15 @@ void _print_friend_info(struct Friend *f, bool is_self) {
     if (is_self) {
         uint8_t tox_id_bin[TOX_ADDRESS_SIZE];
         tox_self_get_address(tox, tox_id_bin);
-        char *hex = bin2hex(tox_id_bin, sizeof(tox_id_bin));
-        PRINT("%-15s%s","Tox ID:", hex);
-        free(hex);
+        char hex[TOX_ADDRESS_SIZE * 2 + 1];
+        PRINT("%-15s%s","Tox ID:", bin2hex(hex, tox_id_bin, sizeof(tox_id_bin)));
     }
 
-    char *hex = bin2hex(f->pubkey, sizeof(f->pubkey));
-    PRINT("%-15s%s","Public Key:", hex);
-    free(hex);
+    char hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    PRINT("%-15s%s","Public Key:", bin2hex(hex, f->pubkey, sizeof(f->pubkey)));
     PRINT("%-15s%s", "Status Msg:",f->status_message);
     PRINT("%-15s%s", "Network:",connection_enum2text(f->connection));
+    if (!is_self) PRINT("%-15s%s", "Client:", f->caps ? "minitox(compressed large messages)" : "unknown");
 }
 
 void command_info(int narg, char **args) {
@@ -887,8 +4387,8 @@ void command_setname(int narg, char **args) {
         return;
     }
 
-    self.name = realloc(self.name, len + 1);
-    strcpy(self.name, name);
+    self.name = setstr(self.name, name, len);
+    highlights_rebuild();
 }
 
 void command_setstmsg(int narg, char **args) {
@@ -901,8 +4401,7 @@ void command_setstmsg(int narg, char **args) {
         return;
     }
 
-    self.status_message = realloc(self.status_message, len+1);
-    strcpy(self.status_message, status);
+    self.status_message = setstr(self.status_message, status, len);
 }
 
 void command_add(int narg, char **args) {
@@ -910,10 +4409,15 @@ void command_add(int narg, char **args) {
     char *msg = "";
     if (narg > 1) msg = args[1];
 
-    uint8_t *bin_id = hex2bin(hex_id);
+    uint8_t bin_id[TOX_ADDRESS_SIZE];
+    size_t len = strlen(hex_id);
+    if (len != sizeof(bin_id) * 2 || !hex2bin(bin_id, hex_id, len)) {
+        WARN("^ Invalid tox id, it should be %d hex chars", (int)sizeof(bin_id) * 2);
+        return;
+    }
+
     TOX_ERR_FRIEND_ADD err;
     uint32_t friend_num = tox_friend_add(tox, bin_id, (uint8_t*)msg, strlen(msg), &err);
-    free(bin_id);
 
     if (err != TOX_ERR_FRIEND_ADD_OK) {
         ERROR("! add friend failed, errcode:%d",err);
@@ -953,9 +4457,13 @@ void command_contacts(int narg, char **args) {
     }
 
     struct Group *cf = groups;
-    PRINT("\n#Groups(contact_index|count of peers|name):\n");
+    PRINT("\n#Groups(contact_index|count of peers|name|unread):\n");
     for (;cf != NULL; cf = cf->next) {
-        PRINT("%3d  %10d  %s",GEN_INDEX(cf->group_num, TALK_TYPE_GROUP), tox_conference_peer_count(tox, cf->group_num, NULL), cf->title);
+        if (cf->unread > 0) {
+            PRINT("%3d  %10d  %s  (%u new)",GEN_INDEX(cf->group_num, TALK_TYPE_GROUP), tox_conference_peer_count(tox, cf->group_num, NULL), cf->title, cf->unread);
+        } else {
+            PRINT("%3d  %10d  %s",GEN_INDEX(cf->group_num, TALK_TYPE_GROUP), tox_conference_peer_count(tox, cf->group_num, NULL), cf->title);
+        }
     }
 }
 
@@ -964,9 +4472,16 @@ void command_save(int narg, char **args) {
 }
 
 void command_go(int narg, char **args) {
+    if (!view) {
+        WARN("^ /go only works in a terminal");
+        return;
+    }
+    struct History *hp = get_current_histp();
+    if (hp) hp->last_read = coarse_time();  // read until now
     if (narg == 0) {
-        TalkingTo = TALK_TYPE_NULL;
-        strcpy(async_repl->prompt, CMD_PROMPT);
+        view->talking_to = TALK_TYPE_NULL;
+        view->hist_scroll = 0;
+        strcpy(view->repl.prompt, CMD_PROMPT);
         return;
     }
     uint32_t contact_idx;
@@ -976,8 +4491,9 @@ void command_go(int narg, char **args) {
         case TALK_TYPE_FRIEND: {
             struct Friend *f = getfriend(num);
             if (f) {
-                TalkingTo = contact_idx;
-                sprintf(async_repl->prompt, FRIEND_TALK_PROMPT, f->name);
+                view->talking_to = contact_idx;
+                view->hist_scroll = 0;
+                sprintf(view->repl.prompt, FRIEND_TALK_PROMPT, f->name);
                 return;
             }
             break;
@@ -985,8 +4501,10 @@ void command_go(int narg, char **args) {
         case TALK_TYPE_GROUP: {
             struct Group *cf = getgroup(num);
             if (cf) {
-                TalkingTo = contact_idx;
-                sprintf(async_repl->prompt, GROUP_TALK_PROMPT, cf->title);
+                cf->unread = 0;
+                view->talking_to = contact_idx;
+                view->hist_scroll = 0;
+                sprintf(view->repl.prompt, GROUP_TALK_PROMPT, cf->title);
                 return;
             }
             break;
@@ -998,25 +4516,36 @@ FAIL:
 }
 
 void command_history(int narg, char **args) {
-    uint32_t n = DEFAULT_CHAT_HIST_COUNT;
-    if (narg > 0 && !str2uint(args[0], &n)) {
+    uint32_t n = config.history_shown;
+    uint32_t skip = 0;
+    if (!view) {
+        WARN("^ /history only works in a terminal");
+        return;
+    }
+    if (narg > 0 && strcmp(args[0], "more") == 0) {
+        skip = view->hist_scroll; // continue from where this view has scrolled to
+    } else if (narg > 0 && !str2uint(args[0], &n)) {
         WARN("Invalid args");
     }
 
-    struct ChatHist **hp = get_current_histp();
+    struct History *hp = get_current_histp();
     if (!hp) {
         WARN("you are not talking to someone");
         return;
     }
+    if (skip < hp->packed_count) thaw_hist(hp);  // packed ones are the oldest
 
-    struct ChatHist *hist = *hp;
+    // n items after the oldest `skip` ones
+    struct ChatHist *hist = hp->oldest;
+    for (uint32_t i=0;i<skip && hist; i++) hist = hist->prev;
+    uint32_t count = 0;
 
-    while (hist && hist->next) hist = hist->next;
     PRINT("%s", "------------ HISTORY BEGIN ---------------")
-    for (int i=0;i<n && hist; i++,hist=hist->prev) {
-        printf("%s\n", hist->msg);
+    for (;count<n && hist; count++,hist=hist->prev) {
+        print_hist(hist);
     }
     PRINT("%s", "------------ HISTORY   END ---------------")
+    view->hist_scroll = skip + count;
 }
 
 void _command_accept(int narg, char **args, bool is_accept) {
@@ -1125,8 +4654,183 @@ void command_settitle(int narg, char **args) {
         return;
     }
 
-    cf->title = realloc(cf->title, len+1);
-    sprintf(cf->title, "%.*s",(int)len,title);
+    cf->title = setstr(cf->title, title, len);
+}
+
+void command_plugins(int narg, char **args) {
+    PRINT("#Plugins(name|calls|avg us|max us|slow calls|path):");
+    for (int i = 0; i < plugin_count; i++) {
+        struct Plugin *pl = &plugins[i];
+        PRINT("%-16.16s %10llu %8.1f %8.1f %10llu  %s", pl->p->name, (unsigned long long)pl->calls,
+              pl->calls ? pl->total_ns / 1e3 / pl->calls : 0.0, pl->max_ns / 1e3,
+              (unsigned long long)pl->slow_calls, pl->path);
+    }
+}
+
+void command_trigger(int narg, char **args) {
+    enum TriggerAction action = 0;
+    while (action < TRIGGER_ACTION_COUNT && strcmp(trigger_action_names[action], args[1]) != 0) action++;
+    if (action == TRIGGER_ACTION_COUNT) {
+        WARN("^ Invalid action, should be one of reply, cmd, notify");
+        return;
+    }
+    if (action == TRIGGER_CMD && args[2][0] != '/') {
+        WARN("^ Invalid command, should start with '/'");
+        return;
+    }
+    struct Trigger *t = addtrigger(args[0], action, args[2]);
+    if (trigger_ac.dirty) ac_build(&trigger_ac);
+    INFO("* trigger %u added", t->id);
+}
+
+void command_triggers(int narg, char **args) {
+    PRINT("#Triggers(id|action|hits|keyword|text):");
+    for (struct Trigger *t = triggers; t; t = t->next) {
+        PRINT("%-5u %-7s %8llu  %-16s %s", t->id, trigger_action_names[t->action], (unsigned long long)t->hits, t->keyword, t->arg);
+    }
+}
+
+void command_untrigger(int narg, char **args) {
+    uint32_t id;
+    if (!str2uint(args[0], &id) || !deltrigger(id)) {
+        WARN("^ Invalid trigger id");
+        return;
+    }
+    if (trigger_ac.dirty) ac_build(&trigger_ac);
+}
+
+void command_highlight(int narg, char **args) {
+    if (narg == 0) {
+        PRINT("#Highlights: %s(your name)", self.name);
+        for (struct Highlight *h = highlights; h; h = h->next) {
+            PRINT("%s", h->keyword);
+        }
+        return;
+    }
+    struct Highlight *h = calloc(1, sizeof(struct Highlight));
+    h->keyword = strdup(args[0]);
+    h->len = strlen(h->keyword);
+    h->next = highlights;
+    highlights = h;
+    highlights_rebuild();
+}
+
+void command_unhighlight(int narg, char **args) {
+    struct Highlight **p = &highlights;
+    LIST_FIND(p, strcmp((*p)->keyword, args[0]) == 0);
+    struct Highlight *h = *p;
+    if (!h) {
+        WARN("^ Invalid keyword");
+        return;
+    }
+    *p = h->next;
+    free(h->keyword);
+    free(h);
+    highlights_rebuild();
+}
+
+void command_mentions(int narg, char **args) {
+    uint32_t n = config.history_shown;
+    if (narg > 0 && !str2uint(args[0], &n)) {
+        WARN("Invalid args");
+    }
+    if (n > MAX_MENTIONS) n = MAX_MENTIONS;
+    uint64_t i = mention_count > n ? mention_count - n : 0;
+
+    PRINT("%s", "------------ MENTIONS BEGIN --------------")
+    for (; i < mention_count; i++) {
+        struct Mention *m = &mentions[i % MAX_MENTIONS];
+        struct Group *cf = getgroup(INDEX_TO_NUM(m->contact));
+        if (!cf) continue;
+        if (cf->hist.blocks && (!cf->hist.oldest || m->serial < cf->hist.oldest->serial)) thaw_hist(&cf->hist);
+        // serials are increasing from oldest to newest
+        struct ChatHist *h = cf->hist.newest;
+        while (h && h->serial > m->serial) h = h->next;
+        if (!h || h->serial != m->serial) continue; // dropped from history
+        PRINT("%s  %12.12s @ %-12.12s | %s", fmttime(h->time), h->name, cf->title, h->msg);
+    }
+    PRINT("%s", "------------ MENTIONS   END --------------")
+}
+
+void _print_hist_memory(const char *name, struct History *hist) {
+    size_t before, after;
+    hist_block_bytes(hist, &before, &after);
+    PRINT("%-16.16s %8zu %8zu %10.1f %10.1f", name, hist->count, hist->packed_count, before / 1024.0, after / 1024.0);
+}
+
+void command_memory(int narg, char **args) {
+    PRINT("#Compressed history(contact|items|packed items|packed KB before|after):");
+    for (struct Friend *f = friends; f; f = f->next) {
+        _print_hist_memory(f->name, &f->hist);
+    }
+    for (struct Group *cf = groups; cf; cf = cf->next) {
+        _print_hist_memory(cf->title ? cf->title : "", &cf->hist);
+    }
+    PRINT("%-15s%.1fKB for %.1fKB of text", "Msg bodies:", body_store.bytes / 1024.0, body_store.text_bytes / 1024.0);
+}
+
+// a counter per call, or "-" if it's unavailable.
+const char *_per_call(char *buf, int counter, struct PerfStats *st) {
+    if (perf.slot[counter] == -1) return "-";
+    sprintf(buf, "%.0f", (double)st->counters[counter] / st->calls);
+    return buf;
+}
+
+void command_stats(int narg, char **args) {
+    if (!perf.enabled) {
+        WARN("^ start minitox with `--perf` to collect stats");
+        return;
+    }
+    if (narg > 0 && strcmp(args[0], "reset") == 0) {
+        memset(perf.stats, 0, sizeof(perf.stats));
+        PRINT("* Stats reset");
+        return;
+    }
+    if (perf.nr < PERF_COUNTER_COUNT) PRINT("%d hardware counters are unavailable: %s", PERF_COUNTER_COUNT - perf.nr, perf.unavailable);
+    PRINT("#Per call(section|calls|avg us|max us|cycles|instructions|IPC|cache misses|branch misses):");
+    for (int i = 0; i < PERF_SECTION_COUNT; i++) {
+        struct PerfStats *st = &perf.stats[i];
+        if (st->calls == 0) continue;
+        char cycles[24], instructions[24], cache_misses[24], branch_misses[24], ipc[24] = "-";
+        if (perf.slot[PERF_CYCLES] != -1 && perf.slot[PERF_INSTRUCTIONS] != -1 && st->counters[PERF_CYCLES] > 0) {
+            sprintf(ipc, "%.2f", (double)st->counters[PERF_INSTRUCTIONS] / st->counters[PERF_CYCLES]);
+        }
+        PRINT("%-26s %8llu %8.1f %8.1f %10s %12s %5s %8s %8s", perf_section_names[i], (unsigned long long)st->calls,
+              st->ns / 1e3 / st->calls, st->max_ns / 1e3, _per_call(cycles, PERF_CYCLES, st),
+              _per_call(instructions, PERF_INSTRUCTIONS, st), ipc, _per_call(cache_misses, PERF_CACHE_MISSES, st),
+              _per_call(branch_misses, PERF_BRANCH_MISSES, st));
+    }
+}
+
+void command_allocstats(int narg, char **args) {
+    print_alloc_profile(NULL);
+}
+
+void command_reload(int narg, char **args) {
+    load_config(true);
+}
+
+void command_paste(int narg, char **args) {
+    if (!view || view->talking_to == TALK_TYPE_NULL) {
+        WARN("^ Not talking to anyone, `/go` to a contact first");
+        return;
+    }
+    FILE *fp = fopen(args[0], "rb");
+    if (!fp) {
+        ERROR("! Open %s failed", args[0]);
+        return;
+    }
+    char *buf = malloc(MAX_LARGE_MESSAGE_SIZE + 1);
+    size_t len = fread(buf, 1, MAX_LARGE_MESSAGE_SIZE + 1, fp);
+    fclose(fp);
+    if (len > MAX_LARGE_MESSAGE_SIZE) {
+        WARN("^ File too large, at most %d bytes", MAX_LARGE_MESSAGE_SIZE);
+    } else if (len == 0 || memchr(buf, '\0', len)) {
+        WARN("^ Not a text file");
+    } else {
+        send_message(view->talking_to, buf, len, view);
+    }
+    free(buf);
 }
 
 #define COMMAND_ARGS_REST 10
@@ -1195,7 +4899,7 @@ struct Command commands[] = {
     },
     {
         "history",
-        "[<n>] - show previous <n> items(default:10) of current chat history",
+        "[<n>|more] - show the first <n> items(default:20) of current chat history, `more` for the next ones",
         0 + COMMAND_ARGS_REST,
         command_history,
     },
@@ -1223,12 +4927,271 @@ struct Command commands[] = {
         2,
         command_settitle,
     },
+    {
+        "plugins",
+        "- list loaded plugins, and how much time their hooks took.",
+        0,
+        command_plugins,
+    },
+    {
+        "trigger",
+        "<keyword> <reply|cmd|notify> <text> - when an incoming message contains <keyword>, reply <text>, run command <text>, or notify with <text>.",
+        3,
+        command_trigger,
+    },
+    {
+        "triggers",
+        "- list triggers.",
+        0,
+        command_triggers,
+    },
+    {
+        "untrigger",
+        "<id> - delete a trigger.",
+        1,
+        command_untrigger,
+    },
+    {
+        "highlight",
+        "[<keyword>] - also take group messages containing <keyword> as mentions, or list highlighted keywords.",
+        0 + COMMAND_ARGS_REST,
+        command_highlight,
+    },
+    {
+        "unhighlight",
+        "<keyword> - stop highlighting <keyword>.",
+        1,
+        command_unhighlight,
+    },
+    {
+        "mentions",
+        "[<n>] - show the latest <n> group messages which mentioned you(default:20).",
+        0 + COMMAND_ARGS_REST,
+        command_mentions,
+    },
+    {
+        "paste",
+        "<file> - send a text file as one message to the current contact, compressed if it's another minitox.",
+        1,
+        command_paste,
+    },
+    {
+        "memory",
+        "- show how much memory compressing history not read for a while saved, per contact.",
+        0,
+        command_memory,
+    },
+    {
+        "stats",
+        "[reset] - show hardware counters of the main loop and callbacks per call, with `--perf`. `reset` to start over.",
+        0 + COMMAND_ARGS_REST,
+        command_stats,
+    },
+    {
+        "allocstats",
+        "- show the top allocators by count and bytes, with `make ALLOC_PROFILE=1`.",
+        0,
+        command_allocstats,
+    },
+    {
+        "reload",
+        "- re-read settings from the config file(also done on SIGHUP), without reconnecting.",
+        0,
+        command_reload,
+    },
 };
 
 void command_help(int narg, char **args){
     for (int i=1;i<COMMAND_LENGTH;i++) {
-        printf("%-16s%s\n", commands[i].name, commands[i].desc);
+        PRINT("%-16s%s", commands[i].name, commands[i].desc);
+    }
+}
+
+/*******************************************************************************
+ *
+ * Daemon & Attach
+ *
+ ******************************************************************************/
+
+int server_fd = -1;
+
+void server_exit(void) {
+    unlink(socket_filename);
+}
+
+void setup_server(void) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_filename, sizeof(addr.sun_path) - 1);
+
+    server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        fputs("! create socket failed\n", stderr);
+        exit(1);
+    }
+    unlink(socket_filename); // left by a previous run
+    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server_fd, 8) == -1) {
+        fprintf(stderr, "! listen on %s failed: %s\n", socket_filename, strerror(errno));
+        exit(1);
+    }
+    int flags = fcntl(server_fd, F_GETFL, 0);
+    fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void daemonize(void) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        fputs("! fork failed\n", stderr);
+        exit(1);
+    }
+    if (pid > 0) {
+        printf("minitox is running in background(pid %d), use `minitox --attach` to attach.\n", (int)pid);
+        exit(0);
+    }
+    setsid();
+    int fd = open("/dev/null", O_RDWR);
+    if (fd != -1) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO) close(fd);
+    }
+    signal(SIGPIPE, SIG_IGN);  // clients may go away at any time
+    atexit(server_exit);
+}
+
+void accept_clients(void) {
+    if (server_fd == -1) return;
+    int fd;
+    while ((fd = accept(server_fd, NULL, NULL)) != -1) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        new_view(fd, fd, true, false);  // until it tells what it wants by `ATTACH tty|json`
+    }
+}
+
+// the first line from a client.
+void client_handshake(struct View *v, const char *line) {
+    v->handshaked = true;
+    if (strcmp(line, "ATTACH json") == 0) {
+        v->json = true;
+        v->repl.prompt[0] = '\0';
+    } else if (strcmp(line, "ATTACH tty") == 0) {
+        PRINT("Type `/guide` to print the guide.");
+        PRINT("Type `/help` to print command list.\n");
+    } else {
+        v->closing = true;
+    }
+}
+
+// runs in the `--attach` process: relay the terminal(or stdin) to the daemon and back.
+int attach_main(bool json) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_filename, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "! connect to %s failed, is `minitox --daemon` running?\n", socket_filename);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    bool tty = !json && isatty(STDIN_FILENO);
+    if (tty) {  // line editing is done by the daemon, pass keys as they are typed
+        struct termios tattr;
+        tcgetattr(STDIN_FILENO, &tattr);
+        saved_tattr = tattr;
+        tattr.c_lflag &= ~(ICANON|ECHO);
+        tattr.c_cc[VMIN] = 1;
+        tattr.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &tattr);
+        NEW_STDIN_FILENO = STDIN_FILENO;
+        atexit(arepl_exit);
+    }
+
+    const char *hello = json ? "ATTACH json\n" : "ATTACH tty\n";
+    write_all(fd, hello, strlen(hello));
+
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    char buf[4096];
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) break;  // detached or daemon exited
+            write_all(STDOUT_FILENO, buf, n);
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) {   // input ended, but still wait for what's left to come
+                shutdown(fd, SHUT_WR);
+                fds[0].fd = -1;
+                continue;
+            }
+            write_all(fd, buf, n);
+        }
+    }
+    if (tty) fputs("\n", stdout);
+    close(fd);
+    return 0;
+}
+
+/*******************************************************************************
+ *
+ * Shutdown
+ *
+ ******************************************************************************/
+
+/// On SIGTERM, SIGINT or Ctrl-D, minitox quits in order: it stops taking input,
+/// gives the messages just sent(large ones too, see PACKET_LARGE_ACK) up to
+/// SHUTDOWN_DEADLINE_MS to be received, saves once, and kills tox, so that
+/// friends see it going offline instead of timing out. Writers(the event log,
+/// file writes) are flushed at exit. A second signal quits at once.
+
+volatile sig_atomic_t shutdown_requested = 0;
+
+void on_shutdown_signal(int sig) {
+    if (shutdown_requested) _exit(1);
+    shutdown_requested = 1;
+}
+
+bool outbound_pending(void) {
+    for (struct Friend *f = friends; f; f = f->next) {
+        if ((f->unreceipted > 0 || f->unacked > 0) && f->connection != TOX_CONNECTION_NONE) return true;
+    }
+    return false;
+}
+
+void shutdown_minitox(void) {
+    uint64_t start = mono_ns();
+    uint64_t deadline = start + SHUTDOWN_DEADLINE_MS * 1000000ULL;
+    INFO("* Shutting down ...");
+
+    if (server_fd != -1) {  // no more clients, and views aren't read from now on
+        close(server_fd);
+        server_fd = -1;
+    }
+    flush_views();
+
+    while (outbound_pending() && mono_ns() < deadline) {
+        tox_iterate(tox, NULL);
+        struct timespec pause = {0, tox_iteration_interval(tox) * 1000000L};
+        nanosleep(&pause, NULL);
     }
+    bool drained = !outbound_pending();
+
+    update_savedata_file();
+    flush_file_writes();
+    unload_plugins();
+    tox_kill(tox);
+    tox = NULL;
+
+    INFO("* Shut down in %.1fms%s", (mono_ns() - start) / 1e6, drained ? "" : ", some sent messages may be lost");
+    flush_views();
+    exit(0);
 }
 
 /*******************************************************************************
@@ -1248,102 +5211,199 @@ char *poptok(char **strp) {
     return save;
 }
 
-void repl_iterate(void){
+// run a command line, output goes to current view(or all views, if none).
+void run_command(char *line) {
+    if (line[0] == '/') {
+        char *l = line + 1; // skip leading '/'
+        char *cmdname = poptok(&l);
+        struct Command *cmd = NULL;
+        for (int j=0; j<COMMAND_LENGTH;j++){ // for_2
+            if (strcmp(commands[j].name, cmdname) == 0) {
+                cmd = &commands[j];
+                break; // break for_2
+            }
+        }
+        if (cmd) {
+            char *tokens[cmd->narg];
+            int ntok = 0;
+            for (; l != NULL && ntok != cmd->narg; ntok++) {
+                // if it's the last arg, then take the rest line.
+                char *tok = (ntok == cmd->narg - 1) ? l : poptok(&l);
+                tokens[ntok] = tok;
+            }
+            if (ntok < cmd->narg - (cmd->narg >= COMMAND_ARGS_REST ? COMMAND_ARGS_REST : 0)) {
+                WARN("Wrong number of cmd args");
+            } else {
+                cmd->handler(ntok, tokens);
+                if (config.save_after_command) update_savedata_file();
+            }
+            return;
+        }
+    }
+
+    WARN("! Invalid command, use `/help` to get list of available commands.");
+}
+
+// returns whether there was any input.
+bool view_iterate(struct View *v){
     static char buf[128];
     static char line[LINE_MAX_SIZE];
+    bool got = false;
     while (1) {
-        int n = read(NEW_STDIN_FILENO, buf, sizeof(buf));
-        if (n <= 0) {
+        int n = read(v->fd, buf, sizeof(buf));
+        if (n == 0 && v->is_client) v->closing = true;
+        if (n == -1 && v->is_client && errno != EAGAIN && errno != EINTR) v->closing = true;
+        if (n <= 0 || v->closing) {
             break;
         }
-        for (int i=0;i<n;i++) { // for_1
+        got = true;
+        for (int i=0;i<n && !v->closing;i++) { // for_1
             char c = buf[i];
-            if (c == '\004')          /* C-d */
-                exit(0);
-            if (!arepl_readline(async_repl, c, line, sizeof(line))) continue; // continue to for_1
+            if (c == '\004') {       /* C-d */
+                if (!v->is_client) shutdown_requested = 1;
+                else v->closing = true;  // detach
+                break;
+            }
+            if (!arepl_readline(&v->repl, c, line, sizeof(line))) continue; // continue to for_1
 
             int len = strlen(line);
             line[--len] = '\0'; // remove trailing \n
 
-            if (TalkingTo != TALK_TYPE_NULL && line[0] != '/') {  // if talking to someone, just print the msg out.
-                struct ChatHist **hp = get_current_histp();
-                if (!hp) {
+            if (!v->handshaked && v->is_client) {
+                client_handshake(v, line);
+                continue; // continue to for_1
+            }
+
+            if (v->talking_to != TALK_TYPE_NULL && line[0] != '/') {  // if talking to someone, just print the msg out.
+                if (!send_message(v->talking_to, line, len, v)) {
                     ERROR("! You are not talking to someone. use `/go` to return to cmd mode");
-                    continue; // continue to for_1
-                }
-                char *msg = genmsg(hp, SELF_MSG_PREFIX "%.*s", getftime(), self.name, len, line);
-                PRINT("%s", msg);
-                switch (INDEX_TO_TYPE(TalkingTo)) {
-                    case TALK_TYPE_FRIEND:
-                        tox_friend_send_message(tox, INDEX_TO_NUM(TalkingTo), TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)line, strlen(line), NULL);
-                        continue; // continue to for_1
-                    case TALK_TYPE_GROUP:
-                        tox_conference_send_message(tox, INDEX_TO_NUM(TalkingTo), TOX_MESSAGE_TYPE_NORMAL, (uint8_t*)line, strlen(line), NULL);
-                        continue;  // continue to for_1
                 }
+                continue; // continue to for_1
             }
 
-            PRINT(CMD_MSG_PREFIX "%s", line);  // take this input line as a command.
+            if (!v->json) PRINT(CMD_MSG_PREFIX "%s", line);  // take this input line as a command.
             if (len == 0) continue; // continue to for_1.  ignore empty line
 
-            if (line[0] == '/') {
-                char *l = line + 1; // skip leading '/'
-                char *cmdname = poptok(&l);
-                struct Command *cmd = NULL;
-                for (int j=0; j<COMMAND_LENGTH;j++){ // for_2
-                    if (strcmp(commands[j].name, cmdname) == 0) {
-                        cmd = &commands[j];
-                        break; // break for_2
-                    }
-                }
-                if (cmd) {
-                    char *tokens[cmd->narg];
-                    int ntok = 0;
-                    for (; l != NULL && ntok != cmd->narg; ntok++) {
-                        // if it's the last arg, then take the rest line.
-                        char *tok = (ntok == cmd->narg - 1) ? l : poptok(&l);
-                        tokens[ntok] = tok;
-                    }
-                    if (ntok < cmd->narg - (cmd->narg >= COMMAND_ARGS_REST ? COMMAND_ARGS_REST : 0)) {
-                        WARN("Wrong number of cmd args");
-                    } else {
-                        cmd->handler(ntok, tokens);
-                        if (SAVEDATA_AFTER_COMMAND) update_savedata_file();
-                    }
-                    continue; // continue to for_1
-                }
-            }
-
-            WARN("! Invalid command, use `/help` to get list of available commands.");
+            struct Event e = {EVENT_COMMAND, 0, TALK_TYPE_NULL};
+            e.text = line;
+            e.text_len = len;
+            e.source = v;
+            emit_event(&e);
+            run_command(line);
         } // end for_1
     } // end while
-    arepl_reprint(async_repl);
+    return got;
+}
+
+void repl_iterate(void){
+    accept_clients();
+    for (struct View *v = views, *next; v; v = next) {
+        next = v->next;
+        view = v;
+        bool got = view_iterate(v);
+        if (v->closing) {
+            del_view(v);
+        } else if (got || v->out.fresh) {
+            arepl_reprint(&v->repl);
+        } else if (v->out.len > 0) {
+            outbuf_flush(&v->out); // a slow client, try again
+        }
+    }
+    view = NULL;
+}
+
+// flush what callbacks printed to each view, and redraw the prompt
+void flush_views(void) {
+    for (view = views; view; view = view->next) {
+        if (view->out.dropped > 0 && view->out.len == 0) {
+            uint64_t dropped = view->out.dropped;
+            view->out.dropped = 0;
+            WARN("! %llu bytes of output were dropped, the client didn't keep up", (unsigned long long)dropped);
+        }
+        if (view->out.fresh) arepl_reprint(&view->repl);
+    }
 }
 
 
 int main(int argc, char **argv) {
-    if (argc == 2 && strcmp(argv[1], "--help") == 0) {
-        fputs("Usage: minitox\n", stdout);
-        fputs("\n", stdout);
-        fputs("Minitox does not take any arguments.\n", stdout);
-        return 0;
+    bool daemon_mode = false, attach_mode = false;
+    start_alloc_profile();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json_mode = true;
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            daemon_mode = true;
+        } else if (strcmp(argv[i], "--attach") == 0) {
+            attach_mode = true;
+        } else if (strcmp(argv[i], "--plugin") == 0 && i + 1 < argc) {
+            load_plugin(argv[++i]);
+        } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            open_eventlog(argv[++i]);
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            perf.enabled = true;
+        } else {
+            fputs("Usage: minitox [--json] [--daemon | --attach] [--plugin <path>]... [--log <file>] [--perf]\n", stdout);
+            fputs("\n", stdout);
+            fputs("  --json    read commands from stdin and print every event as one JSON object per line,\n", stdout);
+            fputs("            for bots and log pipelines. stdin & stdout needn't be a terminal.\n", stdout);
+            fputs("  --daemon  run in background, and let UI clients attach to it.\n", stdout);
+            fputs("  --attach  attach to a running daemon, Ctrl-D to detach. with --json, as a JSON client.\n", stdout);
+            fputs("  --plugin  load a plugin(shared object, see minitox_plugin.h), can be given more than once.\n", stdout);
+            fputs("  --log     append every event to <file> as JSON lines, rotated as it grows.\n", stdout);
+            fputs("  --perf    count cycles, instructions, cache & branch misses of the main loop and callbacks, see `/stats`.\n", stdout);
+            return strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0 ? 0 : 1;
+        }
     }
 
-    fputs("Type `/guide` to print the guide.\n", stdout);
-    fputs("Type `/help` to print command list.\n\n",stdout);
+    if (attach_mode) return attach_main(json_mode);
 
-    setup_arepl();
+    if (daemon_mode) {
+        setup_server();  // before forking, so that errors are still seen
+        daemonize();
+    } else {
+        if (!json_mode) {
+            fputs("Type `/guide` to print the guide.\n", stdout);
+            fputs("Type `/help` to print command list.\n\n",stdout);
+        }
+        setup_arepl();
+    }
+    start_eventlog();
+    start_perf();
+    load_config(false);
     setup_tox();
+    init_plugins();
+    // a terminal going away still hangs up minitox, as usual
+    if (!isatty(STDIN_FILENO)) signal(SIGHUP, on_sighup);
+    signal(SIGTERM, on_shutdown_signal);
+    signal(SIGINT, on_shutdown_signal);
 
     INFO("* Waiting to be online ...");
 
     uint32_t msecs = 0;
+    time_t cold_scan_at = 0;
     while (1) {
+        if (shutdown_requested) shutdown_minitox();
+        if (reload_requested) {
+            reload_requested = 0;
+            load_config(true);
+        }
         if (msecs >= AREPL_INTERVAL) {
             msecs = 0;
+            struct PerfSample s;
+            perf_begin(&s);
             repl_iterate();
+            perf_end(&s, PERF_REPL_ITERATE);
+            if (coarse_time() >= cold_scan_at) {
+                freeze_cold_hists();
+                cold_scan_at = coarse_time() + COLD_SCAN_INTERVAL;
+            }
         }
+        struct PerfSample s;
+        perf_begin(&s);
         tox_iterate(tox, NULL);
+        perf_end(&s, PERF_TOX_ITERATE);
+        poll_file_writes(false);
+        flush_views();
         uint32_t v = tox_iteration_interval(tox);
         msecs += v;
 
@@ -0,0 +1,63 @@
+/*
+ * MiniTox plugin interface
+ *
+ * A plugin is a shared object loaded by `minitox --plugin <path>`. It exports
+ * `minitox_plugin_init`, which gets the API minitox offers and returns the
+ * hooks it wants to be called with. Build one with:
+ *
+ *     cc -std=c99 -shared -fPIC -o myplugin.so myplugin.c
+ *
+ * Hooks are called from minitox's main loop, so they must return quickly:
+ * every call is timed, and the ones over PLUGIN_CALL_BUDGET_US are counted
+ * and reported in `/plugins`.
+ */
+
+#ifndef MINITOX_PLUGIN_H
+#define MINITOX_PLUGIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MINITOX_PLUGIN_ABI 1 // bumped on any incompatible change of the structs below
+
+#define MINITOX_CONTACT_NONE UINT32_MAX // contact index of yourself, or of no one
+
+// What minitox offers to plugins, valid until the plugin is unloaded.
+struct MinitoxAPI {
+    uint32_t abi;
+    void *tox;  // the `Tox *` instance, for everything not wrapped here
+
+    // send a message to a contact(friend or group), as if it was typed.
+    void (*send_message)(uint32_t contact, const char *text, size_t len);
+    // print a line to all attached UIs.
+    void (*log)(const char *fmt, ...);
+};
+
+// Hooks of a plugin, each one may be NULL.
+//
+// `text` points into minitox's own buffers: it is not NUL-terminated, and only
+// valid during the call. Copy it if needed later.
+// Messages sent by a plugin itself from inside a hook are not hooked again.
+struct MinitoxPlugin {
+    uint32_t abi;       // MINITOX_PLUGIN_ABI
+    const char *name;
+    void *ctx;          // passed back to every hook
+
+    // incoming and outgoing messages. `contact` is the index used by `/go`.
+    void (*on_message)(void *ctx, uint32_t contact, bool outgoing, const char *name, const char *text, size_t len);
+    // connection changes of friends, or of yourself(contact is MINITOX_CONTACT_NONE).
+    // `connection` is a TOX_CONNECTION value.
+    void (*on_connection)(void *ctx, uint32_t contact, int connection);
+    // command lines typed in any UI, with the leading '/'.
+    void (*on_command)(void *ctx, const char *text, size_t len);
+    // called before minitox exits.
+    void (*unload)(void *ctx);
+};
+
+#define MINITOX_PLUGIN_INIT "minitox_plugin_init"
+
+// the one symbol a plugin exports. return NULL to refuse to load.
+typedef const struct MinitoxPlugin *minitox_plugin_init_fn(const struct MinitoxAPI *api);
+
+#endif
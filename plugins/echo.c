@@ -0,0 +1,41 @@
+/*
+ * An example minitox plugin: echo back every message from friends.
+ *
+ *     make plugins
+ *     ./minitox --plugin plugins/echo.so
+ */
+
+#include <stdio.h>
+
+#include "../minitox_plugin.h"
+
+#define CONTACT_IS_GROUP(_contact) ((_contact) % 2 == 1) // see GEN_INDEX in minitox.c
+
+static const struct MinitoxAPI *api;
+static unsigned long echoed = 0;
+
+static void on_message(void *ctx, uint32_t contact, bool outgoing, const char *name, const char *text, size_t len) {
+    if (outgoing || CONTACT_IS_GROUP(contact)) return;
+    api->send_message(contact, text, len);
+    echoed++;
+}
+
+static void unload(void *ctx) {
+    api->log("* echo: %lu messages echoed", echoed);
+}
+
+static const struct MinitoxPlugin plugin = {
+    MINITOX_PLUGIN_ABI,
+    "echo",
+    NULL,
+    on_message,
+    NULL,
+    NULL,
+    unload,
+};
+
+const struct MinitoxPlugin *minitox_plugin_init(const struct MinitoxAPI *a) {
+    if (a->abi != MINITOX_PLUGIN_ABI) return NULL;
+    api = a;
+    return &plugin;
+}